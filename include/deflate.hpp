@@ -0,0 +1,31 @@
+#ifndef hpce_deflate_hpp
+#define hpce_deflate_hpp
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace hpce{
+
+	//! Compress one piece of a raw deflate stream (RFC 1951), appending to dst
+	/*! Each piece is compressed independently and ends on a byte boundary, so pieces
+		compressed in parallel can simply be concatenated. Every piece except the
+		last should be compressed with final=false, which ends it with an empty
+		stored block (a "sync flush"); the last piece must use final=true.
+		\param maxChain Longest hash chain searched for each match. Small values
+			are faster, large values compress better.
+	*/
+	void DeflatePiece(const uint8_t *src, size_t n, bool final, std::vector<uint8_t> &dst, unsigned maxChain=8);
+
+	//! Update an Adler-32 checksum (as used by zlib streams) with more data
+	uint32_t Adler32(uint32_t adler, const uint8_t *src, size_t n);
+
+	//! Adler-32 of the concatenation of two pieces, given the checksum of each and the length of the second
+	uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, uint64_t len2);
+
+	//! Update a CRC-32 checksum (as used by png chunks) with more data
+	uint32_t Crc32(uint32_t crc, const uint8_t *src, size_t n);
+
+};
+
+#endif
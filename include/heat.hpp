@@ -20,6 +20,9 @@ namespace hpce{
 	}cell_flags_t;
 	
 	//! Captures the description of a world, and it's current state
+	/*! Each dimension fits in 32 bits, but the total number of cells may not, so
+		anything that indexes properties or state should go through CellIndex.
+	*/
 	struct world_t
 	{
 		// Fixed properties of the world
@@ -33,6 +36,15 @@ namespace hpce{
 		std::vector<float> state;		//! Dynamic state of the world
 	};
 	
+	//! Linear index of the cell at (x,y) in a world of width w
+	/*! Computed in size_t, so worlds with more than 2^32 cells don't wrap around */
+	inline size_t CellIndex(unsigned x, unsigned y, unsigned w)
+	{ return (size_t)y*w + x; }
+	
+	//! Total number of cells in a w x h world
+	/*! Throws std::length_error if the state of such a world couldn't be addressed on this platform */
+	size_t WorldCells(unsigned w, unsigned h);
+	
 	//! Create a square world with a standardised "slalom track"
 	world_t MakeTestWorld(unsigned n, float alpha);
 	
@@ -48,6 +60,64 @@ namespace hpce{
 	*/
 	void RenderWorld(const std::string &fileName, const world_t &world);
 	
+	//! Write pixels that have already been rendered (e.g. on an OpenCL device) as a bitmap
+	/*! scanlines holds h rows of w BGR pixels, the first row first, each followed
+		by (4-w%4)%4 bytes of padding, exactly as RenderWorld writes them.
+		\param fileName Either the name of the file, or "-" for stdout
+	*/
+	void WriteBitmap(const std::string &fileName, unsigned w, unsigned h, const uint8_t *scanlines);
+	
+	//! Render the world as an indexed colour png to the specified file
+	/*! Looks the same as the bitmap from RenderWorld, but is typically much smaller.
+		If every heat level and insulators all appear, which is one colour too many
+		for a palette, the png is RGB instead.
+		\param fileName Either the name of the file, or "-" for stdout
+	*/
+	void RenderWorldPng(const std::string &fileName, const world_t &world);
+	
+	//! How DownsampleWorld combines the temperatures of the cells under each pixel
+	typedef enum{
+		Filter_Box,	//! Mean temperature of the conductive cells
+		Filter_Max	//! Hottest conductive cell
+	}downsample_filter_t;
+	
+	//! Shrink a world to w x h cells for rendering, in a single pass over the original
+	/*! Any insulator under a pixel makes the whole pixel an insulator, so that thin
+		walls stay visible however far the world is shrunk, and fixed cells become
+		ordinary cells. The result is only meant for rendering, not stepping.
+		\param w Target width, or zero to keep the aspect ratio
+		\param h Target height, or zero to keep the aspect ratio
+		\note The world is never scaled up, so the result may be smaller than requested
+	*/
+	world_t DownsampleWorld(const world_t &world, unsigned w, unsigned h, downsample_filter_t filter=Filter_Box);
+	
+	//! The size DownsampleWorld would shrink a srcW x srcH world to when asked for w x h
+	void DownsampleSize(unsigned srcW, unsigned srcH, unsigned &w, unsigned &h);
+	
+	//! Render the world as a pyramid of png tiles, for zoomable viewers
+	/*! Tiles go in dirName/z/x_y.png, where level 0 is the whole world in a single
+		tile, each level doubles the resolution, and the last level is full size.
+		Tile 0_0 is at the top left of the picture, as with the other renderers.
+		dirName/pyramid.txt lists the size of each level.
+	*/
+	void RenderWorldPyramid(const std::string &dirName, const world_t &world, unsigned tileSize=256, downsample_filter_t filter=Filter_Box);
+	
+	//! Render a world file without loading the whole world into memory
+	/*! Binary world files are read a band of rows at a time (mapped where the
+		platform allows), so the world can be larger than memory; text world files
+		are loaded as usual. The output format follows dstName as in render_world:
+		a name ending in / gives a pyramid (with w as the tile size), .png gives a
+		png, and anything else a bitmap. If w or h is non-zero the picture is
+		downsampled as by DownsampleWorld. Pyramids are built a band of rows at a
+		time too, so only a couple of tile rows per level are held, and every cell
+		is checked as LoadWorld would check it.
+		\note Binary files don't record the world time, so it is taken as zero
+	*/
+	void RenderWorldFile(const std::string &dstName, const std::string &srcName, unsigned w=0, unsigned h=0, downsample_filter_t filter=Filter_Box);
+	
+	//! True if fileName ends in .png (in any case), which is how render_world picks the format
+	bool IsPngName(const std::string &fileName);
+	
 	//! Reference world stepping program
 	/*! \param dt Amount to step the world by.  Note that large steps will be unstable.
 		\param n Number of times to step
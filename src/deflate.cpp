@@ -0,0 +1,481 @@
+#include "deflate.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <queue>
+#include <cstring>
+
+// A small, dependency free deflate encoder. It does greedy LZ77 matching with
+// short hash chains and dynamic Huffman blocks, which is all we need to get
+// rendered images down to a sensible size quickly. It makes no attempt to
+// compete with zlib's higher compression levels.
+
+namespace hpce{
+
+namespace{
+
+	const unsigned Window_Size=32768;
+	const unsigned Min_Match=3;
+	const unsigned Max_Match=258;
+	const unsigned Nice_Match=128;		// Stop searching once a match is this long
+	const unsigned Max_Insert=16;			// Don't bother hashing every position within longer matches
+	const unsigned Hash_Bits=15;
+	const unsigned Block_Tokens=1<<16;	// Symbols per Huffman block
+
+	const unsigned Num_LitLen=286;
+	const unsigned Num_Dist=30;
+	const unsigned Num_CodeLen=19;
+	const unsigned End_Of_Block=256;
+
+	const unsigned short len_base[29]={3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+	const unsigned char len_extra[29]={0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+	const unsigned short dist_base[30]={1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+	const unsigned char dist_extra[30]={0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+	const unsigned char codelen_order[19]={16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+	//! Either a literal (dist==0) or a back-reference
+	struct token_t
+	{
+		uint16_t len;		//! Literal byte value, or match length
+		uint16_t dist;	//! Match distance, or zero for a literal
+	};
+
+	unsigned LenSymbol(unsigned len)
+	{
+		unsigned i=28;
+		while(len_base[i]>len)
+			i--;
+		return i;
+	}
+
+	unsigned DistSymbol(unsigned dist)
+	{
+		unsigned i=29;
+		while(dist_base[i]>dist)
+			i--;
+		return i;
+	}
+
+	//! Packs bits LSB first into a byte vector
+	struct bit_writer_t
+	{
+		std::vector<uint8_t> &dst;
+		uint64_t bits;
+		unsigned count;
+
+		bit_writer_t(std::vector<uint8_t> &_dst)
+			: dst(_dst), bits(0), count(0)
+		{}
+
+		void Put(uint32_t value, unsigned len)
+		{
+			bits |= (uint64_t)value << count;
+			count += len;
+			while(count>=8){
+				dst.push_back((uint8_t)bits);
+				bits>>=8;
+				count-=8;
+			}
+		}
+
+		void Align()
+		{
+			if(count>0)
+				Put(0, 8-count);
+		}
+	};
+
+	//! Work out Huffman code lengths for the given frequencies, limited to maxLen bits
+	void BuildLengths(const uint32_t *freq, unsigned n, unsigned maxLen, uint8_t *lengths)
+	{
+		std::vector<uint32_t> f(freq, freq+n);
+		while(true){
+			std::fill(lengths, lengths+n, 0);
+
+			typedef std::pair<uint64_t,unsigned> node_t;	// (weight, node)
+			std::priority_queue<node_t, std::vector<node_t>, std::greater<node_t> > heap;
+			std::vector<unsigned> parent(2*n, 0);
+			unsigned next=n;
+			for(unsigned i=0;i<n;i++){
+				if(f[i])
+					heap.push(node_t(f[i], i));
+			}
+			if(heap.size()==0)
+				return;
+			if(heap.size()==1){
+				lengths[heap.top().second]=1;
+				return;
+			}
+			while(heap.size()>1){
+				node_t a=heap.top(); heap.pop();
+				node_t b=heap.top(); heap.pop();
+				parent[a.second]=next;
+				parent[b.second]=next;
+				heap.push(node_t(a.first+b.first, next));
+				next++;
+			}
+			unsigned root=next-1;
+
+			// Depth of each internal node, which are created in increasing order so
+			// walking down from the root sees each parent before its children
+			std::vector<unsigned> depth(2*n, 0);
+			for(unsigned i=root;i-- > n;){
+				depth[i]=depth[parent[i]]+1;
+			}
+			bool ok=true;
+			for(unsigned i=0;i<n;i++){
+				if(f[i]){
+					unsigned d=depth[parent[i]]+1;
+					lengths[i]=(uint8_t)d;
+					if(d>maxLen)
+						ok=false;
+				}
+			}
+			if(ok)
+				return;
+
+			// Flatten the distribution and try again; this always terminates as
+			// all used symbols eventually have the same weight
+			for(unsigned i=0;i<n;i++){
+				if(f[i])
+					f[i]=(f[i]>>1)|1;
+			}
+		}
+	}
+
+	//! Canonical codes for the given lengths, bit-reversed ready for LSB first output
+	void BuildCodes(const uint8_t *lengths, unsigned n, uint16_t *codes)
+	{
+		unsigned blCount[16]={0};
+		for(unsigned i=0;i<n;i++){
+			blCount[lengths[i]]++;
+		}
+		blCount[0]=0;
+		unsigned nextCode[16]={0};
+		unsigned code=0;
+		for(unsigned bits=1;bits<16;bits++){
+			code=(code+blCount[bits-1])<<1;
+			nextCode[bits]=code;
+		}
+		for(unsigned i=0;i<n;i++){
+			unsigned len=lengths[i];
+			if(len){
+				unsigned c=nextCode[len]++;
+				unsigned r=0;
+				for(unsigned b=0;b<len;b++){
+					r=(r<<1)|((c>>b)&1);
+				}
+				codes[i]=(uint16_t)r;
+			}else{
+				codes[i]=0;
+			}
+		}
+	}
+
+	//! Make sure at least two symbols are used, so every tree is complete
+	void EnsureTwoSymbols(uint32_t *freq, unsigned n)
+	{
+		unsigned used=0;
+		for(unsigned i=0;i<n;i++){
+			if(freq[i])
+				used++;
+		}
+		for(unsigned i=0;(i<n) && (used<2);i++){
+			if(!freq[i]){
+				freq[i]=1;
+				used++;
+			}
+		}
+	}
+
+	//! Empty stored block, which flushes to a byte boundary
+	void PutEmptyStored(bit_writer_t &out, bool final)
+	{
+		out.Put(final?1:0, 1);
+		out.Put(0, 2);
+		out.Align();
+		out.Put(0x0000, 16);
+		out.Put(0xFFFF, 16);
+	}
+
+	//! Copy raw bytes out as one or more (non-final) stored blocks
+	void PutStored(bit_writer_t &out, const uint8_t *src, size_t n)
+	{
+		while(n>0){
+			unsigned todo=(unsigned)std::min<size_t>(n, 65535);
+			out.Put(0, 1);
+			out.Put(0, 2);
+			out.Align();
+			out.Put(todo, 16);
+			out.Put(~todo & 0xFFFF, 16);
+			out.dst.insert(out.dst.end(), src, src+todo);
+			src+=todo;
+			n-=todo;
+		}
+	}
+
+	//! Emit a (non-final) block for the given tokens, which cover raw bytes [src,src+n)
+	void PutBlock(bit_writer_t &out, const std::vector<token_t> &tokens, const uint8_t *src, size_t n)
+	{
+		uint32_t litFreq[Num_LitLen]={0};
+		uint32_t distFreq[Num_Dist]={0};
+		for(size_t i=0;i<tokens.size();i++){
+			if(tokens[i].dist==0){
+				litFreq[tokens[i].len]++;
+			}else{
+				litFreq[257+LenSymbol(tokens[i].len)]++;
+				distFreq[DistSymbol(tokens[i].dist)]++;
+			}
+		}
+		litFreq[End_Of_Block]++;
+		EnsureTwoSymbols(litFreq, Num_LitLen);
+		EnsureTwoSymbols(distFreq, Num_Dist);
+
+		uint8_t litLen[Num_LitLen], distLen[Num_Dist];
+		uint16_t litCode[Num_LitLen], distCode[Num_Dist];
+		BuildLengths(litFreq, Num_LitLen, 15, litLen);
+		BuildLengths(distFreq, Num_Dist, 15, distLen);
+		BuildCodes(litLen, Num_LitLen, litCode);
+		BuildCodes(distLen, Num_Dist, distCode);
+
+		unsigned hlit=Num_LitLen;
+		while(litLen[hlit-1]==0)
+			hlit--;
+		unsigned hdist=Num_Dist;
+		while(distLen[hdist-1]==0)
+			hdist--;
+
+		// Run-length encode the two sets of code lengths as one sequence
+		std::vector<uint8_t> lens(litLen, litLen+hlit);
+		lens.insert(lens.end(), distLen, distLen+hdist);
+		std::vector<std::pair<uint8_t,uint8_t> > rle;	// (symbol, extra bits value)
+		uint32_t clFreq[Num_CodeLen]={0};
+		for(size_t i=0;i<lens.size();){
+			size_t run=1;
+			while( (i+run<lens.size()) && (lens[i+run]==lens[i]) )
+				run++;
+			if(lens[i]==0 && run>=3){
+				run=std::min<size_t>(run, 138);
+				if(run>=11){
+					rle.push_back(std::make_pair(18, (uint8_t)(run-11)));
+				}else{
+					rle.push_back(std::make_pair(17, (uint8_t)(run-3)));
+				}
+			}else if(run>=4){
+				run=std::min<size_t>(run, 7);
+				rle.push_back(std::make_pair(lens[i], 0));
+				rle.push_back(std::make_pair(16, (uint8_t)(run-4)));
+			}else{
+				run=1;
+				rle.push_back(std::make_pair(lens[i], 0));
+			}
+			i+=run;
+		}
+		for(size_t i=0;i<rle.size();i++){
+			clFreq[rle[i].first]++;
+		}
+		uint8_t clLen[Num_CodeLen];
+		uint16_t clCode[Num_CodeLen];
+		BuildLengths(clFreq, Num_CodeLen, 7, clLen);
+		BuildCodes(clLen, Num_CodeLen, clCode);
+		unsigned hclen=Num_CodeLen;
+		while(hclen>4 && clLen[codelen_order[hclen-1]]==0)
+			hclen--;
+
+		// Work out whether it's worth it before committing to the output
+		uint64_t bits=3+5+5+4+3*hclen;
+		for(size_t i=0;i<rle.size();i++){
+			unsigned s=rle[i].first;
+			bits+=clLen[s] + (s==16 ? 2 : s==17 ? 3 : s==18 ? 7 : 0);
+		}
+		for(unsigned i=0;i<Num_LitLen;i++){
+			if(litFreq[i] && i>End_Of_Block){
+				bits+=(uint64_t)litFreq[i]*(litLen[i]+len_extra[i-257]);
+			}else{
+				bits+=(uint64_t)litFreq[i]*litLen[i];
+			}
+		}
+		for(unsigned i=0;i<Num_Dist;i++){
+			bits+=(uint64_t)distFreq[i]*(distLen[i]+dist_extra[i]);
+		}
+		if(bits/8 > n+5*(n/65535+1)){
+			PutStored(out, src, n);
+			return;
+		}
+
+		out.Put(0, 1);	// Not final
+		out.Put(2, 2);	// Dynamic Huffman
+		out.Put(hlit-257, 5);
+		out.Put(hdist-1, 5);
+		out.Put(hclen-4, 4);
+		for(unsigned i=0;i<hclen;i++){
+			out.Put(clLen[codelen_order[i]], 3);
+		}
+		for(size_t i=0;i<rle.size();i++){
+			unsigned s=rle[i].first;
+			out.Put(clCode[s], clLen[s]);
+			if(s==16){
+				out.Put(rle[i].second, 2);
+			}else if(s==17){
+				out.Put(rle[i].second, 3);
+			}else if(s==18){
+				out.Put(rle[i].second, 7);
+			}
+		}
+
+		for(size_t i=0;i<tokens.size();i++){
+			const token_t &t=tokens[i];
+			if(t.dist==0){
+				out.Put(litCode[t.len], litLen[t.len]);
+			}else{
+				unsigned ls=LenSymbol(t.len);
+				out.Put(litCode[257+ls], litLen[257+ls]);
+				out.Put(t.len-len_base[ls], len_extra[ls]);
+				unsigned ds=DistSymbol(t.dist);
+				out.Put(distCode[ds], distLen[ds]);
+				out.Put(t.dist-dist_base[ds], dist_extra[ds]);
+			}
+		}
+		out.Put(litCode[End_Of_Block], litLen[End_Of_Block]);
+	}
+
+	unsigned Hash3(const uint8_t *p)
+	{
+		return ((p[0]<<10) ^ (p[1]<<5) ^ p[2]) & ((1u<<Hash_Bits)-1);
+	}
+
+}; // anonymous namespace
+
+void DeflatePiece(const uint8_t *src, size_t n, bool final, std::vector<uint8_t> &dst, unsigned maxChain)
+{
+	bit_writer_t out(dst);
+
+	// Positions are stored +1, so that zero means "empty"
+	std::vector<size_t> head(1u<<Hash_Bits, 0);
+	std::vector<size_t> prev(Window_Size, 0);
+
+	std::vector<token_t> tokens;
+	tokens.reserve(Block_Tokens);
+	size_t blockStart=0;
+
+	size_t pos=0;
+	while(pos<n){
+		unsigned bestLen=0, bestDist=0;
+		if(pos+Min_Match<=n){
+			unsigned h=Hash3(src+pos);
+			size_t cand=head[h];
+			unsigned maxLen=(unsigned)std::min<size_t>(Max_Match, n-pos);
+			unsigned chain=maxChain;
+			while(cand && chain-- && bestLen<maxLen){
+				size_t c=cand-1;
+				if(pos-c > Window_Size)
+					break;
+				if(src[c+bestLen]==src[pos+bestLen]){
+					unsigned len=0;
+					while(len<maxLen && src[c+len]==src[pos+len])
+						len++;
+					if(len>bestLen){
+						bestLen=len;
+						bestDist=(unsigned)(pos-c);
+						if(len>=Nice_Match)
+							break;
+					}
+				}
+				size_t p=prev[c%Window_Size];
+				if(p>=cand)
+					break;	// Stale entry from an older pass round the window
+				cand=p;
+			}
+			prev[pos%Window_Size]=head[h];
+			head[h]=pos+1;
+		}
+
+		token_t t;
+		if(bestLen>=Min_Match){
+			t.len=(uint16_t)bestLen;
+			t.dist=(uint16_t)bestDist;
+			if(bestLen<=Max_Insert){
+				for(size_t i=pos+1;i<pos+bestLen && i+Min_Match<=n;i++){
+					unsigned h=Hash3(src+i);
+					prev[i%Window_Size]=head[h];
+					head[h]=i+1;
+				}
+			}
+			pos+=bestLen;
+		}else{
+			t.len=src[pos];
+			t.dist=0;
+			pos++;
+		}
+		tokens.push_back(t);
+
+		if(tokens.size()==Block_Tokens){
+			PutBlock(out, tokens, src+blockStart, pos-blockStart);
+			tokens.clear();
+			blockStart=pos;
+		}
+	}
+	if(tokens.size()>0){
+		PutBlock(out, tokens, src+blockStart, n-blockStart);
+	}
+
+	PutEmptyStored(out, final);
+}
+
+uint32_t Adler32(uint32_t adler, const uint8_t *src, size_t n)
+{
+	const uint32_t base=65521;
+	uint32_t a=adler&0xFFFF, b=adler>>16;
+	while(n>0){
+		// 5552 is the most bytes that can be summed before b could overflow
+		size_t todo=std::min<size_t>(n, 5552);
+		for(size_t i=0;i<todo;i++){
+			a+=src[i];
+			b+=a;
+		}
+		a%=base;
+		b%=base;
+		src+=todo;
+		n-=todo;
+	}
+	return (b<<16)|a;
+}
+
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, uint64_t len2)
+{
+	const uint32_t base=65521;
+	uint32_t rem=(uint32_t)(len2%base);
+	uint32_t a1=adler1&0xFFFF, b1=adler1>>16;
+	uint32_t a2=adler2&0xFFFF, b2=adler2>>16;
+	uint32_t a=(a1+a2+base-1)%base;
+	uint32_t b=(uint32_t)(((uint64_t)rem*a1 + b1 + b2 + base - rem)%base);
+	return (b<<16)|a;
+}
+
+uint32_t Crc32(uint32_t crc, const uint8_t *src, size_t n)
+{
+	struct crc_table_t
+	{
+		uint32_t entries[256];
+
+		crc_table_t()
+		{
+			for(uint32_t i=0;i<256;i++){
+				uint32_t c=i;
+				for(unsigned k=0;k<8;k++){
+					c = (c&1) ? (0xEDB88320u ^ (c>>1)) : (c>>1);
+				}
+				entries[i]=c;
+			}
+		}
+	};
+	static const crc_table_t table;
+
+	crc=~crc;
+	for(size_t i=0;i<n;i++){
+		crc=table.entries[(crc^src[i])&0xFF] ^ (crc>>8);
+	}
+	return ~crc;
+}
+
+}; // namespace hpce
@@ -6,20 +6,33 @@
 #include <memory>
 #include <cstdio>
 #include <string>
+#include <limits>
 
 namespace hpce{
+
+//! Total number of cells in a w x h world
+size_t WorldCells(unsigned w, unsigned h)
+{
+	// Both dimensions are 32-bit, so the product always fits in 64 bits, but the
+	// byte size of the state might not fit in a size_t (e.g. 32-bit builds).
+	uint64_t cells=(uint64_t)w*h;
+	if(cells > std::numeric_limits<size_t>::max()/sizeof(float))
+		throw std::length_error("WorldCells : World is too large to be addressed on this platform.");
+	return (size_t)cells;
+}
 	
 //! Create a square world with a standardised "slalom track"
 world_t MakeTestWorld(unsigned n, float alpha)
 {	
-	std::vector<cell_flags_t> properties(n*n, (cell_flags_t)0);
+	size_t cells=WorldCells(n, n);
+	std::vector<cell_flags_t> properties(cells, (cell_flags_t)0);
 	
 	// Top, bottom, left, right boundary
 	for(unsigned i=0;i<n;i++){
-		properties[0*n+i]=Cell_Insulator;
-		properties[(n-1)*n+i]=Cell_Insulator;
-		properties[i*n+0]=Cell_Insulator;
-		properties[i*n+(n-1)]=Cell_Insulator;
+		properties[CellIndex(i,0,n)]=Cell_Insulator;
+		properties[CellIndex(i,n-1,n)]=Cell_Insulator;
+		properties[CellIndex(0,i,n)]=Cell_Insulator;
+		properties[CellIndex(n-1,i,n)]=Cell_Insulator;
 	}
 	
 	// Setup the corridors
@@ -29,31 +42,31 @@ world_t MakeTestWorld(unsigned n, float alpha)
 	
 	// Horizontal branches
 	for(unsigned i=0;i<high;i++){
-		properties[low*n+i]=Cell_Insulator;
+		properties[CellIndex(i,low,n)]=Cell_Insulator;
 	}
 	for(unsigned i=low;i<n;i++){
-		properties[high*n+i]=Cell_Insulator;
+		properties[CellIndex(i,high,n)]=Cell_Insulator;
 	}
 	// Vertical spurs
 	for(unsigned i=low;i<mid;i++){
-		properties[i*n+high]=Cell_Insulator;
+		properties[CellIndex(high,i,n)]=Cell_Insulator;
 	}
 	for(unsigned i=mid;i<high;i++){
-		properties[i*n+low]=Cell_Insulator;
+		properties[CellIndex(low,i,n)]=Cell_Insulator;
 	}
 	
 	// Create state, all intially at ambient temperature
-	std::vector<float> state(n*n, 0.0f);
+	std::vector<float> state(cells, 0.0f);
 	
 	// Create a band of constant heart source along the top
 	for(unsigned x=1;x<n-1;x++){
 		// Heat source
-		state[1*n+x]=1.0f;
-		properties[1*n+x]=Cell_Fixed;
+		state[CellIndex(x,1,n)]=1.0f;
+		properties[CellIndex(x,1,n)]=Cell_Fixed;
 	}
 	// And a point heat-sink in the mid bottom
-	state[(n-3)*n+mid]=0.0f;
-	properties[(n-3)*n+mid]=Cell_Fixed;
+	state[CellIndex(mid,n-3,n)]=0.0f;
+	properties[CellIndex(mid,n-3,n)]=Cell_Fixed;
 	
 	// Now populate the actual world description
 	world_t world;
@@ -84,10 +97,10 @@ void SaveWorld(std::ostream &dst, const world_t &world, bool binary)
 	
 	for(unsigned y=0;y<world.h;y++){
 		if(binary){
-			dst.write((char*)&world.properties[y*world.w], world.w*4);
+			dst.write((char*)&world.properties[CellIndex(0,y,world.w)], (std::streamsize)world.w*4);
 		}else{
 			for(unsigned x=0;x<world.w;x++){
-				dst<<" "<<world.properties[y*world.w+x];
+				dst<<" "<<world.properties[CellIndex(x,y,world.w)];
 			}
 			dst<<std::endl;
 		}
@@ -109,10 +122,10 @@ void SaveWorld(std::ostream &dst, const world_t &world, bool binary)
 	
 	for(unsigned y=0;y<world.h;y++){
 		if(binary){
-			dst.write((char*)&world.state[y*world.w], world.w*4);
+			dst.write((char*)&world.state[CellIndex(0,y,world.w)], (std::streamsize)world.w*4);
 		}else{
 			for(unsigned x=0;x<world.w;x++){
-				dst<<" "<<world.state[y*world.w+x];
+				dst<<" "<<world.state[CellIndex(x,y,world.w)];
 			}
 			dst<<std::endl;
 		}
@@ -144,8 +157,10 @@ world_t LoadWorld(std::istream &src)
 	if(!src.good())
 		throw std::invalid_argument("LoadWorld : Corrupt input file, couldn't write initial world state (width, height, alpha).");
 	
-	world.properties.resize(world.w*world.h);
-	world.state.resize(world.w*world.h);
+	// Check the size before trying to allocate anything
+	size_t cells=WorldCells(world.w, world.h);
+	world.properties.resize(cells);
+	world.state.resize(cells);
 	
 	char delim;
 	src>>delim;
@@ -155,9 +170,9 @@ world_t LoadWorld(std::istream &src)
 	
 	for(unsigned y=0;y<world.h;y++){
 		if(binary){
-			src.read((char*)&world.properties[y*world.w], world.w*4);
+			src.read((char*)&world.properties[CellIndex(0,y,world.w)], (std::streamsize)world.w*4);
 			for(unsigned x=0;x<world.w;x++){
-				unsigned flags=world.properties[y*world.w+x];
+				unsigned flags=world.properties[CellIndex(x,y,world.w)];
 				if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed)){
 					std::cerr<<"y="<<y<<", x="<<x<<", flags="<<flags<<"\n";
 					throw std::invalid_argument("LoadWorld : Unknown flags for cell.");
@@ -169,7 +184,7 @@ world_t LoadWorld(std::istream &src)
 				src>>flags;
 				if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed))
 					throw std::invalid_argument("LoadWorld : Unknown flags for cell.");
-				world.properties[y*world.w+x]=(cell_flags_t)flags;
+				world.properties[CellIndex(x,y,world.w)]=(cell_flags_t)flags;
 			}
 		}
 	}
@@ -183,19 +198,19 @@ world_t LoadWorld(std::istream &src)
 	
 	for(unsigned y=0;y<world.h;y++){
 		if(binary){
-			src.read((char*)&world.state[y*world.w], world.w*4);
+			src.read((char*)&world.state[CellIndex(0,y,world.w)], (std::streamsize)world.w*4);
 			for(unsigned x=0;x<world.w;x++){
-				float temp=world.state[y*world.w+x];
-				if(temp<0 || temp>1)
+				float temp=world.state[CellIndex(x,y,world.w)];
+				if(!(temp>=0 && temp<=1))	// NaN fails too
 					throw std::invalid_argument("LoadWorld : Corrupt input file, temperature out of range.");
 			}
 		}else{
 			for(unsigned x=0;x<world.w;x++){
 				float temp;
 				src>>temp;
-				if(temp<0 || temp>1)
+				if(!(temp>=0 && temp<=1))	// NaN fails too
 					throw std::invalid_argument("LoadWorld : Corrupt input file, temperature out of range.");
-				world.state[y*world.w+x]=temp;
+				world.state[CellIndex(x,y,world.w)]=temp;
 			}
 		}
 	}
@@ -210,106 +225,6 @@ world_t LoadWorld(std::istream &src)
 	return world;
 }
 
-void RenderWorld(const std::string &fileName, const world_t &world)
-{
-	// The solution to doing BITMAPINFOHEADER etc. without being platform-specific
-	// comes from:
-	//   http://stackoverflow.com/a/18675807
-	// In practise you would never do this, but it's the easiest way to stay platform independent fo
-	// coursework purposes.
-
-	uint8_t file[14] = {
-		'B','M', // magic
-		0,0,0,0, // size in bytes
-		0,0, // app data
-		0,0, // app data
-		40+14,0,0,0 // start of data offset
-	};
-	uint8_t info[40] = {
-		40,0,0,0, // info hd size
-		0,0,0,0, // width
-		0,0,0,0, // heigth
-		1,0, // number color planes
-		24,0, // bits per pixel
-		0,0,0,0, // compression is none
-		0,0,0,0, // image bits size
-		0x13,0x0B,0,0, // horz resoluition in pixel / m
-		0x13,0x0B,0,0, // vert resolutions (0x03C3 = 96 dpi, 0x0B13 = 72 dpi)
-		0,0,0,0, // #colors in pallete
-		0,0,0,0, // #important colors
-		};
-
-	unsigned w=world.w;
-	unsigned h=world.h;
-
-	unsigned padSize  = (4-w%4)%4;
-	unsigned sizeData = w*h*3 + h*padSize;
-	unsigned sizeAll  = sizeData + sizeof(file) + sizeof(info);
-
-	file[ 2] = (uint8_t)( sizeAll    );
-	file[ 3] = (uint8_t)( sizeAll>> 8);
-	file[ 4] = (uint8_t)( sizeAll>>16);
-	file[ 5] = (uint8_t	)( sizeAll>>24);
-		
-	info[ 4] = (uint8_t)( w   );
-	info[ 5] = (uint8_t)( w>> 8);
-	info[ 6] = (uint8_t)( w>>16);
-	info[ 7] = (uint8_t)( w>>24);
-
-	info[ 8] = (uint8_t)( h    );
-	info[ 9] = (uint8_t)( h>> 8);
-	info[10] = (uint8_t)( h>>16);
-	info[11] = (uint8_t)( h>>24);
-
-	info[24] = (uint8_t)( sizeData    );
-	info[25] = (uint8_t)( sizeData>> 8);
-	info[26] = (uint8_t)( sizeData>>16);
-	info[27] = (uint8_t)( sizeData>>24);
-		
-	// End stackoverflow excerpt
-
-	FILE *dst=stdout;
-	if(fileName!="-"){
-		dst=fopen(fileName.c_str(), "wb");
-		if(dst==0)
-			throw std::runtime_error("RenderWorld : Couldn't open destination file.");
-	}
-	try{
-		if(sizeof(file)!=fwrite(file, 1, sizeof(file), dst))
-			throw std::runtime_error("RenderWorld : Couldn't write bitmap header.");
-		
-		if(sizeof(info)!=fwrite(info, 1, sizeof(info), dst))
-			throw std::runtime_error("RenderWorld : Couldn't write bitmap info.");
-		
-		std::vector<uint8_t> scanline(w*3+padSize, 0);
-		
-		for(unsigned y=0;y<h;y++){
-			uint8_t *pDst=&scanline[0];
-			for(unsigned x=0;x<w;x++){
-				unsigned index=y*w+x;
-				if(world.properties[index]&Cell_Insulator){
-					*pDst++ = 0;
-					*pDst++ = 255;
-					*pDst++ = 0;
-				}else{
-					uint8_t heat=(uint8_t)(world.state[index]*255);
-					*pDst++ = (255-heat);	// Blue
-					*pDst++ = 0; // Green
-					*pDst++ = heat; // Red
-				}
-			}
-			if(scanline.size()!=fwrite(&scanline[0], 1, scanline.size(), dst))
-				throw std::runtime_error("RenderWorld : Couldn't write scanline.");
-		}
-		
-		if(dst!=stdout)
-			fclose(dst);
-	}catch(...){
-		if(dst!=stdout)
-			fclose(dst);
-	}
-}
-
 //! Reference world stepping program
 /*! \param dt Amount to step the world by.  Note that large steps will be unstable.
 	\param n Number of times to step the world
@@ -323,12 +238,12 @@ void StepWorld(world_t &world, float dt, unsigned n)
 	float inner=1-outer/4;				// Anything that doesn't spread stays
 	
 	// This is our temporary working space
-	std::vector<float> buffer(w*h);
+	std::vector<float> buffer(WorldCells(w, h));
 	
 	for(unsigned t=0;t<n;t++){
 		for(unsigned y=0;y<h;y++){
 			for(unsigned x=0;x<w;x++){
-				unsigned index=y*w + x;
+				size_t index=CellIndex(x,y,w);
 				
 				if((world.properties[index] & Cell_Fixed) || (world.properties[index] & Cell_Insulator)){
 					// Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
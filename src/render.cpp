@@ -0,0 +1,1074 @@
+#include "heat.hpp"
+#include "deflate.hpp"
+
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <memory>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <functional>
+#include <fstream>
+#include <cerrno>
+#include <cctype>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Binary world files are mapped a band at a time where possible, and read otherwise
+#if defined(__unix__) || defined(__APPLE__)
+#define HPCE_HAVE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace hpce{
+
+namespace{
+
+	//! Colour code used for insulators, one past the 256 heat levels
+	const unsigned Code_Insulator=256;
+
+	//! Lookup table from colour code to BGR triple
+	struct colour_lut_t
+	{
+		uint8_t bgr[Code_Insulator+1][3];
+
+		colour_lut_t()
+		{
+			for(unsigned heat=0;heat<256;heat++){
+				bgr[heat][0]=(uint8_t)(255-heat);	// Blue
+				bgr[heat][1]=0;	// Green
+				bgr[heat][2]=(uint8_t)heat;	// Red
+			}
+			bgr[Code_Insulator][0]=0;
+			bgr[Code_Insulator][1]=255;
+			bgr[Code_Insulator][2]=0;
+		}
+	};
+
+	//! Convert one row of cells into colour codes
+	/*! Heat levels are quantised exactly as (uint8_t)(state*255), and insulators
+		are then masked in with Code_Insulator, so there is no branch per cell.
+		The codes index tables, so temperatures outside [0,1] are clamped, and NaN
+		is drawn as cold, whatever the world came from.
+	*/
+	void RenderCodes(unsigned w, const float *state, const cell_flags_t *properties, uint16_t *codes)
+	{
+		unsigned x=0;
+#if defined(__SSE2__)
+		const __m128 scale=_mm_set1_ps(255.0f);
+		const __m128 zero=_mm_setzero_ps();
+		const __m128i insulator=_mm_set1_epi32(Cell_Insulator);
+		const __m128i insulatorCode=_mm_set1_epi32(Code_Insulator);
+		for(;x+8<=w;x+=8){
+			// maxps gives its second operand if either is NaN, so NaN becomes zero
+			__m128 flo=_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(state+x), scale), zero), scale);
+			__m128 fhi=_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(state+x+4), scale), zero), scale);
+			__m128i lo=_mm_cvttps_epi32(flo);
+			__m128i hi=_mm_cvttps_epi32(fhi);
+
+			__m128i mlo=_mm_and_si128(_mm_loadu_si128((const __m128i*)(properties+x)), insulator);
+			__m128i mhi=_mm_and_si128(_mm_loadu_si128((const __m128i*)(properties+x+4)), insulator);
+			mlo=_mm_cmpeq_epi32(mlo, insulator);
+			mhi=_mm_cmpeq_epi32(mhi, insulator);
+
+			lo=_mm_or_si128(_mm_andnot_si128(mlo, lo), _mm_and_si128(mlo, insulatorCode));
+			hi=_mm_or_si128(_mm_andnot_si128(mhi, hi), _mm_and_si128(mhi, insulatorCode));
+
+			// All codes are in [0,256], so the signed saturating pack is exact
+			_mm_storeu_si128((__m128i*)(codes+x), _mm_packs_epi32(lo, hi));
+		}
+#endif
+		for(;x<w;x++){
+			float level=state[x]*255;
+			uint16_t heat = level>0 ? (uint16_t)std::min(level, 255.0f) : 0;	// False for NaN
+			uint16_t mask=(properties[x]&Cell_Insulator) ? 0xFFFF : 0;
+			codes[x]=(heat & ~mask) | (Code_Insulator & mask);
+		}
+	}
+
+	//! Expand one row of colour codes to BGR pixels
+	void ExpandCodes(unsigned w, const uint16_t *codes, const colour_lut_t &lut, uint8_t *pDst)
+	{
+		for(unsigned x=0;x<w;x++){
+			const uint8_t *bgr=lut.bgr[codes[x]];
+			pDst[0]=bgr[0];
+			pDst[1]=bgr[1];
+			pDst[2]=bgr[2];
+			pDst+=3;
+		}
+	}
+
+	//! Number of threads to render with, from HPCE_RENDER_THREADS or the hardware
+	unsigned RenderThreads()
+	{
+		if(getenv("HPCE_RENDER_THREADS")){
+			int n=atoi(getenv("HPCE_RENDER_THREADS"));
+			if(n>0)
+				return n;
+		}
+		unsigned n=std::thread::hardware_concurrency();
+		return n ? n : 1;
+	}
+
+	//! Number of bands to split h rows into, at most one per thread
+	unsigned BandCount(unsigned h)
+	{
+		const unsigned minBandRows=16;	// Not worth starting a thread for less
+
+		unsigned nBands=RenderThreads();
+		if(nBands > (h+minBandRows-1)/minBandRows)
+			nBands=(h+minBandRows-1)/minBandRows;
+		return nBands ? nBands : 1;
+	}
+
+	//! Split rows [0,h) into nBands contiguous bands, and call f(band,y0,y1) for each band in parallel
+	template<class TFunc>
+	void ParallelBands(unsigned h, unsigned nBands, const TFunc &f)
+	{
+		if(nBands<=1){
+			f(0u, 0u, h);
+			return;
+		}
+
+		std::vector<std::thread> threads;
+		std::vector<std::exception_ptr> errors(nBands);
+		for(unsigned i=0;i<nBands;i++){
+			unsigned y0=(unsigned)((uint64_t)h*i/nBands);
+			unsigned y1=(unsigned)((uint64_t)h*(i+1)/nBands);
+			threads.push_back(std::thread([&f,&errors,i,y0,y1](){
+				try{
+					f(i, y0, y1);
+				}catch(...){
+					errors[i]=std::current_exception();
+				}
+			}));
+		}
+		for(unsigned i=0;i<nBands;i++){
+			threads[i].join();
+		}
+		for(unsigned i=0;i<nBands;i++){
+			if(errors[i])
+				std::rethrow_exception(errors[i]);
+		}
+	}
+
+	//! Filter one png row of n bytes, picking whichever standard filter has the smallest output
+	/*! Uses the usual minimum sum of absolute differences heuristic. prev is the
+		previous png row, or null for the first row of the image.
+		\param bpp Bytes per pixel, which is how far back the byte to the left is
+		\param dst Receives the filter type byte followed by n filtered bytes
+	*/
+	void FilterPngRow(size_t n, unsigned bpp, const uint8_t *row, const uint8_t *prev, uint8_t *dst, std::vector<uint8_t> &scratch)
+	{
+		scratch.resize(n*5);
+		uint8_t *cand[5];
+		uint64_t cost[5]={0};
+		for(unsigned f=0;f<5;f++){
+			cand[f]=&scratch[n*f];
+		}
+		for(size_t x=0;x<n;x++){
+			int a = x>=bpp ? row[x-bpp] : 0;
+			int b = prev ? prev[x] : 0;
+			int c = (prev && x>=bpp) ? prev[x-bpp] : 0;
+
+			int p=a+b-c, pa=std::abs(p-a), pb=std::abs(p-b), pc=std::abs(p-c);
+			int paeth = (pa<=pb && pa<=pc) ? a : (pb<=pc) ? b : c;
+
+			cand[0][x]=row[x];
+			cand[1][x]=(uint8_t)(row[x]-a);
+			cand[2][x]=(uint8_t)(row[x]-b);
+			cand[3][x]=(uint8_t)(row[x]-((a+b)>>1));
+			cand[4][x]=(uint8_t)(row[x]-paeth);
+			for(unsigned f=0;f<5;f++){
+				cost[f]+=std::abs((int)(int8_t)cand[f][x]);
+			}
+		}
+		unsigned best=0;
+		for(unsigned f=1;f<5;f++){
+			if(cost[f]<cost[best])
+				best=f;
+		}
+		dst[0]=(uint8_t)best;
+		memcpy(dst+1, cand[best], n);
+	}
+
+	void PutBigEndian32(std::vector<uint8_t> &dst, uint32_t x)
+	{
+		dst.push_back((uint8_t)(x>>24));
+		dst.push_back((uint8_t)(x>>16));
+		dst.push_back((uint8_t)(x>>8));
+		dst.push_back((uint8_t)(x));
+	}
+
+	//! Append a png chunk (length, type, data, crc) to dst
+	void PutPngChunk(std::vector<uint8_t> &dst, const char *type, const uint8_t *data, size_t n)
+	{
+		PutBigEndian32(dst, (uint32_t)n);
+		size_t start=dst.size();
+		dst.insert(dst.end(), type, type+4);
+		dst.insert(dst.end(), data, data+n);
+		PutBigEndian32(dst, Crc32(0, &dst[start], n+4));
+	}
+
+	//! An output file (or stdout) that is written in a few large pieces
+	class output_t
+	{
+	private:
+		std::string m_who;
+		FILE *m_dst;
+
+		output_t(const output_t &);	// Not copyable
+		output_t &operator=(const output_t &);
+	public:
+		output_t(const std::string &fileName, const char *who)
+			: m_who(who)
+			, m_dst(stdout)
+		{
+			if(fileName!="-"){
+				m_dst=fopen(fileName.c_str(), "wb");
+				if(m_dst==0)
+					throw std::runtime_error(m_who+" : Couldn't open destination file.");
+			}
+		}
+
+		~output_t()
+		{
+			if(m_dst!=stdout)
+				fclose(m_dst);
+		}
+
+		void Write(const uint8_t *data, size_t n)
+		{
+			if(n!=fwrite(data, 1, n, m_dst))
+				throw std::runtime_error(m_who+" : Couldn't write image.");
+		}
+	};
+
+	//! Create a directory, which is fine if it already exists
+	void MakeDirectory(const std::string &dirName)
+	{
+#if defined(_WIN32)
+		int err=_mkdir(dirName.c_str());
+#else
+		int err=mkdir(dirName.c_str(), 0777);
+#endif
+		if(err!=0 && errno!=EEXIST)
+			throw std::runtime_error("MakeDirectory : Couldn't create directory '"+dirName+"'.");
+	}
+
+	void CheckWorldShape(const world_t &world, const char *who)
+	{
+		if( (world.state.size()!=WorldCells(world.w,world.h)) || (world.properties.size()!=WorldCells(world.w,world.h)) )
+			throw std::invalid_argument(std::string(who)+" : World state and properties don't match its dimensions.");
+	}
+
+	//! A run of rows fetched from a row source, with row i starting at state+i*stride
+	struct rows_t
+	{
+		const float *state;
+		const cell_flags_t *properties;
+		size_t stride;
+
+		const float *State(unsigned i) const
+		{ return state+i*stride; }
+
+		const cell_flags_t *Properties(unsigned i) const
+		{ return properties+i*stride; }
+	};
+
+	//! Storage that a row source can copy rows into
+	/*! Each thread should have its own, and rows fetched into it are only valid
+		until it is next used.
+	*/
+	class row_buffer_t
+	{
+	private:
+		row_buffer_t(const row_buffer_t &);	// Not copyable
+		row_buffer_t &operator=(const row_buffer_t &);
+	public:
+		std::vector<float> state;
+		std::vector<cell_flags_t> properties;
+		std::ifstream file;
+
+		row_buffer_t()
+		{}
+	};
+
+	//! Something the renderers can read rows of cells from, a band at a time
+	class row_source_t
+	{
+	public:
+		unsigned w, h;
+		float alpha, t;
+
+		virtual ~row_source_t()
+		{}
+
+		//! Fetch rows [y0,y1), which stay valid until buffer is next used
+		virtual rows_t GetRows(unsigned y0, unsigned y1, row_buffer_t &buffer) const =0;
+
+		//! Throw if the rows can't actually be fetched
+		virtual void CheckShape(const char *) const
+		{}
+	};
+
+	//! Rows of a world that is already in memory
+	class memory_rows_t
+		: public row_source_t
+	{
+	private:
+		const world_t &m_world;
+	public:
+		memory_rows_t(const world_t &world)
+			: m_world(world)
+		{
+			w=world.w;
+			h=world.h;
+			alpha=world.alpha;
+			t=world.t;
+		}
+
+		void CheckShape(const char *who) const
+		{ CheckWorldShape(m_world, who); }
+
+		rows_t GetRows(unsigned y0, unsigned, row_buffer_t &) const
+		{
+			size_t index=CellIndex(0,y0,w);
+			rows_t res={ &m_world.state[index], &m_world.properties[index], w };
+			return res;
+		}
+	};
+
+	//! A window onto part of another source, used to cut out tiles
+	class window_rows_t
+		: public row_source_t
+	{
+	private:
+		const row_source_t &m_parent;
+		unsigned m_x0, m_y0;
+	public:
+		window_rows_t(const row_source_t &parent, unsigned x0, unsigned y0, unsigned _w, unsigned _h)
+			: m_parent(parent)
+			, m_x0(x0)
+			, m_y0(y0)
+		{
+			w=_w;
+			h=_h;
+			alpha=parent.alpha;
+			t=parent.t;
+		}
+
+		rows_t GetRows(unsigned y0, unsigned y1, row_buffer_t &buffer) const
+		{
+			rows_t res=m_parent.GetRows(m_y0+y0, m_y0+y1, buffer);
+			res.state+=m_x0;
+			res.properties+=m_x0;
+			return res;
+		}
+	};
+
+	//! Rows read straight out of a binary world file
+	/*! Only the header is read up front. Where possible each fetch maps just the
+		rows it needs, so nothing is held in memory beyond the band being drawn.
+		Rows are copied out of the file into the buffer, as the arrays start
+		wherever the text of the header leaves them, and every cell is checked as
+		LoadWorld would.
+	*/
+	class file_rows_t
+		: public row_source_t
+	{
+	private:
+		std::string m_fileName;
+		uint64_t m_propertiesOffset, m_stateOffset;
+#if defined(HPCE_HAVE_MMAP)
+		int m_fd;
+#endif
+	public:
+		file_rows_t(const std::string &fileName)
+			: m_fileName(fileName)
+#if defined(HPCE_HAVE_MMAP)
+			, m_fd(-1)
+#endif
+		{
+			std::ifstream src(fileName.c_str(), std::ios::in | std::ios::binary);
+			if(!src.is_open())
+				throw std::runtime_error("RenderWorldFile : Couldn't open '"+fileName+"'.");
+
+			// Same header as SaveWorld writes, then the two arrays back to back,
+			// separated by a hyphen
+			std::string header;
+			char delim=0;
+			src>>header>>w>>h>>alpha>>delim;
+			if(header!="HPCEHeatWorldV0Binary")
+				throw std::invalid_argument("RenderWorldFile : File is not a binary world.");
+			if(!src.good() || delim!='-')
+				throw std::invalid_argument("RenderWorldFile : Corrupt world header.");
+			t=0;	// Not recorded in the file
+
+			uint64_t cells=WorldCells(w, h);
+			m_propertiesOffset=(uint64_t)src.tellg();
+			m_stateOffset=m_propertiesOffset+cells*4+1;
+
+			src.seekg(0, std::ios::end);
+			if((uint64_t)src.tellg() < m_stateOffset+cells*4)
+				throw std::invalid_argument("RenderWorldFile : World file is truncated.");
+
+#if defined(HPCE_HAVE_MMAP)
+			m_fd=open(fileName.c_str(), O_RDONLY);
+			if(m_fd<0)
+				throw std::runtime_error("RenderWorldFile : Couldn't open '"+fileName+"'.");
+#endif
+		}
+
+		~file_rows_t()
+		{
+#if defined(HPCE_HAVE_MMAP)
+			if(m_fd>=0)
+				close(m_fd);
+#endif
+		}
+
+		rows_t GetRows(unsigned y0, unsigned y1, row_buffer_t &buffer) const
+		{
+			size_t n=(size_t)w*(y1-y0);
+			uint64_t offset=CellIndex(0,y0,w)*4;
+			rows_t res={ 0, 0, w };
+			if(n==0)
+				return res;
+			buffer.properties.resize(n);
+			buffer.state.resize(n);
+#if defined(HPCE_HAVE_MMAP)
+			// Mappings have to start on a page boundary, so neither array is
+			// aligned within them; they are copied out and unmapped straight away.
+			uint64_t page=sysconf(_SC_PAGESIZE);
+			void *dsts[2]={ &buffer.properties[0], &buffer.state[0] };
+			uint64_t starts[2]={ m_propertiesOffset+offset, m_stateOffset+offset };
+			for(unsigned i=0;i<2;i++){
+				uint64_t base=starts[i]-starts[i]%page;
+				size_t length=(size_t)(starts[i]-base)+n*4;
+				void *p=mmap(0, length, PROT_READ, MAP_SHARED, m_fd, (off_t)base);
+				if(p==MAP_FAILED)
+					throw std::runtime_error("RenderWorldFile : Couldn't map rows of world file.");
+				memcpy(dsts[i], (const uint8_t*)p+(starts[i]-base), n*4);
+				munmap(p, length);
+			}
+#else
+			if(!buffer.file.is_open()){
+				buffer.file.open(m_fileName.c_str(), std::ios::in | std::ios::binary);
+				if(!buffer.file.is_open())
+					throw std::runtime_error("RenderWorldFile : Couldn't open '"+m_fileName+"'.");
+			}
+			buffer.file.seekg(m_propertiesOffset+offset);
+			buffer.file.read((char*)&buffer.properties[0], n*4);
+			buffer.file.seekg(m_stateOffset+offset);
+			buffer.file.read((char*)&buffer.state[0], n*4);
+			if(!buffer.file.good())
+				throw std::runtime_error("RenderWorldFile : Couldn't read rows of world file.");
+#endif
+			// The same checks as LoadWorld, written so that NaN fails too
+			for(size_t i=0;i<n;i++){
+				unsigned flags=buffer.properties[i];
+				if((flags!=0) && (flags!=Cell_Insulator) && (flags!=Cell_Fixed))
+					throw std::invalid_argument("RenderWorldFile : Unknown flags for cell.");
+				float temp=buffer.state[i];
+				if(!(temp>=0 && temp<=1))
+					throw std::invalid_argument("RenderWorldFile : Corrupt world file, temperature out of range.");
+			}
+			res.properties=&buffer.properties[0];
+			res.state=&buffer.state[0];
+			return res;
+		}
+	};
+
+	//! How many rows to handle at a time, so that about bytesPerStripe bytes are held in memory
+	unsigned StripeRows(uint64_t bytesPerRow, unsigned h)
+	{
+		const uint64_t bytesPerStripe=64<<20;
+		uint64_t rows=std::max<uint64_t>(1, bytesPerStripe/std::max<uint64_t>(1, bytesPerRow));
+		return (unsigned)std::min<uint64_t>(rows, h);
+	}
+
+	//! Headers for a w x h bitmap, and the padding at the end of each scanline
+	/*! Throws std::length_error (blaming who) if the sizes don't fit in the headers */
+	unsigned BitmapHeader(unsigned w, unsigned h, uint8_t header[14+40], const char *who)
+	{
+		// The solution to doing BITMAPINFOHEADER etc. without being platform-specific
+		// comes from:
+		//   http://stackoverflow.com/a/18675807
+		// In practise you would never do this, but it's the easiest way to stay platform independent fo
+		// coursework purposes.
+
+		uint8_t file[14] = {
+			'B','M', // magic
+			0,0,0,0, // size in bytes
+			0,0, // app data
+			0,0, // app data
+			40+14,0,0,0 // start of data offset
+		};
+		uint8_t info[40] = {
+			40,0,0,0, // info hd size
+			0,0,0,0, // width
+			0,0,0,0, // heigth
+			1,0, // number color planes
+			24,0, // bits per pixel
+			0,0,0,0, // compression is none
+			0,0,0,0, // image bits size
+			0x13,0x0B,0,0, // horz resoluition in pixel / m
+			0x13,0x0B,0,0, // vert resolutions (0x03C3 = 96 dpi, 0x0B13 = 72 dpi)
+			0,0,0,0, // #colors in pallete
+			0,0,0,0, // #important colors
+			};
+
+		// The bitmap header only has 32 bits for sizes (and signed 32 bits for the
+		// dimensions), so work them out in 64 bits and refuse anything that doesn't fit,
+		// rather than silently writing a corrupt file.
+		unsigned padSize  = (4-w%4)%4;
+		uint64_t sizeData = ((uint64_t)w*3 + padSize)*h;
+		uint64_t sizeAll  = sizeData + sizeof(file) + sizeof(info);
+		if( (w>0x7FFFFFFFu) || (h>0x7FFFFFFFu) || (sizeAll>0xFFFFFFFFu) )
+			throw std::length_error(std::string(who)+" : World is too large to be stored as a bitmap.");
+
+		file[ 2] = (uint8_t)( sizeAll    );
+		file[ 3] = (uint8_t)( sizeAll>> 8);
+		file[ 4] = (uint8_t)( sizeAll>>16);
+		file[ 5] = (uint8_t	)( sizeAll>>24);
+
+		info[ 4] = (uint8_t)( w   );
+		info[ 5] = (uint8_t)( w>> 8);
+		info[ 6] = (uint8_t)( w>>16);
+		info[ 7] = (uint8_t)( w>>24);
+
+		info[ 8] = (uint8_t)( h    );
+		info[ 9] = (uint8_t)( h>> 8);
+		info[10] = (uint8_t)( h>>16);
+		info[11] = (uint8_t)( h>>24);
+
+		info[24] = (uint8_t)( sizeData    );
+		info[25] = (uint8_t)( sizeData>> 8);
+		info[26] = (uint8_t)( sizeData>>16);
+		info[27] = (uint8_t)( sizeData>>24);
+
+		// End stackoverflow excerpt
+
+		memcpy(header, file, sizeof(file));
+		memcpy(header+sizeof(file), info, sizeof(info));
+		return padSize;
+	}
+
+	void RenderBitmap(const std::string &fileName, const row_source_t &src)
+	{
+		unsigned w=src.w;
+		unsigned h=src.h;
+
+		uint8_t header[14+40];
+		unsigned padSize=BitmapHeader(w, h, header, "RenderWorld");
+
+		src.CheckShape("RenderWorld");
+
+		output_t dst(fileName, "RenderWorld");
+		dst.Write(header, sizeof(header));
+
+		// Scanlines are built a stripe at a time, with each band of the stripe
+		// rendered by a different thread, then the stripe is written in one go.
+		size_t cbScanline=(size_t)w*3+padSize;
+		unsigned stripeRows=StripeRows(cbScanline, h);
+		std::unique_ptr<uint8_t[]> pixels(new uint8_t[cbScanline*stripeRows]);
+
+		const colour_lut_t lut;
+
+		for(unsigned s0=0;s0<h;s0+=stripeRows){
+			unsigned s1=std::min(h, s0+stripeRows);
+			ParallelBands(s1-s0, BandCount(s1-s0), [&](unsigned, unsigned b0, unsigned b1){
+				row_buffer_t buffer;
+				rows_t rows=src.GetRows(s0+b0, s0+b1, buffer);
+				std::vector<uint16_t> codes(w);
+				for(unsigned i=b0;i<b1;i++){
+					uint8_t *pDst=&pixels[cbScanline*i];
+
+					RenderCodes(w, rows.State(i-b0), rows.Properties(i-b0), &codes[0]);
+					ExpandCodes(w, &codes[0], lut, pDst);
+					for(unsigned p=0;p<padSize;p++){
+						pDst[(size_t)w*3+p]=0;
+					}
+				}
+			});
+			dst.Write(&pixels[0], cbScanline*(s1-s0));
+		}
+	}
+
+	//! Encode a png, appending it to png
+	/*! The png uses indexed colour unless more than 256 colours appear. The image is built a stripe at a time, with the bands of each stripe filtered
+		and compressed in parallel. flush is called after each stripe with the bytes
+		so far, and may write and clear them.
+	*/
+	void EncodePng(const row_source_t &src, unsigned nThreads, std::vector<uint8_t> &png, const std::function<void(std::vector<uint8_t> &)> &flush)
+	{
+		unsigned w=src.w;
+		unsigned h=src.h;
+
+		if( (w==0) || (h==0) || (w>0x7FFFFFFFu) || (h>0x7FFFFFFFu) )
+			throw std::length_error("RenderWorldPng : World dimensions can't be stored as a png.");
+		src.CheckShape("RenderWorldPng");
+
+		unsigned stripeRows=StripeRows((uint64_t)w*(sizeof(float)+sizeof(cell_flags_t)+1), h);
+		unsigned nBands=std::min(nThreads, BandCount(stripeRows));
+
+		// First pass: find out which colour codes actually appear
+		std::vector<uint64_t> counts(Code_Insulator+1, 0);
+		for(unsigned s0=0;s0<h;s0+=stripeRows){
+			unsigned s1=std::min(h, s0+stripeRows);
+			std::vector<std::vector<uint64_t> > bandCounts(nBands, std::vector<uint64_t>(Code_Insulator+1, 0));
+			ParallelBands(s1-s0, nBands, [&](unsigned band, unsigned b0, unsigned b1){
+				row_buffer_t buffer;
+				rows_t rows=src.GetRows(s0+b0, s0+b1, buffer);
+				std::vector<uint16_t> codes(w);
+				std::vector<uint64_t> &bandCount=bandCounts[band];
+				for(unsigned i=b0;i<b1;i++){
+					RenderCodes(w, rows.State(i-b0), rows.Properties(i-b0), &codes[0]);
+					for(unsigned x=0;x<w;x++){
+						bandCount[codes[x]]++;
+					}
+				}
+			});
+			for(unsigned i=0;i<nBands;i++){
+				for(unsigned c=0;c<=Code_Insulator;c++){
+					counts[c]+=bandCounts[i][c];
+				}
+			}
+		}
+
+		// A palette only has room for 256 colours. If every heat level and insulators
+		// all appear, the image is written as RGB instead, which is bigger but still
+		// exactly the same picture as the bitmap.
+		unsigned nUsed=0;
+		for(unsigned c=0;c<=Code_Insulator;c++){
+			nUsed+=(counts[c]>0);
+		}
+		bool truecolour=(nUsed>256);
+		unsigned bpp=truecolour ? 3 : 1;
+		size_t cbRow=(size_t)w*bpp;
+
+		uint8_t codeToIndex[Code_Insulator+1]={0};
+		std::vector<uint8_t> palette;
+		const colour_lut_t lut;
+		for(unsigned c=0;c<=Code_Insulator && !truecolour;c++){
+			if(counts[c]>0){
+				codeToIndex[c]=(uint8_t)(palette.size()/3);
+				palette.push_back(lut.bgr[c][2]);
+				palette.push_back(lut.bgr[c][1]);
+				palette.push_back(lut.bgr[c][0]);
+			}
+		}
+
+		// Colour codes to the bytes of a png row, as palette indices or RGB triples
+		auto CodesToRow=[&](const std::vector<uint16_t> &codes, std::vector<uint8_t> &row){
+			if(truecolour){
+				for(unsigned x=0;x<w;x++){
+					const uint8_t *bgr=lut.bgr[codes[x]];
+					row[3*(size_t)x+0]=bgr[2];
+					row[3*(size_t)x+1]=bgr[1];
+					row[3*(size_t)x+2]=bgr[0];
+				}
+			}else{
+				for(unsigned x=0;x<w;x++){
+					row[x]=codeToIndex[codes[x]];
+				}
+			}
+		};
+
+		const uint8_t signature[8]={0x89,'P','N','G','\r','\n',0x1A,'\n'};
+		png.insert(png.end(), signature, signature+8);
+
+		std::vector<uint8_t> header;
+		PutBigEndian32(header, w);
+		PutBigEndian32(header, h);
+		header.push_back(8);	// Bit depth
+		header.push_back(truecolour ? 2 : 3);	// RGB or indexed colour
+		header.push_back(0);	// Deflate
+		header.push_back(0);	// Standard filters
+		header.push_back(0);	// Not interlaced
+		PutPngChunk(png, "IHDR", &header[0], header.size());
+		if(!truecolour){
+			PutPngChunk(png, "PLTE", &palette[0], palette.size());
+		}
+
+		// IDAT chunks concatenate, so the zlib wrapper and each band can go in their own
+		const uint8_t zlibHeader[2]={0x78, 0x01};
+		PutPngChunk(png, "IDAT", zlibHeader, 2);
+
+		// Second pass: each band filters and compresses its own rows into an
+		// independent piece of the deflate stream. The world is flipped so that the
+		// png looks the same as the bitmap, which is stored bottom-up, so png row r
+		// is world row h-1-r.
+		uint32_t adler=1;
+		const size_t maxChunk=1<<30;
+		for(unsigned s0=0;s0<h;s0+=stripeRows){
+			unsigned s1=std::min(h, s0+stripeRows);
+			std::vector<std::vector<uint8_t> > compressed(nBands);
+			std::vector<uint32_t> adlers(nBands);
+			std::vector<uint64_t> lengths(nBands, 0);
+			ParallelBands(s1-s0, nBands, [&](unsigned band, unsigned b0, unsigned b1){
+				unsigned r0=s0+b0, r1=s0+b1;
+				if(r0==r1){
+					adlers[band]=1;
+					return;
+				}
+				row_buffer_t buffer;
+				rows_t rows=src.GetRows(h-r1, h-r0, buffer);
+				std::vector<uint16_t> codes(w);
+				std::vector<uint8_t> row(cbRow), prev(cbRow), scratch;
+				std::vector<uint8_t> raw((cbRow+1)*(r1-r0));
+
+				// The first row of each band needs the row above it for filtering
+				if(r0>0){
+					row_buffer_t aboveBuffer;
+					rows_t above=src.GetRows(h-r0, h-r0+1, aboveBuffer);
+					RenderCodes(w, above.State(0), above.Properties(0), &codes[0]);
+					CodesToRow(codes, prev);
+				}
+				for(unsigned r=r0;r<r1;r++){
+					unsigned i=r1-1-r;	// Row within the fetched rows
+					RenderCodes(w, rows.State(i), rows.Properties(i), &codes[0]);
+					CodesToRow(codes, row);
+					FilterPngRow(cbRow, bpp, &row[0], r>0 ? &prev[0] : 0, &raw[(cbRow+1)*(r-r0)], scratch);
+					std::swap(row, prev);
+				}
+				adlers[band]=Adler32(1, &raw[0], raw.size());
+				lengths[band]=raw.size();
+				DeflatePiece(&raw[0], raw.size(), r1==h, compressed[band]);
+			});
+
+			for(unsigned i=0;i<nBands;i++){
+				adler=Adler32Combine(adler, adlers[i], lengths[i]);
+				for(size_t done=0;done<compressed[i].size();done+=maxChunk){
+					size_t todo=std::min(maxChunk, compressed[i].size()-done);
+					PutPngChunk(png, "IDAT", &compressed[i][done], todo);
+				}
+			}
+			flush(png);
+		}
+
+		std::vector<uint8_t> trailer;
+		PutBigEndian32(trailer, adler);
+		PutPngChunk(png, "IDAT", &trailer[0], trailer.size());
+		PutPngChunk(png, "IEND", 0, 0);
+	}
+
+	void RenderPng(const std::string &fileName, const row_source_t &src)
+	{
+		output_t dst(fileName, "RenderWorldPng");
+		std::vector<uint8_t> png;
+		EncodePng(src, RenderThreads(), png, [&](std::vector<uint8_t> &data){
+			dst.Write(&data[0], data.size());
+			data.clear();
+		});
+		dst.Write(&png[0], png.size());
+	}
+
+	world_t Downsample(const row_source_t &src, unsigned w, unsigned h, downsample_filter_t filter)
+	{
+		src.CheckShape("DownsampleWorld");
+
+		DownsampleSize(src.w, src.h, w, h);
+
+		world_t res;
+		res.w=w;
+		res.h=h;
+		res.alpha=src.alpha;
+		res.t=src.t;
+		res.properties.resize(WorldCells(w,h));
+		res.state.resize(WorldCells(w,h));
+
+		// Source column x lands in pixel xmap[x]; rows are mapped the same way
+		std::vector<unsigned> xmap(src.w);
+		for(unsigned x=0;x<src.w;x++){
+			xmap[x]=(unsigned)((uint64_t)x*w/src.w);
+		}
+
+		// Bands are split on output rows, and each source row is read exactly once
+		// by the band that owns the output row it lands in.
+		ParallelBands(h, BandCount(h), [&](unsigned, unsigned oy0, unsigned oy1){
+			std::vector<double> sum(w);
+			std::vector<uint64_t> count(w);
+			std::vector<float> hottest(w);
+			std::vector<uint8_t> insulator(w);
+			row_buffer_t buffer;
+
+			for(unsigned oy=oy0;oy<oy1;oy++){
+				std::fill(sum.begin(), sum.end(), 0.0);
+				std::fill(count.begin(), count.end(), 0);
+				std::fill(hottest.begin(), hottest.end(), 0.0f);
+				std::fill(insulator.begin(), insulator.end(), 0);
+
+				unsigned y0=(unsigned)(((uint64_t)oy*src.h+h-1)/h);
+				unsigned y1=(unsigned)(((uint64_t)(oy+1)*src.h+h-1)/h);
+				rows_t rows=src.GetRows(y0, y1, buffer);
+				for(unsigned y=y0;y<y1;y++){
+					const float *state=rows.State(y-y0);
+					const cell_flags_t *properties=rows.Properties(y-y0);
+					for(unsigned x=0;x<src.w;x++){
+						unsigned ox=xmap[x];
+						if(properties[x]&Cell_Insulator){
+							insulator[ox]=1;
+						}else{
+							sum[ox]+=state[x];
+							count[ox]++;
+							hottest[ox]=std::max(hottest[ox], state[x]);
+						}
+					}
+				}
+
+				size_t index=CellIndex(0,oy,w);
+				for(unsigned ox=0;ox<w;ox++){
+					// Any insulator makes the pixel an insulator, so thin walls don't vanish
+					res.properties[index+ox]=insulator[ox] ? Cell_Insulator : (cell_flags_t)0;
+					if(filter==Filter_Max){
+						res.state[index+ox]=hottest[ox];
+					}else{
+						res.state[index+ox]=count[ox] ? (float)(sum[ox]/count[ox]) : 0.0f;
+					}
+				}
+			}
+		});
+
+		return res;
+	}
+
+	//! One level of a pyramid being rendered, holding only the rows it still needs
+	struct pyramid_level_t
+	{
+		std::string dir;
+		unsigned w, h;
+		unsigned tilesX;
+		world_t band;	//! Rows [first,first+band.h) of the level
+		unsigned first;
+		unsigned written;	//! Rows whose tiles have been written
+		unsigned halved;	//! Rows that have been shrunk into the level below
+	};
+
+	//! Add the next n rows of level z, writing the tiles and shrinking the rows that this completes
+	/*! Tile rows are numbered from the top of the picture, which is the highest y,
+		so the first tile row to complete from y=0 is the last one, and may be short.
+		Rows are shrunk in pairs from y=0, exactly as Downsample would pair them in
+		the whole level.
+	*/
+	void AddPyramidRows(std::vector<pyramid_level_t> &levels, unsigned z, const rows_t &rows, unsigned n, unsigned tileSize, downsample_filter_t filter)
+	{
+		pyramid_level_t &level=levels[z];
+		for(unsigned i=0;i<n;i++){
+			level.band.state.insert(level.band.state.end(), rows.State(i), rows.State(i)+level.w);
+			level.band.properties.insert(level.band.properties.end(), rows.Properties(i), rows.Properties(i)+level.w);
+		}
+		level.band.h+=n;
+		unsigned have=level.first+level.band.h;
+		memory_rows_t band(level.band);
+
+		while(level.written<level.h){
+			unsigned end=level.h-(level.h-level.written-1)/tileSize*tileSize;
+			if(end>have)
+				break;
+			unsigned ty=(level.h-end)/tileSize;
+
+			// Each tile is small, so tiles are spread across threads rather than bands
+			ParallelBands(level.tilesX, std::min(RenderThreads(), level.tilesX), [&](unsigned, unsigned i0, unsigned i1){
+				std::vector<uint8_t> png;
+				for(unsigned tx=i0;tx<i1;tx++){
+					unsigned x0=tx*tileSize, x1=std::min(level.w, x0+tileSize);
+					window_rows_t tile(band, x0, level.written-level.first, x1-x0, end-level.written);
+					png.clear();
+					EncodePng(tile, 1, png, [](std::vector<uint8_t> &){});
+
+					output_t dst(level.dir+"/"+std::to_string(tx)+"_"+std::to_string(ty)+".png", "RenderWorldPyramid");
+					dst.Write(&png[0], png.size());
+				}
+			});
+			level.written=end;
+		}
+
+		if(z>0){
+			unsigned end = (have==level.h) ? have : level.halved+(have-level.halved)/2*2;
+			if(end>level.halved){
+				window_rows_t pairs(band, 0, level.halved-level.first, level.w, end-level.halved);
+				world_t shrunk=Downsample(pairs, (level.w+1)/2, (end-level.halved+1)/2, filter);
+				level.halved=end;
+				rows_t shrunkRows={ &shrunk.state[0], &shrunk.properties[0], shrunk.w };
+				AddPyramidRows(levels, z-1, shrunkRows, shrunk.h, tileSize, filter);
+			}
+		}
+
+		unsigned keep=std::min(level.written, z>0 ? level.halved : level.written);
+		size_t drop=(size_t)(keep-level.first)*level.w;
+		level.band.state.erase(level.band.state.begin(), level.band.state.begin()+drop);
+		level.band.properties.erase(level.band.properties.begin(), level.band.properties.begin()+drop);
+		level.band.h-=keep-level.first;
+		level.first=keep;
+	}
+
+	void RenderPyramid(const std::string &dirName, const row_source_t &src, unsigned tileSize, downsample_filter_t filter)
+	{
+		src.CheckShape("RenderWorldPyramid");
+		if(tileSize==0)
+			throw std::invalid_argument("RenderWorldPyramid : Tile size must be positive.");
+
+		// Level 0 fits in a single tile, and the last level is the full resolution world
+		unsigned levels=1;
+		while( ((uint64_t)tileSize<<(levels-1)) < std::max(src.w, src.h) )
+			levels++;
+
+		MakeDirectory(dirName);
+
+		// Each level halves the one above, rather than going back to the full world
+		std::vector<pyramid_level_t> pyramid(levels);
+		for(unsigned z=levels;z>0;z--){
+			pyramid_level_t &level=pyramid[z-1];
+			level.w = (z==levels) ? src.w : (pyramid[z].w+1)/2;
+			level.h = (z==levels) ? src.h : (pyramid[z].h+1)/2;
+			level.dir=dirName+"/"+std::to_string(z-1);
+			level.tilesX=(level.w+tileSize-1)/tileSize;
+			level.band.w=level.w;
+			level.band.h=0;
+			level.band.alpha=src.alpha;
+			level.band.t=src.t;
+			level.first=0;
+			level.written=0;
+			level.halved=0;
+			MakeDirectory(level.dir);
+		}
+
+		// The index records the size of every level, so a viewer knows which tiles exist
+		std::string index="HPCEHeatPyramidV0\n"+std::to_string(tileSize)+" "+std::to_string(levels)+"\n";
+		for(unsigned z=0;z<levels;z++){
+			const pyramid_level_t &level=pyramid[z];
+			unsigned tilesY=(level.h+tileSize-1)/tileSize;
+			index+=std::to_string(z)+" "+std::to_string(level.w)+" "+std::to_string(level.h)+" "+std::to_string(level.tilesX)+" "+std::to_string(tilesY)+"\n";
+		}
+
+		// The full resolution rows are streamed through every level at once. Each
+		// level only keeps the rows of its unfinished tile row and the next chunk,
+		// and each is half the width of the one above, so at most about twice
+		// (tileSize+chunkRows) rows of the full width are ever held.
+		unsigned chunkRows=std::min(tileSize, StripeRows((uint64_t)src.w*(sizeof(float)+sizeof(cell_flags_t)), src.h));
+		row_buffer_t buffer;
+		for(unsigned y0=0;y0<src.h;y0+=chunkRows){
+			unsigned y1=std::min(src.h, y0+chunkRows);
+			AddPyramidRows(pyramid, levels-1, src.GetRows(y0, y1, buffer), y1-y0, tileSize, filter);
+		}
+
+		output_t dst(dirName+"/pyramid.txt", "RenderWorldPyramid");
+		dst.Write((const uint8_t*)index.c_str(), index.size());
+	}
+
+}; // anonymous namespace
+
+void RenderWorld(const std::string &fileName, const world_t &world)
+{
+	RenderBitmap(fileName, memory_rows_t(world));
+}
+
+void RenderWorldPng(const std::string &fileName, const world_t &world)
+{
+	RenderPng(fileName, memory_rows_t(world));
+}
+
+void WriteBitmap(const std::string &fileName, unsigned w, unsigned h, const uint8_t *scanlines)
+{
+	uint8_t header[14+40];
+	unsigned padSize=BitmapHeader(w, h, header, "WriteBitmap");
+
+	output_t dst(fileName, "WriteBitmap");
+	dst.Write(header, sizeof(header));
+	dst.Write(scanlines, ((size_t)w*3+padSize)*h);
+}
+
+void DownsampleSize(unsigned srcW, unsigned srcH, unsigned &w, unsigned &h)
+{
+	// Zero means "keep the aspect ratio", and we never scale up
+	if(w==0 && h==0){
+		w=srcW;
+		h=srcH;
+	}else if(w==0){
+		w=(unsigned)std::max<uint64_t>(1, (uint64_t)srcW*h/std::max(1u, srcH));
+	}else if(h==0){
+		h=(unsigned)std::max<uint64_t>(1, (uint64_t)srcH*w/std::max(1u, srcW));
+	}
+	w=std::min(w, srcW);
+	h=std::min(h, srcH);
+}
+
+world_t DownsampleWorld(const world_t &world, unsigned w, unsigned h, downsample_filter_t filter)
+{
+	return Downsample(memory_rows_t(world), w, h, filter);
+}
+
+void RenderWorldPyramid(const std::string &dirName, const world_t &world, unsigned tileSize, downsample_filter_t filter)
+{
+	RenderPyramid(dirName, memory_rows_t(world), tileSize, filter);
+}
+
+void RenderWorldFile(const std::string &dstName, const std::string &srcName, unsigned w, unsigned h, downsample_filter_t filter)
+{
+	std::unique_ptr<row_source_t> src;
+	world_t world;
+	{
+		std::ifstream file(srcName.c_str(), std::ios::in | std::ios::binary);
+		if(!file.is_open())
+			throw std::runtime_error("RenderWorldFile : Couldn't open '"+srcName+"'.");
+		std::string header;
+		file>>header;
+		if(header=="HPCEHeatWorldV0Binary"){
+			src.reset(new file_rows_t(srcName));
+		}else{
+			// Text worlds have no fixed layout, so they have to be loaded
+			file.seekg(0);
+			world=LoadWorld(file);
+			src.reset(new memory_rows_t(world));
+		}
+	}
+
+	if(dstName.size()>1 && dstName[dstName.size()-1]=='/'){
+		RenderPyramid(dstName.substr(0, dstName.size()-1), *src, w ? w : 256, filter);
+		return;
+	}
+
+	bool png=IsPngName(dstName);
+	if(w || h){
+		// Only the (much smaller) downsampled world is ever held in memory
+		world_t small=Downsample(*src, w, h, filter);
+		if(png){
+			RenderWorldPng(dstName, small);
+		}else{
+			RenderWorld(dstName, small);
+		}
+	}else if(png){
+		RenderPng(dstName, *src);
+	}else{
+		RenderBitmap(dstName, *src);
+	}
+}
+
+bool IsPngName(const std::string &fileName)
+{
+	if(fileName.size()<4)
+		return false;
+	std::string ext=fileName.substr(fileName.size()-4);
+	for(unsigned i=0;i<ext.size();i++){
+		ext[i]=(char)tolower(ext[i]);
+	}
+	return ext==".png";
+}
+
+}; // namepspace hpce
@@ -1,21 +1,78 @@
 #include "heat.hpp"
 
 #include <cstdlib>
+#include <cstring>
+
+// Usage: render_world [dst [width [height [filter [src]]]]]
+//
+//   dst     File to write, or "-" for stdout. Names ending in .png are written as
+//           png, names ending in / are written as a directory of png tiles (see
+//           RenderWorldPyramid), and anything else is written as a bitmap.
+//   width   Shrink the picture to this many pixels across (0 keeps the aspect
+//           ratio). For a tile pyramid this is the tile size instead.
+//   height  Shrink the picture to this many pixels down (0 keeps the aspect ratio)
+//   filter  "box" (mean temperature, the default) or "max" (hottest cell)
+//   src     World file to render instead of reading stdin. Binary worlds are
+//           rendered straight from the file a band at a time, so they never
+//           have to fit in memory (see RenderWorldFile).
 
 int main(int argc, char *argv[])
 {
 	std::string dstFile="-"; // stdout
+	unsigned width=0, height=0;
+	hpce::downsample_filter_t filter=hpce::Filter_Box;
+	std::string srcFile; // stdin
 	
 	if(argc>1){
 		dstFile=argv[1];
 	}
+	if(argc>2){
+		width=atoi(argv[2]);
+	}
+	if(argc>3){
+		height=atoi(argv[3]);
+	}
+	if(argc>4){
+		if(!strcmp(argv[4], "max")){
+			filter=hpce::Filter_Max;
+		}else if(strcmp(argv[4], "box")){
+			std::cerr<<"Unknown filter '"<<argv[4]<<"', expected box or max."<<std::endl;
+			return 1;
+		}
+	}
+	
+	if(argc>5){
+		srcFile=argv[5];
+	}
 	
 	try{
+		if(!srcFile.empty()){
+			std::cerr<<"Rendering "<<srcFile<<" to "<<dstFile<<std::endl;
+			hpce::RenderWorldFile(dstFile, srcFile, width, height, filter);
+			return 0;
+		}
+		
 		hpce::world_t world=hpce::LoadWorld(std::cin);
 		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
 		
+		if(dstFile.size()>1 && dstFile[dstFile.size()-1]=='/'){
+			unsigned tileSize=width ? width : 256;
+			std::cerr<<"Rendering pyramid of "<<tileSize<<"x"<<tileSize<<" tiles to "<<dstFile<<std::endl;
+			hpce::RenderWorldPyramid(dstFile.substr(0, dstFile.size()-1), world, tileSize, filter);
+			return 0;
+		}
+		
+		if(width || height){
+			world=hpce::DownsampleWorld(world, width, height, filter);
+			std::cerr<<"Downsampled to w="<<world.w<<", h="<<world.h<<std::endl;
+		}
+		
 		std::cerr<<"Rendering to "<<dstFile<<std::endl;
-		hpce::RenderWorld(dstFile, world);
+		if(hpce::IsPngName(dstFile)){
+			hpce::RenderWorldPng(dstFile, world);
+		}else{
+			hpce::RenderWorld(dstFile, world);
+		}
 	}catch(const std::exception &e){
 		std::cerr<<"Exception : "<<e.what()<<std::endl;
 		return 1;
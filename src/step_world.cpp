@@ -1,36 +1,65 @@
 #include "heat.hpp"
+#include "step_engines.hpp"
 
 #include <cstdlib>
+#include <cstring>
+
+// Usage: step_world [--engine=NAME] [dt [n [binary]]]
+//
+// NAME is one of the engines from StepEngines (or just its version, e.g. v3),
+// "auto" to pick the fastest kind available, or "list" to print them all. The
+// default is the reference StepWorld.
 
 int main(int argc, char *argv[])
 {
 	float dt=0.1;
 	unsigned n=1;
 	bool binary=false;
-	
-	if(argc>1){
-		dt=(float)strtod(argv[1], NULL);
+	std::string engineName="reference";
+
+	// Options can go anywhere, and the rest are positional as before
+	std::vector<const char *> args;
+	for(int i=1;i<argc;i++){
+		if(!strncmp(argv[i], "--engine=", 9)){
+			engineName=argv[i]+9;
+		}else{
+			args.push_back(argv[i]);
+		}
 	}
-	if(argc>2){
-		n=atoi(argv[2]);
+
+	if(args.size()>0){
+		dt=(float)strtod(args[0], NULL);
 	}
-	if(argc>3){
-		if(atoi(argv[3]))
+	if(args.size()>1){
+		n=atoi(args[1]);
+	}
+	if(args.size()>2){
+		if(atoi(args[2]))
 			binary=true;
 	}
-	
+
 	try{
+		if(engineName=="list"){
+			const std::vector<hpce::yl10313::step_engine_t> &engines=hpce::yl10313::StepEngines();
+			for(unsigned i=0;i<engines.size();i++){
+				std::cout<<engines[i].name<<" : "<<engines[i].description
+					<<" ("<<hpce::yl10313::DescribeEngineFlags(engines[i].flags)<<")"<<std::endl;
+			}
+			return 0;
+		}
+		const hpce::yl10313::step_engine_t &engine=hpce::yl10313::FindStepEngine(engineName);
+
 		hpce::world_t world=hpce::LoadWorld(std::cin);
 		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
-		
-		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<std::endl;
-		hpce::StepWorld(world, dt, n);
-		
+
+		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<" with engine "<<engine.name<<std::endl;
+		engine.step(world, dt, n);
+
 		hpce::SaveWorld(std::cout, world, binary);
 	}catch(const std::exception &e){
 		std::cerr<<"Exception : "<<e.what()<<std::endl;
 		return 1;
 	}
-		
+
 	return 0;
 }
@@ -0,0 +1,114 @@
+#include "heat.hpp"
+
+#include <stdexcept>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+
+// Checks the index and size guards for worlds with more than 2^32 cells. None
+// of the default checks allocate a huge world, so they can run anywhere. Setting
+// HPCE_TEST_HUGE_STEP=1 also steps a real world past the boundary, which needs
+// around 52GB of memory.
+
+static int failures=0;
+
+static void check(bool ok, const char *what)
+{
+	if(!ok){
+		std::cerr<<"  FAIL : "<<what<<"\n";
+		failures++;
+	}else{
+		std::cerr<<"  pass : "<<what<<"\n";
+	}
+}
+
+template<class TException, class TFunc>
+static void check_throws(TFunc f, const char *what)
+{
+	bool thrown=false;
+	try{
+		f();
+	}catch(const TException &){
+		thrown=true;
+	}catch(...){
+	}
+	check(thrown, what);
+}
+
+int main(int argc, char *argv[])
+{
+	try{
+		const uint64_t boundary=(uint64_t)1<<32;
+		
+		std::cerr<<"Index arithmetic\n";
+		check(hpce::CellIndex(0, 65536, 65536)==boundary, "CellIndex(0,65536,65536) doesn't wrap");
+		check(hpce::CellIndex(5, 65537, 65536)==boundary+65536+5, "CellIndex past 2^32");
+		check(hpce::CellIndex(0xFFFFFFFFu, 0xFFFFFFFFu, 0xFFFFFFFFu)==(uint64_t)0xFFFFFFFFu*0xFFFFFFFFu+0xFFFFFFFFu, "CellIndex at the largest coordinate");
+		
+		std::cerr<<"World sizes\n";
+		if(sizeof(size_t)>=8){
+			check(hpce::WorldCells(65536, 65537)==boundary+65536, "WorldCells(65536,65537) is more than 2^32");
+		}
+		check_throws<std::length_error>([](){ hpce::WorldCells(0xFFFFFFFFu, 0xFFFFFFFFu); }, "WorldCells rejects worlds whose state can't be addressed");
+		
+		std::cerr<<"Loading\n";
+		check_throws<std::length_error>([](){
+			std::stringstream src("HPCEHeatWorldV0Binary\n4294967295 4294967295 0.1\n-");
+			hpce::LoadWorld(src);
+		}, "LoadWorld rejects a huge header before allocating");
+		
+		std::cerr<<"Rendering\n";
+		check_throws<std::length_error>([](){
+			// Never allocated: the header check has to happen before any cell is touched
+			hpce::world_t world;
+			world.w=70000;
+			world.h=70000;
+			world.alpha=0.1f;
+			world.t=0;
+			hpce::RenderWorld("-", world);
+		}, "RenderWorld refuses bitmaps over 4GB");
+		
+		if(getenv("HPCE_TEST_HUGE_STEP") && atoi(getenv("HPCE_TEST_HUGE_STEP"))){
+			std::cerr<<"Stepping a world past 2^32 cells\n";
+			
+			// A short wide world, so that the interesting rows are just past the boundary
+			unsigned w=65536, h=65540;
+			hpce::world_t world;
+			world.w=w;
+			world.h=h;
+			world.alpha=0.1f;
+			world.t=0;
+			world.properties.assign(hpce::WorldCells(w,h), (hpce::cell_flags_t)0);
+			world.state.assign(hpce::WorldCells(w,h), 0.0f);
+			for(unsigned x=0;x<w;x++){
+				world.properties[hpce::CellIndex(x,0,w)]=hpce::Cell_Insulator;
+				world.properties[hpce::CellIndex(x,h-1,w)]=hpce::Cell_Insulator;
+			}
+			for(unsigned y=0;y<h;y++){
+				world.properties[hpce::CellIndex(0,y,w)]=hpce::Cell_Insulator;
+				world.properties[hpce::CellIndex(w-1,y,w)]=hpce::Cell_Insulator;
+			}
+			// Fixed heat source just past the boundary, so if anything wraps the
+			// heat ends up near the top of the world instead
+			size_t source=hpce::CellIndex(100, 65537, w);
+			world.properties[source]=hpce::Cell_Fixed;
+			world.state[source]=1.0f;
+			
+			hpce::StepWorld(world, 0.1f, 1);
+			
+			check(world.state[source+1]>0, "Heat spreads right of a source past 2^32");
+			check(world.state[source+w]>0, "Heat spreads below a source past 2^32");
+			check(world.state[hpce::CellIndex(101,1,w)]==0, "No heat appears at the wrapped location");
+		}
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+	
+	if(failures){
+		std::cerr<<failures<<" checks failed.\n";
+		return 1;
+	}
+	std::cerr<<"All checks passed.\n";
+	return 0;
+}
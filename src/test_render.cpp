@@ -0,0 +1,133 @@
+#include "heat.hpp"
+
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+// Checks the renderers against worlds they shouldn't trust. Files are written
+// to tmp/, which has to exist.
+
+static int failures=0;
+
+static void check(bool ok, const char *what)
+{
+	if(!ok){
+		std::cerr<<"  FAIL : "<<what<<"\n";
+		failures++;
+	}else{
+		std::cerr<<"  pass : "<<what<<"\n";
+	}
+}
+
+static std::string ReadFile(const std::string &fileName)
+{
+	std::ifstream src(fileName.c_str(), std::ios::in | std::ios::binary);
+	if(!src.is_open())
+		throw std::runtime_error("ReadFile : Couldn't open '"+fileName+"'.");
+	std::stringstream res;
+	res<<src.rdbuf();
+	return res.str();
+}
+
+//! A world with every kind of bad temperature, wide enough for both the vector and scalar paths
+static hpce::world_t BadWorld(bool clamped)
+{
+	const float inf=std::numeric_limits<float>::infinity();
+	const float nan=std::numeric_limits<float>::quiet_NaN();
+	const float bad[]={ 1.5f, -0.5f, nan, inf, -inf, 1e30f, 0.5f, 1.0f, 0.0f };
+	const float good[]={ 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 0.5f, 1.0f, 0.0f };
+
+	hpce::world_t world;
+	world.w=21;
+	world.h=4;
+	world.alpha=0.1f;
+	world.t=0;
+	for(unsigned i=0;i<world.w*world.h;i++){
+		world.state.push_back(clamped ? good[i%9] : bad[i%9]);
+		world.properties.push_back(i%7==3 ? hpce::Cell_Insulator : (hpce::cell_flags_t)0);
+	}
+	return world;
+}
+
+//! A world with every heat level, and insulators too if asked
+static hpce::world_t EveryLevel(bool insulators)
+{
+	hpce::world_t world;
+	world.w=64;
+	world.h=5;
+	world.alpha=0.1f;
+	world.t=0;
+	for(unsigned i=0;i<world.w*world.h;i++){
+		world.state.push_back((i%256)/255.0f);
+		world.properties.push_back((insulators && i==300) ? hpce::Cell_Insulator : (hpce::cell_flags_t)0);
+	}
+	return world;
+}
+
+//! Colour type from the IHDR chunk, which always comes first
+static int PngColourType(const std::string &png)
+{
+	return png.size()>25 ? (uint8_t)png[25] : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	try{
+		std::cerr<<"Temperatures outside [0,1]\n";
+		hpce::RenderWorld("tmp/test_render_bad.bmp", BadWorld(false));
+		hpce::RenderWorld("tmp/test_render_good.bmp", BadWorld(true));
+		check(ReadFile("tmp/test_render_bad.bmp")==ReadFile("tmp/test_render_good.bmp"), "Bitmap clamps them, and draws NaN as cold");
+
+		hpce::RenderWorldPng("tmp/test_render_bad.png", BadWorld(false));
+		hpce::RenderWorldPng("tmp/test_render_good.png", BadWorld(true));
+		check(ReadFile("tmp/test_render_bad.png")==ReadFile("tmp/test_render_good.png"), "Png clamps them, and draws NaN as cold");
+
+		std::cerr<<"Palette overflow\n";
+		hpce::RenderWorldPng("tmp/test_render_256.png", EveryLevel(false));
+		check(PngColourType(ReadFile("tmp/test_render_256.png"))==3, "Every heat level still fits in a palette");
+		hpce::RenderWorldPng("tmp/test_render_257.png", EveryLevel(true));
+		check(PngColourType(ReadFile("tmp/test_render_257.png"))==2, "Every heat level and insulators fall back to RGB");
+
+		std::cerr<<"Corrupt binary world files\n";
+		{
+			std::ofstream dst("tmp/test_render_bad.bin", std::ios::out | std::ios::binary);
+			hpce::SaveWorld(dst, BadWorld(false), true);
+		}
+		bool threw=false;
+		try{
+			hpce::RenderWorldFile("tmp/test_render_bad_file.bmp", "tmp/test_render_bad.bin");
+		}catch(const std::invalid_argument &){
+			threw=true;
+		}
+		check(threw, "Rendering a file with bad temperatures throws");
+		threw=false;
+		try{
+			hpce::RenderWorldFile("tmp/test_render_bad_file/", "tmp/test_render_bad.bin", 8);
+		}catch(const std::invalid_argument &){
+			threw=true;
+		}
+		check(threw, "Rendering a pyramid of it throws too");
+
+		hpce::world_t world=BadWorld(true);
+		{
+			std::ofstream dst("tmp/test_render_good.bin", std::ios::out | std::ios::binary);
+			hpce::SaveWorld(dst, world, true);
+		}
+		hpce::RenderWorldFile("tmp/test_render_good_file.png", "tmp/test_render_good.bin");
+		check(ReadFile("tmp/test_render_good_file.png")==ReadFile("tmp/test_render_good.png"), "A good file renders as the world it holds");
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+
+	if(failures){
+		std::cerr<<failures<<" checks failed.\n";
+		return 1;
+	}
+	std::cerr<<"All checks passed.\n";
+	return 0;
+}
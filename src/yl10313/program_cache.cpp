@@ -0,0 +1,279 @@
+#include "program_cache.hpp"
+
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <vector>
+
+// kernel things
+#include <fstream>
+#include <streambuf>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace hpce{
+
+namespace yl10313{
+
+namespace{
+
+	struct embedded_source_t
+	{
+		const char *fileName;
+		const char *source;
+	};
+
+	//! Every .cl file in src/yl10313, generated by the makefile as raw string literals
+	const embedded_source_t embeddedSources[]={
+#include "step_world_kernels.inc"
+		{ 0, 0 }
+	};
+
+	//! 64-bit FNV-1a, which is plenty to tell sources and keys apart
+	uint64_t HashString(const std::string &data)
+	{
+		uint64_t hash=14695981039346656037ull;
+		for(size_t i=0;i<data.size();i++){
+			hash=(hash ^ (uint8_t)data[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	std::string HexString(uint64_t x)
+	{
+		char buffer[17];
+		snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)x);
+		return buffer;
+	}
+
+	//! Create dirName if it is missing, readable and writable by the current user only
+	bool MakeCacheDirectory(const std::string &dirName)
+	{
+#if defined(_WIN32)
+		int err=_mkdir(dirName.c_str());
+#else
+		int err=mkdir(dirName.c_str(), 0700);
+#endif
+		return err==0 || errno==EEXIST;
+	}
+
+	//! True if only the current user could have put files in dirName
+	/*! Cached binaries are handed straight to the OpenCL runtime, so a directory
+		that someone else owns, or that others can write to, would let them run
+		their own kernels in our process. On windows the per-user application
+		data directory is already protected.
+	*/
+	bool IsPrivateDirectory(const std::string &dirName)
+	{
+#if defined(_WIN32)
+		return true;
+#else
+		struct stat info;
+		if(stat(dirName.c_str(), &info)!=0)
+			return false;
+		return S_ISDIR(info.st_mode) && (info.st_uid==geteuid()) && !(info.st_mode & (S_IWGRP|S_IWOTH));
+#endif
+	}
+
+	//! The per-user cache directory, as given by the platform
+	/*! Empty if there isn't one, which turns the cache off. */
+	std::string UserCacheDirectory()
+	{
+#if defined(_WIN32)
+		const char *base=getenv("LOCALAPPDATA");
+		if(!base || !*base)
+			return "";
+		return std::string(base)+"/hpce_cl_cache";
+#else
+		// Relative paths in XDG_CACHE_HOME are invalid, and should be ignored
+		const char *base=getenv("XDG_CACHE_HOME");
+		if(base && base[0]=='/')
+			return std::string(base)+"/hpce_cl_cache";
+
+		const char *home=getenv("HOME");
+		if(!home || home[0]!='/')
+			return "";
+		std::string dotCache=std::string(home)+"/.cache";
+		if(!MakeCacheDirectory(dotCache))
+			return "";
+		return dotCache+"/hpce_cl_cache";
+#endif
+	}
+
+	//! Read the binary stored under key, if there is one
+	/*! Each file starts with the full key, so a hash collision or a file left
+		by something else just looks like a miss.
+	*/
+	bool ReadCache(const std::string &fileName, const std::string &key, std::string &binary)
+	{
+		std::ifstream src(fileName.c_str(), std::ios::in | std::ios::binary);
+		if(!src.is_open())
+			return false;
+
+		std::string contents(
+			(std::istreambuf_iterator<char>(src)),
+			std::istreambuf_iterator<char>()
+		);
+		if( (contents.size()<=key.size()) || (contents.compare(0, key.size(), key)!=0) )
+			return false;
+
+		binary=contents.substr(key.size());
+		return true;
+	}
+
+	//! Store the binary for the program's (single) device under key
+	/*! Failing to write the cache isn't an error, it just means building from
+		source again next time.
+	*/
+	void WriteCache(const std::string &dirName, const std::string &fileName, const std::string &key, const cl::Program &program)
+	{
+		size_t size=0;
+		if(CL_SUCCESS!=clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) || size==0)
+			return;
+		std::vector<unsigned char> binary(size);
+		unsigned char *pBinary=&binary[0];
+		if(CL_SUCCESS!=clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(pBinary), &pBinary, NULL))
+			return;
+
+		WriteCacheFile(dirName, fileName, key+std::string((const char*)&binary[0], binary.size()));
+	}
+
+}; // anonymous namespace
+
+std::string CacheDirectory()
+{
+	std::string dirName;
+	if(getenv("HPCE_CL_CACHE_DIR")){
+		dirName=getenv("HPCE_CL_CACHE_DIR");
+	}else{
+		dirName=UserCacheDirectory();
+	}
+	if(dirName.empty())
+		return dirName;
+
+	// Even a named directory is refused if someone else could plant files in it
+	if(!MakeCacheDirectory(dirName) || !IsPrivateDirectory(dirName)){
+		static bool warned=false;
+		if(!warned){
+			std::cerr<<"Cache directory '"<<dirName<<"' is missing or not private to this user, so caching is off.\n";
+			warned=true;
+		}
+		return "";
+	}
+	return dirName;
+}
+
+bool WriteCacheFile(const std::string &dirName, const std::string &fileName, const std::string &contents)
+{
+	if(!MakeCacheDirectory(dirName))
+		return false;
+
+	// Write to a temporary and rename, so that concurrent runs never see half a file
+#if defined(_WIN32)
+	std::string tmpName=fileName+"."+std::to_string(_getpid())+".tmp";
+#else
+	std::string tmpName=fileName+"."+std::to_string(getpid())+".tmp";
+#endif
+	{
+		std::ofstream dst(tmpName.c_str(), std::ios::out | std::ios::binary);
+		dst.write(contents.data(), contents.size());
+		if(!dst.good()){
+			dst.close();
+			remove(tmpName.c_str());
+			return false;
+		}
+	}
+#if defined(_WIN32)
+	remove(fileName.c_str());	// rename won't replace an existing file on windows
+#endif
+	if(rename(tmpName.c_str(), fileName.c_str())!=0){
+		remove(tmpName.c_str());
+		return false;
+	}
+	return true;
+}
+
+std::string LoadSource(const char *fileName)
+{
+	if(getenv("HPCE_CL_SRC_DIR")){
+		std::string fullName=std::string(getenv("HPCE_CL_SRC_DIR"))+"/"+fileName;
+
+		std::ifstream src(fullName, std::ios::in | std::ios::binary);
+		if(!src.is_open())
+			throw std::runtime_error("LoadSource : Couldn't load cl file from '"+fullName+"'.");
+
+		return std::string(
+			(std::istreambuf_iterator<char>(src)), // Node the extra brackets.
+			std::istreambuf_iterator<char>()
+		);
+	}
+
+	for(const embedded_source_t *p=embeddedSources;p->fileName;p++){
+		if(!strcmp(p->fileName, fileName))
+			return p->source;
+	}
+	throw std::runtime_error(std::string("LoadSource : No cl file called '")+fileName+"' was built in.");
+}
+
+cl::Program BuildProgram(const cl::Context &context, const cl::Device &device, const char *fileName, const std::string &options)
+{
+	std::string source=LoadSource(fileName);
+	std::vector<cl::Device> devices(1, device);
+
+	std::string key="HPCEProgramCacheV0\n"
+		+device.getInfo<CL_DEVICE_NAME>()+"\n"
+		+device.getInfo<CL_DEVICE_VERSION>()+"\n"
+		+device.getInfo<CL_DRIVER_VERSION>()+"\n"
+		+HexString(HashString(source))+" "+std::to_string(source.size())+"\n"
+		+options+"\n";
+
+	std::string dirName=CacheDirectory();
+	std::string cacheName;
+	if(!dirName.empty()){
+		cacheName=dirName+"/"+HexString(HashString(key))+".bin";
+
+		std::string binary;
+		if(ReadCache(cacheName, key, binary)){
+			try{
+				cl::Program::Binaries binaries(1, std::make_pair((const void*)binary.data(), binary.size()));
+				cl::Program program(context, devices, binaries);
+				program.build(devices, options.c_str());
+				return program;
+			}catch(const cl::Error &){
+				// Probably from an older run-time, so fall through and rebuild
+				std::cerr<<"Cached binary for "<<fileName<<" was rejected, rebuilding.\n";
+			}
+		}
+	}
+
+	cl::Program::Sources sources;	// A vector of (data,length) pairs
+	sources.push_back(std::make_pair(source.c_str(), source.size()+1));	// push on our single string
+
+	cl::Program program(context, sources);
+	try{
+		program.build(devices, options.c_str());
+	}catch(...){
+		std::cerr<<"Log for device "<<device.getInfo<CL_DEVICE_NAME>()<<":\n\n";
+		std::cerr<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)<<"\n\n";
+		throw;
+	}
+
+	if(!cacheName.empty()){
+		WriteCache(dirName, cacheName, key, program);
+	}
+	return program;
+}
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
@@ -0,0 +1,54 @@
+#ifndef hpce_yl10313_program_cache_hpp
+#define hpce_yl10313_program_cache_hpp
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+// OpenCL define:
+#define __CL_ENABLE_EXCEPTIONS
+#define __CL_USE_DEPRECATED_OPENCL_1_1_APIS
+#include "CL/cl.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+	//! Source of one of the .cl files in src/yl10313
+	/*! The sources are compiled into the executable, so by default no files are
+		needed at run-time. If HPCE_CL_SRC_DIR is set the file is loaded from that
+		directory instead, which is handy when working on a kernel.
+	*/
+	std::string LoadSource(const char *fileName);
+
+	//! Directory to keep cached files in, or an empty string if caching is turned off
+	/*! This is HPCE_CL_CACHE_DIR if set, or else hpce_cl_cache in the per-user
+		cache directory: $XDG_CACHE_HOME or ~/.cache, or %LOCALAPPDATA% on windows.
+		The directory is created readable by the current user only, and caching is
+		turned off if it belongs to someone else or others can write to it, as
+		cached binaries are run without further checks.
+	*/
+	std::string CacheDirectory();
+
+	//! Replace fileName with contents, creating dirName first if needed
+	/*! The file is written to a temporary and renamed, so concurrent runs never see
+		half a file. Failing to write a cache isn't an error, so this returns false
+		rather than throwing.
+	*/
+	bool WriteCacheFile(const std::string &dirName, const std::string &fileName, const std::string &contents);
+
+	//! Build one of the .cl files for a device, reusing a binary from a previous run where possible
+	/*! Built binaries are kept in CacheDirectory(), keyed by the device name and
+		version, the driver version, a hash of the source and the build options. If
+		a cached binary is missing, doesn't match, or the runtime rejects it, the program is built from
+		source and the cache is refreshed. Setting HPCE_CL_CACHE_DIR to an empty
+		string turns the cache off.
+		\param options Passed to clBuildProgram
+	*/
+	cl::Program BuildProgram(const cl::Context &context, const cl::Device &device, const char *fileName, const std::string &options="");
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
+
+#endif
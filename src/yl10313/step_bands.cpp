@@ -0,0 +1,574 @@
+#include "step_bands.hpp"
+
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <exception>
+#include <sstream>
+#include <algorithm>
+
+#include "program_cache.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+//! One band of the world, and whatever steps it
+/*! The worker holds rows [L0(),L1()) of the world, which are its own rows
+	[Y0(),Y1()) plus up to halo rows either side. The outermost row of a halo
+	is marked as fixed, as its neighbours aren't in the copy.
+*/
+class band_worker_t
+{
+protected:
+	unsigned m_w, m_h;
+	unsigned m_y0, m_y1;
+	unsigned m_l0, m_l1;
+
+	//! Replace the local copy with rows [L0(),L1()) of the world
+	virtual void Upload(const float *state, const std::vector<uint32_t> &props)=0;
+public:
+	band_worker_t(unsigned w, unsigned h)
+		: m_w(w), m_h(h)
+		, m_y0(0), m_y1(0)
+		, m_l0(0), m_l1(0)
+	{}
+
+	virtual ~band_worker_t()
+	{}
+
+	virtual std::string Name() const=0;
+
+	//! Take rows [y0,y1) of world, with a halo of up to halo rows either side
+	void Load(const world_t &world, const std::vector<uint32_t> &packed, unsigned y0, unsigned y1, unsigned halo)
+	{
+		m_y0=y0;
+		m_y1=y1;
+		m_l0=y0>halo ? y0-halo : 0;
+		m_l1=std::min(m_h, y1+halo);
+
+		std::vector<uint32_t> props(packed.begin()+CellIndex(0,m_l0,m_w), packed.begin()+CellIndex(0,m_l1,m_w));
+		if(m_l0>0){
+			std::fill(props.begin(), props.begin()+m_w, (uint32_t)Cell_Fixed);
+		}
+		if(m_l1<m_h){
+			std::fill(props.end()-m_w, props.end(), (uint32_t)Cell_Fixed);
+		}
+		Upload(&world.state[CellIndex(0,m_l0,m_w)], props);
+	}
+
+	//! Step the local copy n times, waiting until it is done
+	virtual void Step(float inner, float outer, unsigned n)=0;
+
+	//! Copy rows [y0,y1) of the world, which must be in the local copy, to dst
+	virtual void ReadRows(unsigned y0, unsigned y1, float *dst)=0;
+
+	//! Copy src over rows [y0,y1) of the world, which must be in the local copy
+	virtual void WriteRows(unsigned y0, unsigned y1, const float *src)=0;
+
+	unsigned Y0() const { return m_y0; }
+	unsigned Y1() const { return m_y1; }
+	unsigned L0() const { return m_l0; }
+	unsigned L1() const { return m_l1; }
+};
+
+namespace{
+
+	//! One step of rows cells, with the same arithmetic as StepWorld but using packed properties
+	void StepRows(const float *state, float *buffer, const uint32_t *props, unsigned w, unsigned rows, float inner, float outer)
+	{
+		size_t cells=WorldCells(w, rows);
+		for(size_t index=0;index<cells;index++){
+			uint32_t myProps=props[index];
+
+			if((myProps & Cell_Fixed) || (myProps & Cell_Insulator)){
+				// Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
+				buffer[index]=state[index];
+			}else{
+				float contrib=inner;
+				float acc=inner*state[index];
+
+				// Cell above
+				if(myProps & 0x4) {
+					contrib += outer;
+					acc += outer * state[index-w];
+				}
+
+				// Cell below
+				if(myProps & 0x8){
+					contrib += outer;
+					acc += outer * state[index+w];
+				}
+
+				// Cell left
+				if(myProps & 0x10){
+					contrib += outer;
+					acc += outer * state[index-1];
+				}
+
+				// Cell right
+				if(myProps & 0x20){
+					contrib += outer;
+					acc += outer * state[index+1];
+				}
+
+				// Scale the accumulate value by the number of places contributing to it
+				float res=acc/contrib;
+				// Then clamp to the range [0,1]
+				res=std::min(1.0f, std::max(0.0f, res));
+				buffer[index] = res;
+			}
+		}
+	}
+
+	//! A band stepped by a host thread
+	class host_worker_t
+		: public band_worker_t
+	{
+	private:
+		unsigned m_index;
+		std::vector<float> m_state, m_buffer;
+		std::vector<uint32_t> m_props;
+	protected:
+		virtual void Upload(const float *state, const std::vector<uint32_t> &props)
+		{
+			m_props=props;
+			m_state.assign(state, state+props.size());
+			m_buffer.resize(props.size());
+		}
+	public:
+		host_worker_t(unsigned w, unsigned h, unsigned index)
+			: band_worker_t(w, h)
+			, m_index(index)
+		{}
+
+		virtual std::string Name() const
+		{ return "host thread "+std::to_string(m_index); }
+
+		virtual void Step(float inner, float outer, unsigned n)
+		{
+			for(unsigned t=0;t<n;t++){
+				StepRows(&m_state[0], &m_buffer[0], &m_props[0], m_w, m_l1-m_l0, inner, outer);
+				std::swap(m_state, m_buffer);
+			}
+		}
+
+		virtual void ReadRows(unsigned y0, unsigned y1, float *dst)
+		{
+			memcpy(dst, &m_state[CellIndex(0,y0-m_l0,m_w)], sizeof(float)*WorldCells(m_w, y1-y0));
+		}
+
+		virtual void WriteRows(unsigned y0, unsigned y1, const float *src)
+		{
+			memcpy(&m_state[CellIndex(0,y0-m_l0,m_w)], src, sizeof(float)*WorldCells(m_w, y1-y0));
+		}
+	};
+
+	//! A band stepped by the v5 kernel on an OpenCL device
+	class device_worker_t
+		: public band_worker_t
+	{
+	private:
+		cl::Device m_device;
+		cl::Context m_context;
+		cl::CommandQueue m_queue;
+		cl::Program m_program;
+		cl::Kernel m_kernel;
+
+		size_t m_capacity;	//! Cells the buffers have room for
+		cl::Buffer m_buffProperties;
+		cl::Buffer m_buffState;		//! Always holds the current state
+		cl::Buffer m_buffBuffer;
+	protected:
+		virtual void Upload(const float *state, const std::vector<uint32_t> &props)
+		{
+			// Rebalancing moves a few rows at a time, so buffers are only ever grown
+			size_t cb=sizeof(float)*props.size();
+			if(props.size()>m_capacity){
+				if(cb > m_device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+					throw std::runtime_error("band_session_t : Band is too large to fit in a single buffer on "+Name()+".");
+				m_buffProperties=cl::Buffer(m_context, CL_MEM_READ_ONLY, cb);
+				m_buffState=cl::Buffer(m_context, CL_MEM_READ_WRITE, cb);
+				m_buffBuffer=cl::Buffer(m_context, CL_MEM_READ_WRITE, cb);
+				m_capacity=props.size();
+			}
+			m_queue.enqueueWriteBuffer(m_buffProperties, CL_TRUE, 0, cb, &props[0]);
+			m_queue.enqueueWriteBuffer(m_buffState, CL_TRUE, 0, cb, state);
+		}
+	public:
+		device_worker_t(unsigned w, unsigned h, const cl::Device &device)
+			: band_worker_t(w, h)
+			, m_device(device)
+			, m_capacity(0)
+		{
+			std::vector<cl::Device> devices(1, m_device);
+			m_context=cl::Context(devices);
+			m_queue=cl::CommandQueue(m_context, m_device);
+			m_program=BuildProgram(m_context, m_device, "step_world_v5_kernel.cl");
+			m_kernel=cl::Kernel(m_program, "kernel_xy");
+		}
+
+		virtual std::string Name() const
+		{ return m_device.getInfo<CL_DEVICE_NAME>(); }
+
+		virtual void Step(float inner, float outer, unsigned n)
+		{
+			m_kernel.setArg(1, inner);
+			m_kernel.setArg(2, outer);
+			m_kernel.setArg(4, m_buffProperties);
+
+			// The kernel takes the width from the global size, so it works on the band as if it were a world
+			cl::NDRange offset(0, 0);
+			cl::NDRange globalSize(m_w, m_l1-m_l0);
+			for(unsigned t=0;t<n;t++){
+				m_kernel.setArg(0, m_buffState);
+				m_kernel.setArg(3, m_buffBuffer);
+				m_queue.enqueueNDRangeKernel(m_kernel, offset, globalSize, cl::NullRange);
+				std::swap(m_buffState, m_buffBuffer);
+			}
+			m_queue.finish();
+		}
+
+		virtual void ReadRows(unsigned y0, unsigned y1, float *dst)
+		{
+			m_queue.enqueueReadBuffer(m_buffState, CL_TRUE, sizeof(float)*CellIndex(0,y0-m_l0,m_w), sizeof(float)*WorldCells(m_w, y1-y0), dst);
+		}
+
+		virtual void WriteRows(unsigned y0, unsigned y1, const float *src)
+		{
+			m_queue.enqueueWriteBuffer(m_buffState, CL_TRUE, sizeof(float)*CellIndex(0,y0-m_l0,m_w), sizeof(float)*WorldCells(m_w, y1-y0), src);
+		}
+	};
+
+	//! Rebalance only if the slowest band would finish at least this much sooner
+	const double RebalanceGain=0.1;
+
+	//! Speeds are measured over windows of at least this many rounds...
+	const unsigned RebalanceRounds=16;
+
+	//! ...and at least this many seconds, which doubles after every rebalance
+	const double RebalanceSeconds=0.05;
+
+	//! Longest a window gets, however often the bands have been rebalanced
+	const double RebalanceMaxSeconds=2.0;
+
+	//! Time the slowest band would take to step its rows once, at the given speeds
+	double SlowestBand(const std::vector<unsigned> &rows, const std::vector<double> &speed)
+	{
+		double res=0;
+		for(unsigned i=0;i<rows.size();i++){
+			res=std::max(res, rows[i]/speed[i]);
+		}
+		return res;
+	}
+
+	//! Split rows in proportion to weight, giving every band at least one row
+	std::vector<unsigned> SplitRows(unsigned rows, const std::vector<double> &weight)
+	{
+		unsigned n=weight.size();
+		double total=0;
+		for(unsigned i=0;i<n;i++){
+			total+=weight[i];
+		}
+
+		// Everyone gets one row, then the rest are shared out, with leftovers
+		// going to the largest remainders
+		unsigned spare=rows-n;
+		std::vector<unsigned> res(n, 1);
+		std::vector<std::pair<double,unsigned> > remainders;
+		unsigned given=0;
+		for(unsigned i=0;i<n;i++){
+			double share=spare*weight[i]/total;
+			unsigned whole=std::min(spare-given, (unsigned)share);
+			res[i]+=whole;
+			given+=whole;
+			remainders.push_back(std::make_pair(share-whole, i));
+		}
+		std::sort(remainders.rbegin(), remainders.rend());
+		for(unsigned i=0;given<spare;i=(i+1)%n){
+			res[remainders[i].second]++;
+			given++;
+		}
+		return res;
+	}
+
+}; // anonymous namespace
+
+band_options_t BandOptionsFromEnv()
+{
+	band_options_t options;
+
+	std::string devices=getenv("HPCE_BAND_DEVICES") ? getenv("HPCE_BAND_DEVICES") : "";
+	if(devices=="" || devices=="all"){
+		// Having no OpenCL at all is fine here, it just leaves the host threads
+		try{
+			std::vector<cl::Platform> platforms;
+			cl::Platform::get(&platforms);
+			for(unsigned p=0;p<platforms.size();p++){
+				std::vector<cl::Device> found;
+				platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &found);
+				options.devices.insert(options.devices.end(), found.begin(), found.end());
+			}
+		}catch(const cl::Error &){
+			options.devices.clear();
+		}
+	}else if(devices!="none"){
+		std::vector<cl::Platform> platforms;
+		cl::Platform::get(&platforms);
+
+		std::istringstream list(devices);
+		std::string item;
+		while(std::getline(list, item, ',')){
+			unsigned p, d;
+			if(2!=sscanf(item.c_str(), "%u.%u", &p, &d))
+				throw std::invalid_argument("BandOptionsFromEnv : HPCE_BAND_DEVICES should be all, none, or a list like 0.0,1.0.");
+			std::vector<cl::Device> found;
+			platforms.at(p).getDevices(CL_DEVICE_TYPE_ALL, &found);
+			options.devices.push_back(found.at(d));
+		}
+	}
+	if(getenv("HPCE_BAND_THREADS") && *getenv("HPCE_BAND_THREADS")){
+		options.threads=atoi(getenv("HPCE_BAND_THREADS"));
+	}
+	if(getenv("HPCE_BAND_HALO") && *getenv("HPCE_BAND_HALO")){
+		options.halo=atoi(getenv("HPCE_BAND_HALO"));
+	}
+	if(getenv("HPCE_BAND_REBALANCE") && *getenv("HPCE_BAND_REBALANCE")){
+		options.rebalance=atoi(getenv("HPCE_BAND_REBALANCE"))!=0;
+	}
+	return options;
+}
+
+band_session_t::band_session_t(const world_t &world, const band_options_t &options)
+	: m_w(world.w)
+	, m_h(world.h)
+	, m_alpha(world.alpha)
+	, m_t(world.t)
+	, m_options(options)
+	, m_world(world)
+	, m_rounds(0)
+	, m_windowRounds(0)
+	, m_windowSeconds(0)
+	, m_minWindowSeconds(RebalanceSeconds)
+{
+	size_t cells=WorldCells(world.w, world.h);
+	if( (world.state.size()!=cells) || (world.properties.size()!=cells) )
+		throw std::invalid_argument("band_session_t : World state and properties don't match its dimensions.");
+	if(m_options.halo==0)
+		m_options.halo=1;
+
+	m_packed=PackProperties(world);
+
+	for(unsigned i=0;i<m_options.devices.size();i++){
+		m_workers.push_back(std::unique_ptr<band_worker_t>(new device_worker_t(m_w, m_h, m_options.devices[i])));
+	}
+	for(unsigned i=0;i<m_options.threads;i++){
+		m_workers.push_back(std::unique_ptr<band_worker_t>(new host_worker_t(m_w, m_h, i)));
+	}
+	if(m_workers.empty())
+		throw std::invalid_argument("band_session_t : Need at least one device or host thread.");
+	if(m_workers.size()>m_h)
+		throw std::invalid_argument("band_session_t : World has fewer rows than there are bands.");
+
+	// Nothing is known about the speeds yet, so start with equal bands
+	m_rows=SplitRows(m_h, std::vector<double>(m_workers.size(), 1.0));
+	StartWindow();
+	LoadBands();
+}
+
+band_session_t::~band_session_t()
+{}
+
+void band_session_t::LoadBands()
+{
+	unsigned y=0;
+	for(unsigned i=0;i<m_workers.size();i++){
+		m_workers[i]->Load(m_world, m_packed, y, y+m_rows[i], m_options.halo);
+		y+=m_rows[i];
+	}
+}
+
+void band_session_t::Round(float inner, float outer, unsigned n)
+{
+	unsigned count=m_workers.size();
+	std::vector<double> seconds(count, 0.0);
+	std::vector<std::exception_ptr> errors(count);
+
+	auto work=[&](unsigned i){
+		try{
+			auto begin=std::chrono::steady_clock::now();
+			m_workers[i]->Step(inner, outer, n);
+			seconds[i]=std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+		}catch(...){
+			errors[i]=std::current_exception();
+		}
+	};
+
+	// This thread takes the last band itself
+	std::vector<std::thread> threads;
+	for(unsigned i=0;i+1<count;i++){
+		threads.push_back(std::thread(work, i));
+	}
+	work(count-1);
+	for(unsigned i=0;i<threads.size();i++){
+		threads[i].join();
+	}
+	for(unsigned i=0;i<count;i++){
+		if(errors[i])
+			std::rethrow_exception(errors[i]);
+	}
+
+	double elapsed=0;
+	for(unsigned i=0;i<count;i++){
+		m_windowWork[i]+=m_rows[i]*(double)n;
+		m_windowBusy[i]+=seconds[i];
+		elapsed=std::max(elapsed, seconds[i]);
+	}
+	m_windowRounds++;
+	m_windowSeconds+=elapsed;
+
+	if(count==1)
+		return;
+
+	// Rows within halo of a boundary are all anyone else's halo can reach, so
+	// those go to the host copy, and then out to the halos
+	for(unsigned i=0;i<count;i++){
+		band_worker_t &worker=*m_workers[i];
+		unsigned y0=worker.Y0(), y1=worker.Y1();
+		unsigned depth=std::min(m_options.halo, y1-y0);
+		if(y0>0){
+			worker.ReadRows(y0, y0+depth, &m_world.state[CellIndex(0,y0,m_w)]);
+		}
+		if(y1<m_h){
+			worker.ReadRows(y1-depth, y1, &m_world.state[CellIndex(0,y1-depth,m_w)]);
+		}
+	}
+	for(unsigned i=0;i<count;i++){
+		band_worker_t &worker=*m_workers[i];
+		if(worker.L0()<worker.Y0()){
+			worker.WriteRows(worker.L0(), worker.Y0(), &m_world.state[CellIndex(0,worker.L0(),m_w)]);
+		}
+		if(worker.Y1()<worker.L1()){
+			worker.WriteRows(worker.Y1(), worker.L1(), &m_world.state[CellIndex(0,worker.Y1(),m_w)]);
+		}
+	}
+}
+
+void band_session_t::StartWindow()
+{
+	m_windowWork.assign(m_workers.size(), 0.0);
+	m_windowBusy.assign(m_workers.size(), 0.0);
+	m_windowRounds=0;
+	m_windowSeconds=0;
+}
+
+void band_session_t::Rebalance()
+{
+	unsigned count=m_workers.size();
+	if(count<2)
+		return;
+	if(m_windowRounds<RebalanceRounds || m_windowSeconds<m_minWindowSeconds)
+		return;
+
+	std::vector<double> speed(count, 0.0);
+	bool known=true;
+	for(unsigned i=0;i<count;i++){
+		if(m_windowBusy[i]>0){
+			speed[i]=m_windowWork[i]/m_windowBusy[i];
+		}
+		known = known && speed[i]>0;
+	}
+	std::vector<double> previous=m_lastSpeed;
+	m_lastSpeed = known ? speed : std::vector<double>();
+	StartWindow();
+	if(!known || previous.empty())
+		return;
+
+	// Split by both windows together, but only move if the split pays off in
+	// each of them, so one noisy window can't set it off
+	std::vector<double> both(count);
+	for(unsigned i=0;i<count;i++){
+		both[i]=(speed[i]+previous[i])/2;
+	}
+	std::vector<unsigned> rows=SplitRows(m_h, both);
+	if(SlowestBand(rows, speed) > SlowestBand(m_rows, speed)*(1-RebalanceGain))
+		return;
+	if(SlowestBand(rows, previous) > SlowestBand(m_rows, previous)*(1-RebalanceGain))
+		return;
+
+	// Reloading every band isn't worth it to move a single row
+	unsigned moved=0;
+	for(unsigned i=0;i<count;i++){
+		moved=std::max(moved, rows[i]>m_rows[i] ? rows[i]-m_rows[i] : m_rows[i]-rows[i]);
+	}
+	if(moved<=1)
+		return;
+
+	ReadWorld(m_world);
+	m_rows=rows;
+	LoadBands();
+	std::cerr<<"Rebalanced bands : "<<DescribeBands()<<"\n";
+
+	// Speeds are measured afresh for the new split, and each rebalance makes the next one wait longer
+	m_lastSpeed.clear();
+	m_minWindowSeconds=std::min(2*m_minWindowSeconds, RebalanceMaxSeconds);
+}
+
+void band_session_t::Step(float dt, unsigned n)
+{
+	float outer=m_alpha*dt;		// We spread alpha to other cells per time
+	float inner=1-outer/4;				// Anything that doesn't spread stays
+
+	for(unsigned done=0;done<n;){
+		unsigned todo=std::min(m_options.halo, n-done);
+		Round(inner, outer, todo);
+
+		// Time is stepped one dt at a time, to round exactly like the reference
+		for(unsigned t=0;t<todo;t++){
+			m_t += dt;
+		}
+		done+=todo;
+		m_rounds++;
+
+		if(m_options.rebalance && done<n){
+			Rebalance();
+		}
+	}
+}
+
+void band_session_t::ReadWorld(world_t &world)
+{
+	if( (world.w!=m_w) || (world.h!=m_h) )
+		throw std::invalid_argument("band_session_t::ReadWorld : World dimensions don't match the session.");
+
+	world.state.resize(WorldCells(m_w, m_h));
+	for(unsigned i=0;i<m_workers.size();i++){
+		band_worker_t &worker=*m_workers[i];
+		worker.ReadRows(worker.Y0(), worker.Y1(), &world.state[CellIndex(0,worker.Y0(),m_w)]);
+	}
+	world.t=m_t;
+}
+
+std::string band_session_t::DescribeBands() const
+{
+	std::string res;
+	for(unsigned i=0;i<m_workers.size();i++){
+		if(i>0)
+			res+=", ";
+		res+=m_workers[i]->Name()+" : "+std::to_string(m_rows[i])+" rows";
+	}
+	return res;
+}
+
+void StepWorldV7Bands(world_t &world, float dt, unsigned n)
+{
+	band_session_t session(world, BandOptionsFromEnv());
+	session.Step(dt, n);
+	session.ReadWorld(world);
+}
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
@@ -0,0 +1,120 @@
+#ifndef hpce_yl10313_step_bands_hpp
+#define hpce_yl10313_step_bands_hpp
+
+#include <memory>
+
+#include "step_world_session.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+	//! What a band session splits the world across
+	struct band_options_t
+	{
+		//! OpenCL devices, each of which gets a band
+		std::vector<cl::Device> devices;
+		//! Host threads, each of which gets a band
+		unsigned threads;
+		//! Steps between halo exchanges, which is also how many rows deep the halos are
+		/*! Deeper halos mean fewer (but larger) exchanges, at the cost of stepping
+			the halo rows redundantly.
+		*/
+		unsigned halo;
+		//! Move rows between bands according to how fast each one turns out to be
+		bool rebalance;
+
+		band_options_t()
+			: threads(1)
+			, halo(4)
+			, rebalance(true)
+		{}
+	};
+
+	//! Options taken from the environment
+	/*! HPCE_BAND_DEVICES is "all" (the default), "none", or a comma separated list
+		of platform.device pairs, e.g. "0.0,1.0". HPCE_BAND_THREADS gives the number
+		of host threads (default 1), HPCE_BAND_HALO the steps between exchanges
+		(default 4), and HPCE_BAND_REBALANCE=0 keeps the bands fixed.
+	*/
+	band_options_t BandOptionsFromEnv();
+
+	class band_worker_t;
+
+	//! A world split into horizontal bands, stepped on several devices and host threads at once
+	/*! Each worker owns a band of rows, and keeps a copy of those rows plus a halo
+		of halo rows from the bands either side. Workers step their copy halo steps
+		at a time, all in parallel. The rows at the edge of each copy go stale, as
+		their neighbours outside the copy aren't being stepped, but the staleness
+		only moves in by one row per step, so the owned rows stay exact. Between
+		rounds the rows next to each boundary are copied through the host into the
+		halos of the neighbours.
+
+		Each worker is timed every round, and the timings are gathered over windows
+		of at least 16 rounds and 50ms. If two windows in a row both say the slowest
+		band would finish 10% sooner with the rows redistributed in proportion to
+		each worker's speed, and that moves more than one row, the bands are
+		reloaded. Each rebalance doubles the next window, up to 2s.
+
+		Every worker uses the same arithmetic as StepWorld, so the results are
+		identical whatever the split.
+	*/
+	class band_session_t
+	{
+	private:
+		unsigned m_w, m_h;
+		float m_alpha;
+		float m_t;
+		band_options_t m_options;
+
+		world_t m_world;	//! Host copy, where rows go between workers
+		std::vector<uint32_t> m_packed;
+		std::vector<std::unique_ptr<band_worker_t> > m_workers;
+		std::vector<unsigned> m_rows;	//! Rows owned by each worker, top to bottom
+		unsigned m_rounds;
+
+		// Timings since the last decision about rebalancing
+		std::vector<double> m_windowWork;	//! Rows*steps stepped by each worker
+		std::vector<double> m_windowBusy;	//! Seconds each worker spent stepping
+		unsigned m_windowRounds;
+		double m_windowSeconds;	//! Wall time of the rounds, i.e. of the slowest worker in each
+		double m_minWindowSeconds;	//! How long a window has to last before deciding
+		std::vector<double> m_lastSpeed;	//! Rows*steps per second of each worker in the window before, or empty
+
+		band_session_t(const band_session_t &);	// Not copyable
+		band_session_t &operator=(const band_session_t &);
+
+		//! Give each worker its rows from m_world
+		void LoadBands();
+		//! Step every worker n<=halo times, then exchange halos
+		void Round(float inner, float outer, unsigned n);
+		//! Start collecting timings for the next decision
+		void StartWindow();
+		//! Move rows between workers if a whole window of timings says it is worthwhile
+		void Rebalance();
+	public:
+		band_session_t(const world_t &world, const band_options_t &options=band_options_t());
+		~band_session_t();
+
+		//! Take n steps of size dt
+		void Step(float dt, unsigned n);
+
+		//! Copy the current state and time into world
+		/*! world must have the same dimensions as the one the session was created from */
+		void ReadWorld(world_t &world);
+
+		//! Describe who owns which rows, e.g. "host 0 : 40 rows, platform 0 device 0 : 60 rows"
+		std::string DescribeBands() const;
+
+		float Time() const
+		{ return m_t; }
+	};
+
+	//! Same interface as the other versions, using a band session (with options from the environment) for the duration of the call
+	void StepWorldV7Bands(world_t &world, float dt, unsigned n);
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
+
+#endif
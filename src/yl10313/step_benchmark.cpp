@@ -0,0 +1,401 @@
+#include "step_engines.hpp"
+#include "step_timeline.hpp"
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <stdexcept>
+#include <algorithm>
+
+// Usage: step_benchmark [sizes [steps [threads]]]
+//
+//   sizes    Comma separated world sizes, as for make_world (default 64,256,1024)
+//   steps    Comma separated numbers of steps (default 10,100)
+//   threads  Comma separated host thread counts (default 1,2,4), which only
+//            engines that can use threads are run with. Each is passed on
+//            through HPCE_BAND_THREADS.
+//
+// Every engine from StepEngines is run on every combination, unless
+// HPCE_BENCH_ENGINES gives a comma separated list of them. Loading, stepping
+// and saving are timed separately, so parsing and formatting don't hide the
+// stepping. Each is the best of HPCE_BENCH_REPEATS runs (default 3). Worlds
+// are loaded from and saved to memory, in the text format unless
+// HPCE_BENCH_BINARY=1.
+//
+// The results go to stdout as CSV, or as JSON with HPCE_BENCH_FORMAT=json.
+// Each row has the cell updates per second (GCUP/s), the memory traffic of
+// stepping in GB/s (counting one read of the state and properties and one
+// write of the state per cell update, so caches can make it look higher than
+// the hardware allows), the size of the world file per cell, the step time of
+// the reference over this one, the scaling efficiency compared to one thread
+// (only for engines that use threads), and whether the result matches the
+// reference. Saving the CSV and passing it back as HPCE_BENCH_BASELINE adds
+// the baseline step time over this one. Engines that fail are listed as
+// skipped, after the rows in CSV and in "skipped" in JSON.
+//
+// Steps more than HPCE_BENCH_TOLERANCE (default 0.1) slower than the baseline
+// are reported on stderr, and make the exit status 2. A result that doesn't
+// match the reference makes it 1, and nothing being measured at all makes it 3.
+
+namespace{
+
+	typedef std::chrono::steady_clock bench_clock_t;
+
+	//! One engine on one world size, step count and thread count
+	struct bench_result_t
+	{
+		std::string engine;
+		unsigned w, h, steps, threads;
+		double loadSeconds, stepSeconds, saveSeconds;
+		double fileBytesPerCell;	//! Size of the world file, divided by the cells
+		double speedup;	//! Reference step time over this one, or zero if unknown
+		double efficiency;	//! Step time with one thread over threads times this one, or zero if unknown
+		double vsBaseline;	//! Baseline step time over this one, or zero if there isn't one
+		bool matches;	//! Same final state as the reference
+
+		double CellUpdatesPerSecond() const
+		{ return stepSeconds>0 ? (double)w*h*steps/stepSeconds : 0.0; }
+
+		//! Bytes a step has to move per cell update, ignoring any reuse in caches
+		static double TrafficBytesPerCell()
+		{ return 2*sizeof(float)+sizeof(hpce::cell_flags_t); }
+	};
+
+	//! An engine that couldn't run on one world size, step count and thread count
+	struct bench_skip_t
+	{
+		std::string engine;
+		unsigned w, h, steps, threads;
+		std::string reason;
+	};
+
+	double Seconds(bench_clock_t::time_point begin)
+	{
+		return std::chrono::duration<double>(bench_clock_t::now()-begin).count();
+	}
+
+	std::vector<unsigned> ParseList(const char *list, const char *what)
+	{
+		std::vector<unsigned> res;
+		std::istringstream src(list);
+		std::string item;
+		while(std::getline(src, item, ',')){
+			char *end;
+			unsigned long x=strtoul(item.c_str(), &end, 10);
+			if(item.empty() || *end || x==0)
+				throw std::invalid_argument(std::string("ParseList : ")+what+" should look like 64,256,1024.");
+			res.push_back((unsigned)x);
+		}
+		if(res.empty())
+			throw std::invalid_argument(std::string("ParseList : No ")+what+" given.");
+		return res;
+	}
+
+	std::vector<const hpce::yl10313::step_engine_t *> EnginesFromEnv()
+	{
+		std::vector<const hpce::yl10313::step_engine_t *> res;
+		if(getenv("HPCE_BENCH_ENGINES") && *getenv("HPCE_BENCH_ENGINES")){
+			std::istringstream src(getenv("HPCE_BENCH_ENGINES"));
+			std::string name;
+			while(std::getline(src, name, ',')){
+				res.push_back(&hpce::yl10313::FindStepEngine(name));
+			}
+		}else{
+			const std::vector<hpce::yl10313::step_engine_t> &engines=hpce::yl10313::StepEngines();
+			for(unsigned i=0;i<engines.size();i++){
+				res.push_back(&engines[i]);
+			}
+		}
+		return res;
+	}
+
+	std::string BaselineKey(const std::string &engine, unsigned w, unsigned h, unsigned steps, unsigned threads)
+	{
+		std::stringstream res;
+		res<<engine<<","<<w<<","<<h<<","<<steps<<","<<threads;
+		return res.str();
+	}
+
+	//! Step times from the CSV of an earlier run, keyed by BaselineKey
+	std::map<std::string,double> LoadBaseline(const char *fileName)
+	{
+		std::ifstream src(fileName);
+		if(!src.is_open())
+			throw std::runtime_error(std::string("LoadBaseline : Couldn't open '")+fileName+"'.");
+
+		// Columns are found by name, so baselines survive new columns being added
+		std::string line, cell;
+		std::getline(src, line);
+		std::map<std::string,unsigned> columns;
+		std::istringstream header(line);
+		for(unsigned i=0;std::getline(header, cell, ',');i++){
+			columns[cell]=i;
+		}
+		const char *needed[]={ "engine", "w", "h", "steps", "threads", "stepSeconds" };
+		for(unsigned i=0;i<6;i++){
+			if(!columns.count(needed[i]))
+				throw std::runtime_error(std::string("LoadBaseline : '")+fileName+"' has no "+needed[i]+" column.");
+		}
+
+		std::map<std::string,double> res;
+		while(std::getline(src, line)){
+			if(!line.empty() && line[0]=='#')
+				continue;	// Skipped engines
+			std::vector<std::string> cells;
+			std::istringstream row(line);
+			while(std::getline(row, cell, ',')){
+				cells.push_back(cell);
+			}
+			if(cells.size()<columns.size())
+				continue;
+			std::string key=cells[columns["engine"]]+","+cells[columns["w"]]+","+cells[columns["h"]]
+				+","+cells[columns["steps"]]+","+cells[columns["threads"]];
+			res[key]=strtod(cells[columns["stepSeconds"]].c_str(), NULL);
+		}
+		return res;
+	}
+
+	//! Load, step and save a world with one engine, keeping the best of several runs
+	bench_result_t Run(const hpce::yl10313::step_engine_t &engine, const std::string &file, unsigned steps, unsigned threads, unsigned repeats, bool binary, const hpce::world_t &expected)
+	{
+		char buffer[16];
+		snprintf(buffer, sizeof(buffer), "%u", threads);
+		setenv("HPCE_BAND_THREADS", buffer, 1);
+
+		bench_result_t res;
+		res.engine=engine.name;
+		res.steps=steps;
+		res.threads=threads;
+		res.speedup=0;
+		res.efficiency=0;
+		res.vsBaseline=0;
+		res.matches=true;
+
+		for(unsigned i=0;i<repeats;i++){
+			std::istringstream src(file);
+			bench_clock_t::time_point begin=bench_clock_t::now();
+			hpce::world_t world=hpce::LoadWorld(src);
+			double loadSeconds=Seconds(begin);
+
+			begin=bench_clock_t::now();
+			engine.step(world, 0.1f, steps);
+			double stepSeconds=Seconds(begin);
+
+			std::ostringstream dst;
+			begin=bench_clock_t::now();
+			hpce::SaveWorld(dst, world, binary);
+			double saveSeconds=Seconds(begin);
+
+			res.matches = res.matches && (world.state==expected.state);
+			if(i==0){
+				res.w=world.w;
+				res.h=world.h;
+				res.fileBytesPerCell=(double)file.size()/((double)world.w*world.h);
+				res.loadSeconds=loadSeconds;
+				res.stepSeconds=stepSeconds;
+				res.saveSeconds=saveSeconds;
+			}else{
+				res.loadSeconds=std::min(res.loadSeconds, loadSeconds);
+				res.stepSeconds=std::min(res.stepSeconds, stepSeconds);
+				res.saveSeconds=std::min(res.saveSeconds, saveSeconds);
+			}
+		}
+		return res;
+	}
+
+	//! Zero is unknown, which is an empty cell in CSV and null in JSON
+	std::string Optional(double x, bool json)
+	{
+		if(x==0)
+			return json ? "null" : "";
+		std::stringstream res;
+		res<<x;
+		return res.str();
+	}
+
+	//! Skipped engines go after the rows as comments, with any commas in the reason replaced
+	void WriteCsv(std::ostream &dst, const std::vector<bench_result_t> &results, const std::vector<bench_skip_t> &skipped)
+	{
+		dst<<"engine,w,h,steps,threads,loadSeconds,stepSeconds,saveSeconds,gcups,gbPerSecond,fileBytesPerCell,speedup,efficiency,vsBaseline,matches\n";
+		for(unsigned i=0;i<results.size();i++){
+			const bench_result_t &r=results[i];
+			dst<<r.engine<<","<<r.w<<","<<r.h<<","<<r.steps<<","<<r.threads
+				<<","<<r.loadSeconds<<","<<r.stepSeconds<<","<<r.saveSeconds
+				<<","<<r.CellUpdatesPerSecond()*1e-9<<","<<r.CellUpdatesPerSecond()*bench_result_t::TrafficBytesPerCell()*1e-9
+				<<","<<r.fileBytesPerCell
+				<<","<<Optional(r.speedup, false)<<","<<Optional(r.efficiency, false)<<","<<Optional(r.vsBaseline, false)
+				<<","<<(r.matches ? 1 : 0)<<"\n";
+		}
+		for(unsigned i=0;i<skipped.size();i++){
+			const bench_skip_t &s=skipped[i];
+			std::string reason=s.reason;
+			std::replace(reason.begin(), reason.end(), ',', ';');
+			std::replace(reason.begin(), reason.end(), '\n', ' ');
+			dst<<"# skipped,"<<s.engine<<","<<s.w<<","<<s.h<<","<<s.steps<<","<<s.threads<<","<<reason<<"\n";
+		}
+	}
+
+	void WriteJson(std::ostream &dst, const std::vector<bench_result_t> &results, const std::vector<bench_skip_t> &skipped)
+	{
+		using hpce::yl10313::JsonString;
+
+		dst<<"{\n  \"runs\": [";
+		for(unsigned i=0;i<results.size();i++){
+			const bench_result_t &r=results[i];
+			dst<<(i ? ",\n    " : "\n    ")<<"{\"engine\": "<<JsonString(r.engine)<<", \"w\": "<<r.w<<", \"h\": "<<r.h
+				<<", \"steps\": "<<r.steps<<", \"threads\": "<<r.threads
+				<<", \"loadSeconds\": "<<r.loadSeconds<<", \"stepSeconds\": "<<r.stepSeconds<<", \"saveSeconds\": "<<r.saveSeconds
+				<<", \"gcups\": "<<r.CellUpdatesPerSecond()*1e-9
+				<<", \"gbPerSecond\": "<<r.CellUpdatesPerSecond()*bench_result_t::TrafficBytesPerCell()*1e-9
+				<<", \"fileBytesPerCell\": "<<r.fileBytesPerCell
+				<<", \"speedup\": "<<Optional(r.speedup, true)<<", \"efficiency\": "<<Optional(r.efficiency, true)
+				<<", \"vsBaseline\": "<<Optional(r.vsBaseline, true)
+				<<", \"matches\": "<<(r.matches ? "true" : "false")<<"}";
+		}
+		dst<<(results.empty() ? "],\n  \"skipped\": [" : "\n  ],\n  \"skipped\": [");
+		for(unsigned i=0;i<skipped.size();i++){
+			const bench_skip_t &s=skipped[i];
+			dst<<(i ? ",\n    " : "\n    ")<<"{\"engine\": "<<JsonString(s.engine)<<", \"w\": "<<s.w<<", \"h\": "<<s.h
+				<<", \"steps\": "<<s.steps<<", \"threads\": "<<s.threads
+				<<", \"reason\": "<<JsonString(s.reason)<<"}";
+		}
+		dst<<(skipped.empty() ? "]\n}\n" : "\n  ]\n}\n");
+	}
+
+}; // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+	const char *sizeList="64,256,1024", *stepList="10,100", *threadList="1,2,4";
+	if(argc>1){
+		sizeList=argv[1];
+	}
+	if(argc>2){
+		stepList=argv[2];
+	}
+	if(argc>3){
+		threadList=argv[3];
+	}
+
+	try{
+		std::vector<unsigned> sizes=ParseList(sizeList, "sizes");
+		std::vector<unsigned> stepCounts=ParseList(stepList, "steps");
+		std::vector<unsigned> threadCounts=ParseList(threadList, "threads");
+		std::vector<const hpce::yl10313::step_engine_t *> engines=EnginesFromEnv();
+
+		unsigned repeats=3;
+		if(getenv("HPCE_BENCH_REPEATS") && *getenv("HPCE_BENCH_REPEATS")){
+			repeats=std::max(1, atoi(getenv("HPCE_BENCH_REPEATS")));
+		}
+		bool binary=getenv("HPCE_BENCH_BINARY") && atoi(getenv("HPCE_BENCH_BINARY"));
+		bool json=false;
+		if(getenv("HPCE_BENCH_FORMAT") && *getenv("HPCE_BENCH_FORMAT")){
+			std::string format=getenv("HPCE_BENCH_FORMAT");
+			if(format=="json"){
+				json=true;
+			}else if(format!="csv"){
+				throw std::invalid_argument("HPCE_BENCH_FORMAT should be csv or json.");
+			}
+		}
+		std::map<std::string,double> baseline;
+		if(getenv("HPCE_BENCH_BASELINE") && *getenv("HPCE_BENCH_BASELINE")){
+			baseline=LoadBaseline(getenv("HPCE_BENCH_BASELINE"));
+		}
+		double tolerance=0.1;
+		if(getenv("HPCE_BENCH_TOLERANCE") && *getenv("HPCE_BENCH_TOLERANCE")){
+			tolerance=strtod(getenv("HPCE_BENCH_TOLERANCE"), NULL);
+		}
+
+		std::vector<bench_result_t> results;
+		std::vector<bench_skip_t> skipped;
+		for(unsigned si=0;si<sizes.size();si++){
+			hpce::world_t world=hpce::MakeTestWorld(sizes[si], 0.1f);
+			std::ostringstream file;
+			hpce::SaveWorld(file, world, binary);
+
+			for(unsigned ni=0;ni<stepCounts.size();ni++){
+				unsigned steps=stepCounts[ni];
+				std::cerr<<"Benchmarking w="<<world.w<<", h="<<world.h<<", n="<<steps<<std::endl;
+
+				// What every engine should get, which isn't timed
+				hpce::world_t expected=world;
+				hpce::StepWorld(expected, 0.1f, steps);
+
+				double referenceSeconds=0;
+				for(unsigned ei=0;ei<engines.size();ei++){
+					const hpce::yl10313::step_engine_t &engine=*engines[ei];
+					bool threaded=(engine.flags & hpce::yl10313::Engine_Threads)!=0;
+					double singleSeconds=0;
+					for(unsigned ti=0;ti<threadCounts.size();ti++){
+						unsigned threads=threadCounts[ti];
+						if(!threaded && ti>0)
+							break;	// The thread count makes no difference
+						bench_result_t r;
+						try{
+							r=Run(engine, file.str(), steps, threaded ? threads : 1, repeats, binary, expected);
+						}catch(const std::exception &e){
+							std::cerr<<"Skipping "<<engine.name<<" : "<<e.what()<<std::endl;
+							bench_skip_t skip={ engine.name, world.w, world.h, steps, threaded ? threads : 1, e.what() };
+							skipped.push_back(skip);
+							break;
+						}
+
+						if(!strcmp(engine.name, "reference")){
+							referenceSeconds=r.stepSeconds;
+						}
+						if(referenceSeconds>0 && r.stepSeconds>0){
+							r.speedup=referenceSeconds/r.stepSeconds;
+						}
+						if(r.threads==1){
+							singleSeconds=r.stepSeconds;
+						}
+						// Engines that ignore the thread count have no scaling to speak of
+						if(threaded && singleSeconds>0 && r.stepSeconds>0){
+							r.efficiency=singleSeconds/(r.threads*r.stepSeconds);
+						}
+
+						std::string key=BaselineKey(r.engine, r.w, r.h, r.steps, r.threads);
+						if(baseline.count(key) && r.stepSeconds>0){
+							r.vsBaseline=baseline[key]/r.stepSeconds;
+						}
+						if(!r.matches){
+							std::cerr<<"Mismatch : "<<key<<" doesn't give the same state as the reference"<<std::endl;
+						}
+						results.push_back(r);
+					}
+				}
+			}
+		}
+
+		if(json){
+			WriteJson(std::cout, results, skipped);
+		}else{
+			WriteCsv(std::cout, results, skipped);
+		}
+
+		if(results.empty()){
+			std::cerr<<"Nothing was measured, as every engine was skipped"<<std::endl;
+			return 3;
+		}
+
+		// Only compared once everything has run, so one slow engine doesn't stop the rest
+		bool mismatch=false, regression=false;
+		for(unsigned i=0;i<results.size();i++){
+			const bench_result_t &r=results[i];
+			mismatch = mismatch || !r.matches;
+			if(r.vsBaseline>0 && r.vsBaseline<1/(1+tolerance)){
+				std::cerr<<"Regression : "<<BaselineKey(r.engine, r.w, r.h, r.steps, r.threads)
+					<<" took "<<r.stepSeconds<<"s to step, against "<<r.stepSeconds*r.vsBaseline<<"s in the baseline"<<std::endl;
+				regression=true;
+			}
+		}
+		return mismatch ? 1 : regression ? 2 : 0;
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,100 @@
+#include "step_engines.hpp"
+#include "step_bands.hpp"
+#include "step_ensemble.hpp"
+
+#include <stdexcept>
+
+namespace hpce{
+
+namespace yl10313{
+
+namespace{
+
+	//! An ensemble of one, so the ensemble kernel can be compared with the others
+	void StepWorldV8Ensemble(world_t &world, float dt, unsigned n)
+	{
+		std::vector<world_t> worlds(1, world);
+		StepWorldsV8Ensemble(worlds, std::vector<float>(1, dt), n);
+		world=worlds[0];
+	}
+
+	bool HaveOpenCLDevice()
+	{
+		try{
+			std::vector<cl::Platform> platforms;
+			cl::Platform::get(&platforms);
+			for(unsigned i=0;i<platforms.size();i++){
+				std::vector<cl::Device> devices;
+				platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+				if(!devices.empty())
+					return true;
+			}
+		}catch(const cl::Error &){
+			// No platforms is reported as an error by some run-times
+		}
+		return false;
+	}
+
+}; // anonymous namespace
+
+const std::vector<step_engine_t> &StepEngines()
+{
+	static const step_engine_t engines[]={
+		{ "reference", "StepWorld from heat.cpp", Engine_Host, StepWorld },
+		{ "v1_lambda", "Reference with the cell update as a lambda", Engine_Host, StepWorldV1Lambda },
+		{ "v2_function", "Reference with the cell update as a free function", Engine_Host, StepWorldV2Function },
+		{ "v3_opencl", "OpenCL, copying the state both ways every step", Engine_OpenCL, StepWorldV3OpenCL },
+		{ "v4_double_buffered", "OpenCL, with the state kept on the device", Engine_OpenCL, StepWorldV4DoubleBufferd },
+		{ "v5_packed_properties", "OpenCL, with the neighbours packed into the properties", Engine_OpenCL, StepWorldV5PackedProperties },
+		{ "v6_session", "OpenCL session with the kernel and device from the tuner", Engine_OpenCL|Engine_Host|Engine_Tuned, StepWorldV6Session },
+		{ "v7_bands", "Bands split across devices and host threads", Engine_OpenCL|Engine_Host|Engine_Threads|Engine_MultiDevice, StepWorldV7Bands },
+		{ "v8_ensemble", "OpenCL ensemble kernel, with an ensemble of one", Engine_OpenCL|Engine_Ensemble, StepWorldV8Ensemble }
+	};
+	static const std::vector<step_engine_t> res(engines, engines+sizeof(engines)/sizeof(engines[0]));
+	return res;
+}
+
+const step_engine_t &FindStepEngine(const std::string &name)
+{
+	if(name=="auto")
+		return ChooseStepEngine();
+
+	const std::vector<step_engine_t> &engines=StepEngines();
+	std::string names;
+	for(unsigned i=0;i<engines.size();i++){
+		std::string full=engines[i].name;
+		if( name==full || name==full.substr(0, full.find('_')) )
+			return engines[i];
+		names += (i ? ", " : "") + full;
+	}
+	throw std::invalid_argument("FindStepEngine : Unknown engine '"+name+"', which should be auto or one of "+names+".");
+}
+
+const step_engine_t &ChooseStepEngine()
+{
+	// The session engine falls back to the host by itself when that is faster
+	return FindStepEngine(HaveOpenCLDevice() ? "v6_session" : "reference");
+}
+
+std::string DescribeEngineFlags(unsigned flags)
+{
+	static const struct{ unsigned flag; const char *name; } names[]={
+		{ Engine_Host, "host" },
+		{ Engine_OpenCL, "opencl" },
+		{ Engine_Threads, "threads" },
+		{ Engine_MultiDevice, "multi-device" },
+		{ Engine_Tuned, "tuned" },
+		{ Engine_Ensemble, "ensemble" }
+	};
+	std::string res;
+	for(unsigned i=0;i<sizeof(names)/sizeof(names[0]);i++){
+		if(flags & names[i].flag){
+			res += (res.empty() ? "" : ", ") + std::string(names[i].name);
+		}
+	}
+	return res;
+}
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
@@ -0,0 +1,60 @@
+#ifndef hpce_yl10313_step_engines_hpp
+#define hpce_yl10313_step_engines_hpp
+
+#include <string>
+#include <vector>
+
+#include "heat.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+	//! What an engine needs, and what it can do, as a combination of bits
+	typedef enum{
+		Engine_Host		=0x01,	//! Can step on the host CPU
+		Engine_OpenCL		=0x02,	//! Needs (or can use) an OpenCL device
+		Engine_Threads		=0x04,	//! Can use several host threads, from HPCE_BAND_THREADS
+		Engine_MultiDevice	=0x08,	//! Can use several OpenCL devices at once
+		Engine_Tuned		=0x10,	//! Chooses its own kernel and device, e.g. from the tuning database
+		Engine_Ensemble		=0x20	//! Built to step many worlds together, so slow for just one
+	}step_engine_flags_t;
+
+	//! One way of stepping a world, all with the same interface as StepWorld
+	/*! Every engine gives exactly the same results as StepWorld, so they can be
+		swapped freely. Any further options come from the environment, as they do
+		for the step_world_* program of the same name.
+	*/
+	struct step_engine_t
+	{
+		const char *name;	//! e.g. "v5_packed_properties", as for bin/step_world_v5_packed_properties
+		const char *description;
+		unsigned flags;	//! Combination of step_engine_flags_t
+		void (*step)(world_t &world, float dt, unsigned n);
+	};
+
+	//! Every engine, in the order they were written, starting with the reference
+	const std::vector<step_engine_t> &StepEngines();
+
+	//! Engine with the given name, or just its version, so "v3" is "v3_opencl"
+	/*! "auto" gives ChooseStepEngine(). */
+	const step_engine_t &FindStepEngine(const std::string &name);
+
+	//! The session engine if there is an OpenCL device, and the reference otherwise
+	const step_engine_t &ChooseStepEngine();
+
+	//! Flags as a readable list, e.g. "host, threads"
+	std::string DescribeEngineFlags(unsigned flags);
+
+	// Defined alongside the main functions of the step_world_* programs
+	void StepWorldV1Lambda(world_t &world, float dt, unsigned n);
+	void StepWorldV2Function(world_t &world, float dt, unsigned n);
+	void StepWorldV3OpenCL(world_t &world, float dt, unsigned n);
+	void StepWorldV4DoubleBufferd(world_t &world, float dt, unsigned n);
+	void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n);
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
+
+#endif
@@ -0,0 +1,167 @@
+#include "step_ensemble.hpp"
+
+#include <stdexcept>
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+
+#include "program_cache.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+namespace{
+
+	//! Launches enqueued between flushes, as for step_session_t
+	const unsigned Ensemble_Batch=64;
+
+}; // anonymous namespace
+
+ensemble_session_t::ensemble_session_t(const std::vector<world_t> &worlds, const cl::Device &device)
+	: m_cells(0)
+	, m_device(device)
+	, m_current(0)
+{
+	if(worlds.empty())
+		throw std::invalid_argument("ensemble_session_t : Ensemble has no worlds.");
+
+	unsigned maxW=0, maxH=0;
+	std::vector<cl_uint> sizes;
+	for(unsigned i=0;i<worlds.size();i++){
+		const world_t &world=worlds[i];
+		size_t cells=WorldCells(world.w, world.h);
+		if( (world.state.size()!=cells) || (world.properties.size()!=cells) )
+			throw std::invalid_argument("ensemble_session_t : World state and properties don't match its dimensions.");
+
+		m_w.push_back(world.w);
+		m_h.push_back(world.h);
+		m_alpha.push_back(world.alpha);
+		m_t.push_back(world.t);
+		m_offsets.push_back(m_cells);
+		sizes.push_back(world.w);
+		sizes.push_back(world.h);
+		m_cells+=cells;
+		maxW=std::max(maxW, world.w);
+		maxH=std::max(maxH, world.h);
+	}
+
+	// Every world is packed on the host, then narrowed to a byte per cell
+	std::vector<uint8_t> packed(m_cells);
+	std::vector<float> state(m_cells);
+	for(unsigned i=0;i<worlds.size();i++){
+		std::vector<uint32_t> props=PackProperties(worlds[i]);
+		std::copy(props.begin(), props.end(), packed.begin()+m_offsets[i]);
+		std::copy(worlds[i].state.begin(), worlds[i].state.end(), state.begin()+m_offsets[i]);
+	}
+
+	std::vector<cl::Device> devices(1, m_device);
+	m_context=cl::Context(devices);
+	m_queue=cl::CommandQueue(m_context, m_device);
+
+	size_t cbBuffer=sizeof(float)*m_cells;
+	if(cbBuffer > m_device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+		throw std::runtime_error("ensemble_session_t : Ensemble is too large to fit in a single buffer on this device.");
+
+	m_buffProperties=cl::Buffer(m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, m_cells, &packed[0]);
+	m_buffOffsets=cl::Buffer(m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_ulong)*m_offsets.size(), &m_offsets[0]);
+	m_buffSizes=cl::Buffer(m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint)*sizes.size(), &sizes[0]);
+	m_buffCoefficients=cl::Buffer(m_context, CL_MEM_READ_ONLY, 2*sizeof(float)*worlds.size());
+	m_buffers[0]=cl::Buffer(m_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, cbBuffer, &state[0]);
+	m_buffers[1]=cl::Buffer(m_context, CL_MEM_READ_WRITE, cbBuffer);
+
+	m_program=BuildProgram(m_context, m_device, "step_world_ensemble_kernel.cl");
+	for(unsigned i=0;i<2;i++){
+		m_kernels[i]=cl::Kernel(m_program, "kernel_ensemble");
+		m_kernels[i].setArg(0, m_buffers[i]);
+		m_kernels[i].setArg(1, m_buffCoefficients);
+		m_kernels[i].setArg(2, m_buffers[1-i]);
+		m_kernels[i].setArg(3, m_buffProperties);
+		m_kernels[i].setArg(4, m_buffOffsets);
+		m_kernels[i].setArg(5, m_buffSizes);
+	}
+	m_globalSize=cl::NDRange(maxW, maxH, worlds.size());
+}
+
+void ensemble_session_t::Step(float dt, unsigned n)
+{
+	Step(std::vector<float>(Count(), dt), n);
+}
+
+void ensemble_session_t::Step(const std::vector<float> &dt, unsigned n)
+{
+	if(dt.size()!=Count())
+		throw std::invalid_argument("ensemble_session_t::Step : Need one step size for each world.");
+	if(n==0)
+		return;
+
+	if(dt!=m_boundDt){
+		// The in-order queue makes earlier launches finish with the old values first
+		std::vector<float> coefficients(2*Count());
+		for(unsigned i=0;i<Count();i++){
+			float outer=m_alpha[i]*dt[i];		// We spread alpha to other cells per time
+			float inner=1-outer/4;				// Anything that doesn't spread stays
+			coefficients[2*i]=inner;
+			coefficients[2*i+1]=outer;
+		}
+		m_queue.enqueueWriteBuffer(m_buffCoefficients, CL_TRUE, 0, sizeof(float)*coefficients.size(), &coefficients[0]);
+		m_boundDt=dt;
+	}
+
+	// As in step_session_t, at most two batches are in flight
+	std::deque<cl::Event> batchEnds;
+	for(unsigned i=0;i<n;i++){
+		bool endOfBatch=((i+1)%Ensemble_Batch==0);
+		cl::Event event;
+		m_queue.enqueueNDRangeKernel(m_kernels[m_current], cl::NullRange, m_globalSize, cl::NullRange,
+			NULL, endOfBatch ? &event : NULL);
+		m_current=1-m_current;
+
+		if(endOfBatch){
+			m_queue.flush();
+			batchEnds.push_back(event);
+			if(batchEnds.size()>2){
+				batchEnds.front().wait();
+				batchEnds.pop_front();
+			}
+		}
+	}
+	m_queue.flush();
+
+	// Time is stepped one dt at a time, to round exactly like the reference
+	for(unsigned i=0;i<Count();i++){
+		for(unsigned t=0;t<n;t++){
+			m_t[i] += dt[i];
+		}
+	}
+}
+
+void ensemble_session_t::ReadWorlds(std::vector<world_t> &worlds)
+{
+	if(worlds.size()!=Count())
+		throw std::invalid_argument("ensemble_session_t::ReadWorlds : Number of worlds doesn't match the ensemble.");
+	for(unsigned i=0;i<Count();i++){
+		if( (worlds[i].w!=m_w[i]) || (worlds[i].h!=m_h[i]) )
+			throw std::invalid_argument("ensemble_session_t::ReadWorlds : World dimensions don't match the ensemble.");
+	}
+
+	// Each read goes straight into its world, and only the last one blocks
+	for(unsigned i=0;i<Count();i++){
+		size_t cells=WorldCells(m_w[i], m_h[i]);
+		worlds[i].state.resize(cells);
+		m_queue.enqueueReadBuffer(m_buffers[m_current], (i+1==Count()) ? CL_TRUE : CL_FALSE,
+			sizeof(float)*m_offsets[i], sizeof(float)*cells, &worlds[i].state[0]);
+		worlds[i].t=m_t[i];
+	}
+}
+
+void StepWorldsV8Ensemble(std::vector<world_t> &worlds, const std::vector<float> &dt, unsigned n)
+{
+	ensemble_session_t session(worlds);
+	session.Step(dt, n);
+	session.ReadWorlds(worlds);
+}
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
@@ -0,0 +1,72 @@
+#ifndef hpce_yl10313_step_ensemble_hpp
+#define hpce_yl10313_step_ensemble_hpp
+
+#include "step_world_session.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+	//! Many worlds stepped together on one OpenCL device
+	/*! Worlds of a few hundred cells across can't keep a device busy on their own,
+		and stepping each in its own session pays for the set-up and a launch per
+		step every time. An ensemble packs all the worlds into one pair of buffers,
+		and every step is a single launch of step_world_ensemble_kernel.cl over a 3D
+		range, with one world per slice.
+
+		The worlds can have different sizes, alphas, states and step sizes, but the
+		range is as large as the largest world in every slice, so worlds of similar
+		size waste the least. Each world gets exactly the same results as StepWorld.
+	*/
+	class ensemble_session_t
+	{
+	private:
+		std::vector<unsigned> m_w, m_h;
+		std::vector<float> m_alpha;
+		std::vector<float> m_t;
+		std::vector<cl_ulong> m_offsets;	//! Index of the first cell of each world in the buffers
+		size_t m_cells;	//! Cells in all the worlds together
+
+		cl::Device m_device;
+		cl::Context m_context;
+		cl::CommandQueue m_queue;
+		cl::Program m_program;
+		cl::NDRange m_globalSize;
+
+		cl::Buffer m_buffProperties;
+		cl::Buffer m_buffOffsets, m_buffSizes, m_buffCoefficients;
+		cl::Buffer m_buffers[2];
+		cl::Kernel m_kernels[2];	//! m_kernels[i] steps m_buffers[i] into m_buffers[1-i]
+		unsigned m_current;	//! Index of the buffer holding the current state
+
+		std::vector<float> m_boundDt;	//! Step sizes in m_buffCoefficients, or empty if none yet
+
+		ensemble_session_t(const ensemble_session_t &);	// Not copyable
+		ensemble_session_t &operator=(const ensemble_session_t &);
+	public:
+		//! Copy the worlds to the device, ready to be stepped
+		ensemble_session_t(const std::vector<world_t> &worlds, const cl::Device &device=SelectDevice());
+
+		//! Enqueue n steps, with world i stepped by dt[i] each time
+		void Step(const std::vector<float> &dt, unsigned n);
+
+		//! Enqueue n steps of size dt for every world
+		void Step(float dt, unsigned n);
+
+		//! Wait for outstanding steps, then copy the current state and time of every world
+		/*! worlds must have the same dimensions as the ones the session was created from */
+		void ReadWorlds(std::vector<world_t> &worlds);
+
+		//! Number of worlds in the ensemble
+		unsigned Count() const
+		{ return m_w.size(); }
+	};
+
+	//! Step each world by its own dt, n times, in a single ensemble (on the device from SelectDevice)
+	void StepWorldsV8Ensemble(std::vector<world_t> &worlds, const std::vector<float> &dt, unsigned n);
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
+
+#endif
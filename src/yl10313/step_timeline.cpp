@@ -0,0 +1,207 @@
+#include "step_timeline.hpp"
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+namespace hpce{
+
+namespace yl10313{
+
+namespace{
+
+	//! Commands kept individually in the report, after which only the totals grow
+	const unsigned Timeline_Records=4096;
+
+	//! Commands allowed to be outstanding before Add waits for the oldest
+	const unsigned Timeline_Pending=1024;
+
+	//! Bytes per second as GB/s, or zero if there was no time to divide by
+	double GigabytesPerSecond(uint64_t bytes, double seconds)
+	{
+		return seconds>0 ? bytes/seconds*1e-9 : 0.0;
+	}
+
+}; // anonymous namespace
+
+const char *TimelinePhaseName(timeline_phase_t phase)
+{
+	switch(phase){
+	case Phase_Compile:	return "compile";
+	case Phase_Pack:	return "pack";
+	case Phase_Upload:	return "upload";
+	case Phase_Kernel:	return "kernel";
+	case Phase_Readback:	return "readback";
+	case Phase_Idle:	return "idle";
+	case Phase_Count:	break;
+	}
+	throw std::invalid_argument("TimelinePhaseName : Unknown phase.");
+}
+
+std::string JsonString(const std::string &text)
+{
+	std::string res="\"";
+	for(size_t i=0;i<text.size();i++){
+		unsigned char c=(unsigned char)text[i];
+		if(c=='"' || c=='\\'){
+			res+='\\';
+			res+=(char)c;
+		}else if(c<0x20){
+			char buffer[8];
+			snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+			res+=buffer;
+		}else{
+			res+=(char)c;
+		}
+	}
+	return res+"\"";
+}
+
+timeline_t::timeline_t(bool enabled)
+	: m_enabled(enabled)
+	, m_cellUpdates(0)
+	, m_truncated(false)
+	, m_origin(0)
+	, m_lastEnd(0)
+{
+	memset(m_totals, 0, sizeof(m_totals));
+}
+
+bool timeline_t::EnabledFromEnv()
+{
+	return getenv("HPCE_PROFILE") && atoi(getenv("HPCE_PROFILE"));
+}
+
+void timeline_t::Add(timeline_phase_t phase, uint64_t bytes, uint64_t cells)
+{
+	if(!m_enabled)
+		return;
+
+	pending_t pending;
+	pending.phase=phase;
+	pending.event=m_event;
+	pending.bytes=bytes;
+	pending.cells=cells;
+	m_pending.push_back(pending);
+	m_event=cl::Event();
+
+	if(m_pending.size()>Timeline_Pending){
+		Retire();
+	}
+}
+
+void timeline_t::AddHost(timeline_phase_t phase, double seconds)
+{
+	if(!m_enabled)
+		return;
+	m_totals[phase].commands++;
+	m_totals[phase].seconds+=seconds;
+}
+
+void timeline_t::Retire()
+{
+	pending_t &pending=m_pending.front();
+	pending.event.wait();
+	cl_ulong start=pending.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	cl_ulong end=pending.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+	if(m_lastEnd==0){
+		m_origin=start;
+	}else if(start>m_lastEnd){
+		// Commands are retired in the order the in-order queue ran them
+		m_totals[Phase_Idle].commands++;
+		m_totals[Phase_Idle].seconds+=(start-m_lastEnd)*1e-9;
+	}
+	m_lastEnd=std::max(m_lastEnd, end);
+
+	double seconds=(end-start)*1e-9;
+	totals_t &totals=m_totals[pending.phase];
+	totals.commands++;
+	totals.seconds+=seconds;
+	totals.bytes+=pending.bytes;
+
+	if(pending.phase==Phase_Kernel){
+		unsigned bucket=0;
+		for(double us=seconds*1e6;us>=1;us/=2){
+			bucket++;
+		}
+		if(m_histogram.size()<=bucket){
+			m_histogram.resize(bucket+1);
+		}
+		m_histogram[bucket]++;
+		m_cellUpdates+=pending.cells;
+	}
+
+	if(m_records.size()<Timeline_Records){
+		record_t record;
+		record.phase=pending.phase;
+		record.start=start;
+		record.end=end;
+		m_records.push_back(record);
+	}else{
+		m_truncated=true;
+	}
+
+	m_pending.pop_front();
+}
+
+void timeline_t::Finish()
+{
+	while(!m_pending.empty()){
+		Retire();
+	}
+}
+
+void timeline_t::WriteJson(std::ostream &dst, const std::string &info)
+{
+	Finish();
+
+	dst<<"{\n";
+	if(!info.empty()){
+		dst<<"  "<<info<<",\n";
+	}
+
+	dst<<"  \"phases\": {\n";
+	for(unsigned i=0;i<Phase_Count;i++){
+		const totals_t &totals=m_totals[i];
+		dst<<"    \""<<TimelinePhaseName((timeline_phase_t)i)<<"\": {"
+			<<"\"commands\": "<<totals.commands
+			<<", \"seconds\": "<<totals.seconds
+			<<", \"bytes\": "<<totals.bytes
+			<<", \"gbPerSecond\": "<<GigabytesPerSecond(totals.bytes, totals.seconds)
+			<<"}"<<(i+1<Phase_Count ? "," : "")<<"\n";
+	}
+	dst<<"  },\n";
+
+	const totals_t &kernels=m_totals[Phase_Kernel];
+	dst<<"  \"kernels\": {\n";
+	dst<<"    \"launches\": "<<kernels.commands<<",\n";
+	dst<<"    \"meanSeconds\": "<<(kernels.commands ? kernels.seconds/kernels.commands : 0.0)<<",\n";
+	dst<<"    \"cellUpdatesPerSecond\": "<<(kernels.seconds>0 ? m_cellUpdates/kernels.seconds : 0.0)<<",\n";
+	dst<<"    \"histogram\": [";
+	for(unsigned i=0;i<m_histogram.size();i++){
+		double lo = i ? (double)(1ull<<(i-1)) : 0.0;
+		double hi = (double)(1ull<<i);
+		dst<<(i ? ", " : "")<<"{\"minUs\": "<<lo<<", \"maxUs\": "<<hi<<", \"count\": "<<m_histogram[i]<<"}";
+	}
+	dst<<"]\n";
+	dst<<"  },\n";
+
+	// Times are relative to the start of the first command, so they stay readable
+	dst<<"  \"timelineTruncated\": "<<(m_truncated ? "true" : "false")<<",\n";
+	dst<<"  \"timeline\": [";
+	for(unsigned i=0;i<m_records.size();i++){
+		const record_t &record=m_records[i];
+		dst<<(i ? ",\n    " : "\n    ")<<"{\"phase\": \""<<TimelinePhaseName(record.phase)<<"\""
+			<<", \"startUs\": "<<(record.start-m_origin)*1e-3
+			<<", \"endUs\": "<<(record.end-m_origin)*1e-3<<"}";
+	}
+	dst<<"\n  ]\n";
+	dst<<"}\n";
+}
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
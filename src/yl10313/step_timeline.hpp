@@ -0,0 +1,127 @@
+#ifndef hpce_yl10313_step_timeline_hpp
+#define hpce_yl10313_step_timeline_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <iostream>
+
+// OpenCL define:
+#define __CL_ENABLE_EXCEPTIONS
+#define __CL_USE_DEPRECATED_OPENCL_1_1_APIS
+#include "CL/cl.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+	//! What a command (or a stretch of host time) in a timeline was doing
+	typedef enum{
+		Phase_Compile,	//! Building programs, timed on the host
+		Phase_Pack,	//! Preparing data on the host before upload
+		Phase_Upload,	//! Writes to the device
+		Phase_Kernel,	//! Kernel launches
+		Phase_Readback,	//! Reads from the device
+		Phase_Idle,	//! Device time between one command ending and the next starting, e.g. in barriers
+		Phase_Count
+	}timeline_phase_t;
+
+	//! Name of a phase as it appears in reports, e.g. "upload"
+	const char *TimelinePhaseName(timeline_phase_t phase);
+
+	//! text as a quoted JSON string, escaping quotes, backslashes and control characters
+	std::string JsonString(const std::string &text);
+
+	//! Start and end times of OpenCL commands, summarised into a report
+	/*! Commands are added with the event from their enqueue, which needs a queue
+		created with QueueProperties(). Their timestamps are only read once they
+		have completed, so adding never waits unless a lot of commands are
+		outstanding. When the timeline is disabled everything is a no-op, and
+		Event() gives null, so the enqueues don't even create events.
+
+		The report gives the device (or host) time in each phase, bytes moved and
+		achieved GB/s, a histogram of kernel durations, cell updates per second,
+		and the first few thousand commands individually.
+	*/
+	class timeline_t
+	{
+	private:
+		struct pending_t
+		{
+			timeline_phase_t phase;
+			cl::Event event;
+			uint64_t bytes;
+			uint64_t cells;
+		};
+
+		struct record_t
+		{
+			timeline_phase_t phase;
+			cl_ulong start, end;
+		};
+
+		struct totals_t
+		{
+			unsigned commands;
+			double seconds;
+			uint64_t bytes;
+		};
+
+		bool m_enabled;
+		cl::Event m_event;	//! Filled in by the enqueue that Event() was passed to
+		std::deque<pending_t> m_pending;
+		totals_t m_totals[Phase_Count];
+		std::vector<unsigned> m_histogram;	//! Bucket i holds kernels taking [2^(i-1),2^i) us, bucket 0 those under 1us
+		uint64_t m_cellUpdates;
+		std::vector<record_t> m_records;
+		bool m_truncated;	//! There were too many commands to record them all
+		cl_ulong m_origin;	//! Start of the first command
+		cl_ulong m_lastEnd;	//! End of the latest command so far, or zero if none
+
+		//! Read the timestamps of the oldest pending command, waiting if needed
+		void Retire();
+	public:
+		timeline_t(bool enabled);
+
+		//! HPCE_PROFILE=1 turns timelines on
+		/*! Only step_world_v5_packed_properties records a timeline. Sessions read
+			the same variable (see step_options_t::profile), but only keep the
+			running totals in step_profile_t, as they may run for far more launches
+			than a timeline could keep.
+		*/
+		static bool EnabledFromEnv();
+
+		bool Enabled() const
+		{ return m_enabled; }
+
+		//! Properties to create a queue with so that its commands can be added
+		cl_command_queue_properties QueueProperties() const
+		{ return m_enabled ? CL_QUEUE_PROFILING_ENABLE : 0; }
+
+		//! Where the next enqueue should put its event, or null when disabled
+		cl::Event *Event()
+		{ return m_enabled ? &m_event : NULL; }
+
+		//! Add the command just enqueued with Event()
+		/*! \param bytes Bytes the command moves, for working out GB/s
+			\param cells Cells a kernel updates, for working out cell updates per second
+		*/
+		void Add(timeline_phase_t phase, uint64_t bytes=0, uint64_t cells=0);
+
+		//! Add time spent on the host rather than the device
+		void AddHost(timeline_phase_t phase, double seconds);
+
+		//! Wait for every command added so far, and read its timestamps
+		void Finish();
+
+		//! Write the report as JSON, after waiting for everything added so far
+		/*! \param info Extra members for the top level object, already formatted, e.g. "\"steps\":100", or empty */
+		void WriteJson(std::ostream &dst, const std::string &info="");
+	};
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
+
+#endif
@@ -0,0 +1,512 @@
+#include "step_tuner.hpp"
+
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <fstream>
+#include <sstream>
+
+#include "program_cache.hpp"
+#include "step_bands.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+namespace{
+
+	//! First line of the tuning database, so that a format change just looks like an empty database
+	const char *TuningHeader="HPCETuningV1";
+
+	//! Each measurement runs for at least this long, to drown out timer resolution and launch jitter
+	const double MinTimingSeconds=0.05;
+
+	//! ...unless it takes more than this many steps
+	const unsigned MaxTimingSteps=4096;
+
+	bool SameOptions(const step_options_t &a, const step_options_t &b)
+	{
+		return a.kernel==b.kernel && a.localW==b.localW && a.localH==b.localH
+			&& a.fuse==b.fuse && a.coarsen==b.coarsen;
+	}
+
+	step_options_t MakeOptions(step_kernel_t kernel, unsigned localW, unsigned localH, unsigned fuse=0, unsigned coarsen=0)
+	{
+		step_options_t options;
+		options.kernel=kernel;
+		options.localW=localW;
+		options.localH=localH;
+		options.fuse=fuse;
+		options.coarsen=coarsen;
+		return options;
+	}
+
+	//! Everything the tuner tries
+	std::vector<step_options_t> Candidates()
+	{
+		static const unsigned shapes[][2]={ {16,16}, {32,8}, {64,4}, {8,8} };
+
+		std::vector<step_options_t> res;
+		res.push_back(MakeOptions(Kernel_Global, 0, 0));
+		for(unsigned i=0;i<4;i++){
+			res.push_back(MakeOptions(Kernel_Global, shapes[i][0], shapes[i][1]));
+		}
+		for(unsigned i=0;i<4;i++){
+			res.push_back(MakeOptions(Kernel_Tiled, shapes[i][0], shapes[i][1]));
+		}
+		for(unsigned fuse=2;fuse<=8;fuse*=2){
+			res.push_back(MakeOptions(Kernel_Fused, 16, 16, fuse));
+			res.push_back(MakeOptions(Kernel_Fused, 32, 8, fuse));
+		}
+		for(unsigned coarsen=4;coarsen<=16;coarsen*=2){
+			res.push_back(MakeOptions(Kernel_Coarse, 0, 0, 0, coarsen));
+			res.push_back(MakeOptions(Kernel_Coarse, 16, 4, 0, coarsen));
+			res.push_back(MakeOptions(Kernel_Coarse, 64, 1, 0, coarsen));
+		}
+		// Only worth having if the device's texture cache beats its ordinary caches
+		res.push_back(MakeOptions(Kernel_Image, 0, 0));
+		for(unsigned i=0;i<4;i++){
+			res.push_back(MakeOptions(Kernel_Image, shapes[i][0], shapes[i][1]));
+		}
+		return res;
+	}
+
+	unsigned RoundUpPow2(unsigned x)
+	{
+		unsigned res=1;
+		while(res<x && res<0x80000000u){
+			res*=2;
+		}
+		return res;
+	}
+
+	//! Where the database is, returning false if there isn't one
+	/*! Only the default location is created if it is missing, so dirName is
+		just "." for a file named by HPCE_TUNE_DB.
+	*/
+	bool TuningLocation(std::string &dirName, std::string &fileName)
+	{
+		if(getenv("HPCE_TUNE_DB")){
+			dirName=".";
+			fileName=getenv("HPCE_TUNE_DB");
+		}else{
+			dirName=CacheDirectory();
+			fileName=dirName+"/tuning.txt";
+		}
+		return !dirName.empty() && !fileName.empty();
+	}
+
+	//! Every line of the database apart from the header, or nothing if it is missing or out of date
+	std::vector<std::string> ReadTuningLines(const std::string &fileName)
+	{
+		std::vector<std::string> lines;
+		std::ifstream src(fileName.c_str());
+		std::string line;
+		if(!std::getline(src, line) || line!=TuningHeader)
+			return lines;
+		while(std::getline(src, line)){
+			if(!line.empty())
+				lines.push_back(line);
+		}
+		return lines;
+	}
+
+	//! Find the value stored for key, which is the rest of the line after the key and a tab
+	bool LookupEntry(const std::string &key, std::string &value)
+	{
+		std::string dirName, fileName;
+		if(!TuningLocation(dirName, fileName))
+			return false;
+
+		std::vector<std::string> lines=ReadTuningLines(fileName);
+		for(unsigned i=0;i<lines.size();i++){
+			if(lines[i].compare(0, key.size()+1, key+"\t")==0){
+				value=lines[i].substr(key.size()+1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//! Store value for key, replacing any existing entry
+	void StoreEntry(const std::string &key, const std::string &value)
+	{
+		std::string dirName, fileName;
+		if(!TuningLocation(dirName, fileName))
+			return;
+
+		std::string contents=std::string(TuningHeader)+"\n";
+		std::vector<std::string> lines=ReadTuningLines(fileName);
+		for(unsigned i=0;i<lines.size();i++){
+			if(lines[i].compare(0, key.size()+1, key+"\t")!=0)
+				contents+=lines[i]+"\n";
+		}
+		contents+=key+"\t"+value+"\n";
+
+		if(!WriteCacheFile(dirName, fileName, contents))
+			std::cerr<<"Couldn't write tuning database '"<<fileName<<"'.\n";
+	}
+
+	std::string SizeClass(unsigned w, unsigned h)
+	{
+		return std::to_string(RoundUpPow2(w))+"x"+std::to_string(RoundUpPow2(h));
+	}
+
+	std::string DeviceSignature(const cl::Device &device)
+	{
+		return device.getInfo<CL_DEVICE_NAME>()+"\t"
+			+device.getInfo<CL_DEVICE_VERSION>()+"\t"
+			+device.getInfo<CL_DRIVER_VERSION>();
+	}
+
+	//! Host engines worth calibrating, as for step_target_t::hostThreads
+	/*! StepWorld, then host-only band sessions with doubling numbers of threads
+		up to the hardware's.
+	*/
+	std::vector<unsigned> HostThreadCounts()
+	{
+		unsigned hardware=std::thread::hardware_concurrency();
+		std::vector<unsigned> res(1, 0);
+		for(unsigned threads=2;threads<hardware;threads*=2){
+			res.push_back(threads);
+		}
+		if(hardware>1)
+			res.push_back(hardware);
+		return res;
+	}
+
+	//! Band options which use threads host threads and no devices
+	band_options_t HostBandOptions(unsigned threads)
+	{
+		band_options_t options;
+		options.threads=threads;
+		return options;
+	}
+
+	//! Time a host engine on a copy of the world, in seconds per step
+	double TimeHostSteps(const world_t &world, unsigned threads)
+	{
+		world_t copy=world;
+		float dt=0.1f;
+
+		std::unique_ptr<band_session_t> bands;
+		if(threads){
+			// The first round starts the threads, so it isn't timed
+			bands.reset(new band_session_t(world, HostBandOptions(threads)));
+			bands->Step(dt, 1);
+		}
+
+		unsigned n=1;
+		while(1){
+			auto begin=std::chrono::steady_clock::now();
+			if(bands){
+				bands->Step(dt, n);
+			}else{
+				StepWorld(copy, dt, n);
+			}
+			double elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+
+			if(elapsed>=MinTimingSeconds || n>=MaxTimingSteps)
+				return elapsed/n;
+			n*=2;
+		}
+	}
+
+	//! Every device on every platform, in the order HPCE_SELECT_PLATFORM and HPCE_SELECT_DEVICE count them
+	void EnumerateDevices(std::vector<step_target_t> &targets)
+	{
+		std::vector<cl::Platform> platforms;
+		try{
+			cl::Platform::get(&platforms);
+		}catch(const cl::Error &){
+			return;	// Some loaders report no platforms as an error
+		}
+		for(unsigned p=0;p<platforms.size();p++){
+			std::vector<cl::Device> devices;
+			try{
+				platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+			}catch(const cl::Error &){
+				continue;
+			}
+			for(unsigned d=0;d<devices.size();d++){
+				step_target_t target;
+				target.host=false;
+				target.platform=p;
+				target.device=d;
+				target.clDevice=devices[d];
+				targets.push_back(target);
+			}
+		}
+	}
+
+}; // anonymous namespace
+
+double TimeSteps(step_session_t &session)
+{
+	// The first launch includes any lazy set-up in the run-time, so it isn't timed
+	float dt=0.1f;
+	session.Step(dt, 1);
+	session.Finish();
+
+	unsigned n=1;
+	while(1){
+		auto begin=std::chrono::steady_clock::now();
+		session.Step(dt, n);
+		session.Finish();
+		double elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+
+		if(elapsed>=MinTimingSeconds || n>=MaxTimingSteps)
+			return elapsed/n;
+		n*=2;
+	}
+}
+
+step_options_t TuneStepOptions(const world_t &world, const cl::Device &device)
+{
+	std::vector<step_options_t> candidates=Candidates();
+	std::vector<step_options_t> tried;
+
+	step_options_t best;
+	double bestTime=-1;
+
+	for(unsigned i=0;i<candidates.size();i++){
+		step_options_t actual;
+		double seconds;
+		try{
+			// Candidates which can't use their local size get the run-time's choice,
+			// so they may turn out to be the same as one already timed
+			step_session_t session(world, candidates[i], device);
+			actual=session.Options();
+			bool seen=false;
+			for(unsigned j=0;j<tried.size();j++){
+				seen = seen || SameOptions(tried[j], actual);
+			}
+			if(seen)
+				continue;
+			tried.push_back(actual);
+
+			seconds=TimeSteps(session);
+		}catch(const std::exception &e){
+			std::cerr<<"Tuning : "<<DescribeStepOptions(candidates[i])<<" : skipped, "<<e.what()<<"\n";
+			continue;
+		}
+		std::cerr<<"Tuning : "<<DescribeStepOptions(actual)<<" : "<<seconds<<" s/step\n";
+
+		if(bestTime<0 || seconds<bestTime){
+			best=actual;
+			bestTime=seconds;
+		}
+	}
+
+	if(bestTime<0)
+		throw std::runtime_error("TuneStepOptions : None of the kernels could run on this device.");
+
+	std::cerr<<"Tuning : Best is "<<DescribeStepOptions(best)<<"\n";
+	StoreTuning(TuningKey(device, world.w, world.h), best, bestTime);
+	return best;
+}
+
+std::string TuningKey(const cl::Device &device, unsigned w, unsigned h)
+{
+	return DeviceSignature(device)+"\t"+SizeClass(w, h);
+}
+
+bool LookupTuning(const std::string &key, step_options_t &options)
+{
+	// The value is: kernel localW localH fuse coarsen seconds-per-step
+	std::string value;
+	if(!LookupEntry(key, value))
+		return false;
+
+	std::istringstream fields(value);
+	std::string kernel;
+	step_options_t res;
+	if(!(fields>>kernel>>res.localW>>res.localH>>res.fuse>>res.coarsen))
+		return false;
+	try{
+		res.kernel=ParseStepKernel(kernel);
+	}catch(const std::invalid_argument &){
+		return false;	// Written by a version with other kernels
+	}
+	options=res;
+	return true;
+}
+
+void StoreTuning(const std::string &key, const step_options_t &options, double secondsPerStep)
+{
+	std::ostringstream value;
+	value<<StepKernelName(options.kernel)<<" "<<options.localW<<" "<<options.localH
+		<<" "<<options.fuse<<" "<<options.coarsen<<" "<<secondsPerStep;
+	StoreEntry(key, value.str());
+}
+
+step_options_t ChooseStepOptions(const world_t &world, const cl::Device &device)
+{
+	step_options_t env=StepOptionsFromEnv();
+	if(getenv("HPCE_STEP_KERNEL") && *getenv("HPCE_STEP_KERNEL"))
+		return env;
+
+	std::string tune=getenv("HPCE_TUNE") ? getenv("HPCE_TUNE") : "";
+	step_options_t options;
+	if(tune=="1"){
+		options=TuneStepOptions(world, device);
+	}else if(tune=="0" || !LookupTuning(TuningKey(device, world.w, world.h), options)){
+		return env;
+	}
+
+	// Batching, profiling, memory and specialisation aren't tuned, so they always come from the environment
+	options.batch=env.batch;
+	options.profile=env.profile;
+	options.memory=env.memory;
+	options.specialize=env.specialize;
+	return options;
+}
+
+std::string DescribeStepTarget(const step_target_t &target)
+{
+	if(target.host && target.hostThreads)
+		return "the host, with "+std::to_string(target.hostThreads)+" band threads";
+	if(target.host)
+		return "the host";
+	return "platform "+std::to_string(target.platform)+", device "+std::to_string(target.device)
+		+" : "+target.clDevice.getInfo<CL_DEVICE_NAME>();
+}
+
+step_target_t CalibrateStepTarget(const world_t &world)
+{
+	std::vector<step_target_t> targets;
+	EnumerateDevices(targets);
+
+	step_target_t best;
+	double bestTime=-1;
+
+	std::vector<unsigned> threadCounts=HostThreadCounts();
+	for(unsigned i=0;i<threadCounts.size();i++){
+		step_target_t host;
+		host.host=true;
+		host.hostThreads=threadCounts[i];
+
+		double seconds;
+		try{
+			seconds=TimeHostSteps(world, host.hostThreads);
+		}catch(const std::exception &e){
+			std::cerr<<"Calibrating : "<<DescribeStepTarget(host)<<" : skipped, "<<e.what()<<"\n";
+			continue;
+		}
+		std::cerr<<"Calibrating : "<<DescribeStepTarget(host)<<" : "<<seconds<<" s/step\n";
+
+		if(bestTime<0 || seconds<bestTime){
+			best=host;
+			bestTime=seconds;
+		}
+	}
+
+	std::string key="target";
+	for(unsigned i=0;i<targets.size();i++){
+		key+="\t"+DeviceSignature(targets[i].clDevice);
+
+		double seconds;
+		try{
+			step_session_t session(world, ChooseStepOptions(world, targets[i].clDevice), targets[i].clDevice);
+			seconds=TimeSteps(session);
+		}catch(const std::exception &e){
+			std::cerr<<"Calibrating : "<<DescribeStepTarget(targets[i])<<" : skipped, "<<e.what()<<"\n";
+			continue;
+		}
+		std::cerr<<"Calibrating : "<<DescribeStepTarget(targets[i])<<" : "<<seconds<<" s/step\n";
+
+		if(bestTime<0 || seconds<bestTime){
+			best=targets[i];
+			bestTime=seconds;
+		}
+	}
+	key+="\t"+SizeClass(world.w, world.h);
+
+	if(bestTime<0)
+		throw std::runtime_error("CalibrateStepTarget : Nothing could step the world.");
+
+	std::ostringstream value;
+	if(best.host){
+		value<<"host "<<best.hostThreads;
+	}else{
+		value<<best.platform<<" "<<best.device;
+	}
+	value<<" "<<bestTime;
+	StoreEntry(key, value.str());
+
+	return best;
+}
+
+void StepOnHost(const step_target_t &target, world_t &world, float dt, unsigned n)
+{
+	if(target.hostThreads==0){
+		StepWorld(world, dt, n);
+		return;
+	}
+	band_session_t bands(world, HostBandOptions(target.hostThreads));
+	bands.Step(dt, n);
+	bands.ReadWorld(world);
+}
+
+step_target_t ChooseStepTarget(const world_t &world)
+{
+	std::string platform=getenv("HPCE_SELECT_PLATFORM") ? getenv("HPCE_SELECT_PLATFORM") : "";
+	std::string device=getenv("HPCE_SELECT_DEVICE") ? getenv("HPCE_SELECT_DEVICE") : "";
+
+	step_target_t target;
+	if(platform!="auto" && device!="auto"){
+		target.host=false;
+		target.clDevice=SelectDevice();
+		target.platform=atoi(platform.c_str());
+		target.device=atoi(device.c_str());
+		return target;
+	}
+
+	std::string tune=getenv("HPCE_TUNE") ? getenv("HPCE_TUNE") : "";
+	if(tune!="1" && tune!="0"){
+		// The decision is keyed by every device present, so adding or updating
+		// any of them means calibrating again
+		std::vector<step_target_t> targets;
+		EnumerateDevices(targets);
+		std::string key="target";
+		for(unsigned i=0;i<targets.size();i++){
+			key+="\t"+DeviceSignature(targets[i].clDevice);
+		}
+		key+="\t"+SizeClass(world.w, world.h);
+
+		std::string value;
+		if(LookupEntry(key, value)){
+			std::istringstream fields(value);
+			std::string first;
+			unsigned p, d;
+			fields>>first;
+			if(first=="host"){
+				target.host=true;
+				if(fields>>target.hostThreads){
+					std::cerr<<"Using "<<DescribeStepTarget(target)<<"\n";
+					return target;
+				}
+			}
+			p=atoi(first.c_str());
+			if(fields>>d){
+				for(unsigned i=0;i<targets.size();i++){
+					if(targets[i].platform==p && targets[i].device==d){
+						std::cerr<<"Using "<<DescribeStepTarget(targets[i])<<"\n";
+						return targets[i];
+					}
+				}
+			}
+		}
+	}
+
+	target=CalibrateStepTarget(world);
+	std::cerr<<"Using "<<DescribeStepTarget(target)<<"\n";
+	return target;
+}
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
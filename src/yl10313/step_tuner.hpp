@@ -0,0 +1,89 @@
+#ifndef hpce_yl10313_step_tuner_hpp
+#define hpce_yl10313_step_tuner_hpp
+
+#include "step_world_session.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+	//! Measure how long a session takes per step, in seconds
+	/*! The session is stepped (by an arbitrary dt) until the measurement has taken
+		long enough to be meaningful, so its world is changed.
+	*/
+	double TimeSteps(step_session_t &session);
+
+	//! Benchmark each kernel with a range of parameters, and return the fastest
+	/*! Candidates which can't run on the device (e.g. because the tile doesn't fit
+		in local memory) are skipped. Progress is reported on std::cerr.
+	*/
+	step_options_t TuneStepOptions(const world_t &world, const cl::Device &device);
+
+	//! Key identifying a device and a class of world sizes in the tuning database
+	/*! Sizes are rounded up to powers of two, so e.g. 77x77 and 100x100 share an entry. */
+	std::string TuningKey(const cl::Device &device, unsigned w, unsigned h);
+
+	//! Look up the best options stored for key, returning false if there are none
+	bool LookupTuning(const std::string &key, step_options_t &options);
+
+	//! Store the best options for key, replacing any existing entry
+	/*! Failing to write the database is reported, but isn't an error. */
+	void StoreTuning(const std::string &key, const step_options_t &options, double secondsPerStep);
+
+	//! The options to step this world with on this device
+	/*! If HPCE_STEP_KERNEL is set the options come from the environment, as in
+		StepOptionsFromEnv. Otherwise, the tuning database is consulted, and if
+		it has an entry for the device and size class that is used. Setting
+		HPCE_TUNE=1 re-tunes and updates the database, while HPCE_TUNE=0 ignores
+		the database.
+
+		The database is the file named by HPCE_TUNE_DB, by default tuning.txt in
+		the program cache directory (see CacheDirectory).
+	*/
+	step_options_t ChooseStepOptions(const world_t &world, const cl::Device &device);
+
+	//! Where to step a world: an OpenCL device, or the host
+	struct step_target_t
+	{
+		bool host;
+		unsigned hostThreads;	//! On the host, threads for a band session, or 0 for StepWorld
+		unsigned platform, device;	//! Indices as for HPCE_SELECT_PLATFORM and HPCE_SELECT_DEVICE
+		cl::Device clDevice;
+
+		step_target_t()
+			: host(false)
+			, hostThreads(0)
+			, platform(0)
+			, device(0)
+		{}
+	};
+
+	//! e.g. "platform 0, device 1 : Tahiti", "the host, with 4 band threads", or "the host"
+	std::string DescribeStepTarget(const step_target_t &target);
+
+	//! Time a few steps of world on the host and on every OpenCL device, and return the fastest
+	/*! The host is timed with StepWorld, and with host-only band sessions using
+		2, 4, ... threads up to the hardware's. Each device uses the options from
+		ChooseStepOptions. Anything that fails is skipped. The decision, including
+		the host engine, is stored in the tuning database, keyed by the full list
+		of devices and the size class of the world.
+	*/
+	step_target_t CalibrateStepTarget(const world_t &world);
+
+	//! Where to step this world
+	/*! If HPCE_SELECT_PLATFORM or HPCE_SELECT_DEVICE is "auto" the decision from a
+		previous calibration is used, or CalibrateStepTarget is run if there isn't
+		one. As with the kernel options, HPCE_TUNE=1 or HPCE_TUNE=0 both ignore a
+		stored decision, so calibration runs again. Otherwise this is the device
+		from SelectDevice.
+	*/
+	step_target_t ChooseStepTarget(const world_t &world);
+
+	//! Step world with the host engine chosen by target
+	void StepOnHost(const step_target_t &target, world_t &world, float dt, unsigned n);
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
+
+#endif
@@ -0,0 +1,164 @@
+// Each work-item steps a horizontal strip of HPCE_COARSEN cells (a multiple of
+// four, passed in as a build option), four at a time using float4. The strip is
+// walked left to right, so the left and right neighbours of each group of four
+// come from the groups either side, which are already in registers, and only
+// the two cells just outside the strip are loaded separately. The conditions of
+// the scalar kernels become masks for select, and the arithmetic is unchanged,
+// so the results are identical. Strips that hang over the right edge of the
+// world fall back to the scalar code for the cells that are left.
+
+// As with the tiled kernel, HPCE_W, HPCE_H, HPCE_INNER and HPCE_OUTER can fix
+// the size and weights as build options, in which case the arguments are ignored.
+
+// Keep a*b+c as two roundings, so the results match the other kernels and the host
+#pragma OPENCL FP_CONTRACT OFF
+
+#ifndef HPCE_COARSEN
+#define HPCE_COARSEN 8
+#endif
+
+enum cell_flags_t{
+           Cell_Fixed      =0x1,
+           Cell_Insulator  =0x2
+};
+
+__kernel void kernel_coarse(
+	__global const float *world_state, //0
+	float inner_arg, //1
+	float outer_arg, //2
+	__global float *buffer, //3
+	__global const uchar *world_properties, //4, packed by kernel_pack
+	uint w_arg, //5
+	uint h_arg //6
+	){
+
+#ifdef HPCE_INNER
+	const float inner=HPCE_INNER, outer=HPCE_OUTER;
+#else
+	const float inner=inner_arg, outer=outer_arg;
+#endif
+#ifdef HPCE_W
+	const uint w=HPCE_W, h=HPCE_H;
+#else
+	const uint w=w_arg, h=h_arg;
+#endif
+
+	uint x0=get_global_id(0)*HPCE_COARSEN, y=get_global_id(1);
+	if(x0>=w || y>=h)
+		return;	// Only there to pad out the work-groups
+
+	size_t row=(size_t)y*w;
+
+	if(x0+HPCE_COARSEN <= w){
+		__global const float *centre=world_state+row+x0;
+		__global const float *above=centre-w, *below=centre+w;
+
+		float4 zero=(float4)(0.0f);
+
+		// Neighbours which are not conductive are never used, but they still
+		// get loaded, so anything outside the world is replaced by zero.
+		float left=(x0>0) ? centre[-1] : 0.0f;
+		float4 curr=vload4(0, centre);
+
+		for(uint i=0; i<HPCE_COARSEN; i+=4){
+			float4 next;
+			float right;
+			if(i+4<HPCE_COARSEN){
+				next=vload4(0, centre+i+4);
+				right=next.x;
+			}else{
+				next=zero;
+				right=(x0+HPCE_COARSEN<w) ? centre[HPCE_COARSEN] : 0.0f;
+			}
+
+			float4 up=(y>0) ? vload4(0, above+i) : zero;
+			float4 down=(y+1<h) ? vload4(0, below+i) : zero;
+			float4 l=(float4)(left, curr.xyz);
+			float4 r=(float4)(curr.yzw, right);
+
+			uint4 myProps=convert_uint4(vload4(0, world_properties+row+x0+i));
+
+			float4 contrib=(float4)(inner);
+			float4 acc=inner*curr;
+
+			// Cell above
+			int4 m=(myProps & (uint4)(0x4)) != (uint4)(0);
+			contrib=select(contrib, contrib+outer, m);
+			acc=select(acc, acc+outer*up, m);
+
+			// Cell below
+			m=(myProps & (uint4)(0x8)) != (uint4)(0);
+			contrib=select(contrib, contrib+outer, m);
+			acc=select(acc, acc+outer*down, m);
+
+			// Cell left
+			m=(myProps & (uint4)(0x10)) != (uint4)(0);
+			contrib=select(contrib, contrib+outer, m);
+			acc=select(acc, acc+outer*l, m);
+
+			// Cell right
+			m=(myProps & (uint4)(0x20)) != (uint4)(0);
+			contrib=select(contrib, contrib+outer, m);
+			acc=select(acc, acc+outer*r, m);
+
+			// Scale the accumulate value by the number of places contributing to it
+			float4 res=acc/contrib;
+			// Then clamp to the range [0,1]
+			res=min((float4)(1.0f), max(zero, res));
+
+			// Fixed cells and insulators never change
+			m=(myProps & (uint4)(Cell_Fixed|Cell_Insulator)) != (uint4)(0);
+			res=select(res, curr, m);
+
+			vstore4(res, 0, buffer+row+x0+i);
+
+			left=curr.w;
+			curr=next;
+		}
+		return;
+	}
+
+	for(uint x=x0; x<w; x++){
+		size_t index=row + x;
+
+		uint myProps=world_properties[index];
+
+		if((myProps & Cell_Fixed) || (myProps & Cell_Insulator)){
+			// Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
+			buffer[index]=world_state[index];
+		}else{
+			float contrib=inner;
+			float acc=inner*world_state[index];
+
+			// Cell above
+			if(myProps & 0x4) {
+				contrib += outer;
+				acc += outer * world_state[index-w];
+			}
+
+			// Cell below
+			if(myProps & 0x8){
+				contrib += outer;
+				acc += outer * world_state[index+w];
+			}
+
+			// Cell left
+			if(myProps & 0x10){
+				contrib += outer;
+				acc += outer * world_state[index-1];
+			}
+
+			// Cell right
+			if(myProps & 0x20){
+				contrib += outer;
+				acc += outer * world_state[index+1];
+			}
+
+			// Scale the accumulate value by the number of places contributing to it
+			float res=acc/contrib;
+			// Then clamp to the range [0,1]
+			res=min(1.0f, max(0.0f, res));
+			buffer[index] = res;
+		}
+	}
+}
@@ -0,0 +1,60 @@
+// Measures how far the world is from a steady state, without reading it back.
+// kernel_converge has each work-group find the largest change of any cell over
+// the last step, and the total heat, for its share of the world, and
+// kernel_converge_final reduces those partial results with a single work-group,
+// so only one float2 (max change, total heat) ever has to leave the device.
+// Work-group sizes must be powers of two.
+
+float2 ReduceGroup(float2 mine, __local float2 *scratch)
+{
+	uint lid=get_local_id(0);
+	scratch[lid]=mine;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for(uint half=get_local_size(0)/2;half>0;half/=2){
+		if(lid<half){
+			float2 other=scratch[lid+half];
+			scratch[lid]=(float2)(max(scratch[lid].x, other.x), scratch[lid].y+other.y);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	return scratch[0];
+}
+
+__kernel void kernel_converge(
+	__global const float *world_state, //0
+	__global const float *previous_state, //1, the state a step earlier
+	ulong cells, //2
+	__local float2 *scratch, //3, one per work-item
+	__global float2 *partials //4, one per work-group
+	){
+
+	// Each work-item strides through the world, so any number of groups covers it
+	float2 mine=(float2)(0.0f, 0.0f);
+	for(size_t i=get_global_id(0);i<cells;i+=get_global_size(0)){
+		float value=world_state[i];
+		mine.x=max(mine.x, fabs(value-previous_state[i]));
+		mine.y+=value;
+	}
+
+	float2 res=ReduceGroup(mine, scratch);
+	if(get_local_id(0)==0)
+		partials[get_group_id(0)]=res;
+}
+
+__kernel void kernel_converge_final(
+	__global const float2 *partials, //0
+	uint count, //1
+	__local float2 *scratch, //2, one per work-item
+	__global float2 *result //3
+	){
+
+	float2 mine=(float2)(0.0f, 0.0f);
+	for(uint i=get_local_id(0);i<count;i+=get_local_size(0)){
+		float2 other=partials[i];
+		mine=(float2)(max(mine.x, other.x), mine.y+other.y);
+	}
+
+	float2 res=ReduceGroup(mine, scratch);
+	if(get_local_id(0)==0)
+		result[0]=res;
+}
@@ -0,0 +1,68 @@
+// Steps a whole ensemble of worlds at once, one world per slice of a 3D range.
+// The worlds are packed one after the other in the state, buffer and
+// properties, and each has its own size, offset, and step coefficients, so
+// they can differ in alpha and dt as well as state. The range is as wide and
+// tall as the largest world, and work-items past the edge of a smaller one do
+// nothing. The arithmetic is exactly that of step_world_v5_kernel.cl.
+
+#pragma OPENCL FP_CONTRACT OFF
+
+enum cell_flags_t{
+           Cell_Fixed      =0x1,
+           Cell_Insulator  =0x2
+};
+
+__kernel void kernel_ensemble(
+	__global const float *world_state, //0
+	__global const float2 *coefficients, //1, inner and outer for each world
+	__global float *buffer, //2
+	__global const uchar *world_properties, //3, packed as by PackProperties
+	__global const ulong *offsets, //4, index of the first cell of each world
+	__global const uint2 *sizes //5, width and height of each world
+	){
+
+	uint x=get_global_id(0), y=get_global_id(1), z=get_global_id(2);
+	uint2 size=sizes[z];
+	if(x>=size.x || y>=size.y)
+		return;
+
+	size_t w=size.x;
+	size_t index=offsets[z] + y*w + x;
+	uint myProps = world_properties[index];
+
+	if((myProps & Cell_Fixed) || (myProps & Cell_Insulator)){
+		buffer[index]=world_state[index];
+	}else{
+		float inner=coefficients[z].x, outer=coefficients[z].y;
+		float contrib=inner;
+		float acc=inner*world_state[index];
+
+		// Cell above
+		if(myProps & 0x4) {
+			contrib += outer;
+			acc += outer * world_state[index-w];
+		}
+
+		// Cell below
+		if(myProps & 0x8){
+			contrib += outer;
+			acc += outer * world_state[index+w];
+		}
+
+		// Cell left
+		if(myProps & 0x10){
+			contrib += outer;
+			acc += outer * world_state[index-1];
+		}
+
+		// Cell right
+		if(myProps & 0x20){
+			contrib += outer;
+			acc += outer * world_state[index+1];
+		}
+
+		float res=acc/contrib;
+		res=min(1.0f, max(0.0f, res));
+		buffer[index] = res;
+	}
+}
@@ -0,0 +1,116 @@
+// Advances the world by k steps in one launch. Each work-group loads its tile
+// plus a halo k cells deep into local memory, then steps the whole thing k times
+// there. After each step the outermost ring of the tile is stale (it needed
+// neighbours that aren't in the tile), so the region being updated shrinks by
+// one cell per step, and after k steps exactly the work-group's own cells are
+// left to write back. The halo is computed redundantly by neighbouring groups,
+// which is the price of not going back to global memory between steps.
+//
+// Every cell goes through exactly the same arithmetic as in the single step
+// kernels, so the results are identical.
+
+// Keep a*b+c as two roundings, so the results match the other kernels and the host
+#pragma OPENCL FP_CONTRACT OFF
+
+enum cell_flags_t{
+           Cell_Fixed      =0x1,
+           Cell_Insulator  =0x2
+};
+
+__kernel void kernel_fused(
+	__global const float *world_state, //0
+	float inner, //1
+	float outer, //2
+	__global float *buffer, //3
+	__global const uchar *world_properties, //4, packed by kernel_pack
+	uint w, //5
+	uint h, //6
+	uint k, //7, number of steps to take
+	__local float *tileA, //8, (local width+2k)*(local height+2k) floats
+	__local float *tileB, //9, same size as tileA
+	__local uint *tileProps //10, same size as tileA
+	){
+
+	size_t lw=get_local_size(0), lh=get_local_size(1);
+	size_t lx=get_local_id(0), ly=get_local_id(1);
+	size_t tw=lw+2*k, th=lh+2*k;
+	size_t group=lw*lh, me=ly*lw+lx;
+
+	// Tile co-ordinate (0,0) is at world co-ordinate (ox,oy), which may be outside the world
+	long ox=(long)(get_group_id(0)*lw)-k, oy=(long)(get_group_id(1)*lh)-k;
+
+	// Anything outside the world is loaded as a cold insulator, so it never changes
+	// and never contributes. Cells in the world only ever use neighbours that
+	// their packed properties mark as conductive, which are in the world.
+	for(size_t i=me; i<tw*th; i+=group){
+		long gx=ox+(long)(i%tw), gy=oy+(long)(i/tw);
+		if(gx>=0 && gy>=0 && gx<(long)w && gy<(long)h){
+			size_t index=(size_t)gy*w + (size_t)gx;
+			tileA[i]=world_state[index];
+			tileProps[i]=world_properties[index];
+		}else{
+			tileA[i]=0.0f;
+			tileProps[i]=Cell_Insulator;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	__local float *src=tileA, *dst=tileB;
+	for(uint s=1; s<=k; s++){
+		// Cells at least s away from the edge of the tile are still exact after s steps
+		size_t rw=tw-2*s, rh=th-2*s;
+		for(size_t i=me; i<rw*rh; i+=group){
+			size_t t=(s+i/rw)*tw + s+i%rw;
+			uint myProps=tileProps[t];
+
+			if((myProps & Cell_Fixed) || (myProps & Cell_Insulator)){
+				// Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
+				dst[t]=src[t];
+			}else{
+				float contrib=inner;
+				float acc=inner*src[t];
+
+				// Cell above
+				if(myProps & 0x4) {
+					contrib += outer;
+					acc += outer * src[t-tw];
+				}
+
+				// Cell below
+				if(myProps & 0x8){
+					contrib += outer;
+					acc += outer * src[t+tw];
+				}
+
+				// Cell left
+				if(myProps & 0x10){
+					contrib += outer;
+					acc += outer * src[t-1];
+				}
+
+				// Cell right
+				if(myProps & 0x20){
+					contrib += outer;
+					acc += outer * src[t+1];
+				}
+
+				// Scale the accumulate value by the number of places contributing to it
+				float res=acc/contrib;
+				// Then clamp to the range [0,1]
+				res=min(1.0f, max(0.0f, res));
+				dst[t] = res;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		__local float *tmp=src;
+		src=dst;
+		dst=tmp;
+	}
+
+	// Only the work-group's own cells (the centre of the tile) are written back
+	size_t x=get_group_id(0)*lw + lx, y=get_group_id(1)*lh + ly;
+	if(x<w && y<h){
+		buffer[y*w + x]=src[(ly+k)*tw + lx+k];
+	}
+}
@@ -0,0 +1,12 @@
+// Copies the cells at a list of indices into a compact buffer, so that a few
+// probes and regions can be read back without moving the whole state.
+
+__kernel void kernel_gather(
+	__global const float *world_state, //0
+	__global const ulong *indices, //1
+	__global float *samples //2, one for each index
+	){
+
+	size_t i=get_global_id(0);
+	samples[i]=world_state[indices[i]];
+}
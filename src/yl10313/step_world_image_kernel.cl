@@ -0,0 +1,70 @@
+// Same step as step_world_v5_kernel.cl, but with the state and the packed
+// properties held in 2D images (CL_R of CL_FLOAT and CL_UNSIGNED_INT8) rather
+// than flat buffers. Reads then go through the texture cache, which on many
+// devices is laid out for 2D locality, so the neighbours above and below are
+// as likely to be cached as those to the left and right. A kernel can't read
+// and write the same image, so the session ping-pongs between two of them.
+
+// Keep a*b+c as two roundings, so the results match the host exactly
+#pragma OPENCL FP_CONTRACT OFF
+
+enum cell_flags_t{
+           Cell_Fixed      =0x1,
+           Cell_Insulator  =0x2
+};
+
+// Coordinates are always inside the world, so no filtering or edge handling is needed
+__constant sampler_t Sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
+
+__kernel void kernel_image(
+	__read_only image2d_t world_state, //0
+	float inner, //1
+	float outer, //2
+	__write_only image2d_t buffer, //3
+	__read_only image2d_t world_properties //4
+	){
+
+	int x=get_global_id(0), y=get_global_id(1);
+	// The range is padded when a work-group size is given
+	if(x>=get_image_width(world_state) || y>=get_image_height(world_state))
+		return;
+
+	int2 pos=(int2)(x, y);
+	uint myProps=read_imageui(world_properties, Sampler, pos).x;
+	float myState=read_imagef(world_state, Sampler, pos).x;
+
+	if((myProps & Cell_Fixed) || (myProps & Cell_Insulator)){
+		write_imagef(buffer, pos, (float4)(myState, 0.0f, 0.0f, 0.0f));
+	}else{
+		float contrib=inner;
+		float acc=inner*myState;
+
+		// Cell above
+		if(myProps & 0x4) {
+			contrib += outer;
+			acc += outer * read_imagef(world_state, Sampler, (int2)(x, y-1)).x;
+		}
+
+		// Cell below
+		if(myProps & 0x8){
+			contrib += outer;
+			acc += outer * read_imagef(world_state, Sampler, (int2)(x, y+1)).x;
+		}
+
+		// Cell left
+		if(myProps & 0x10){
+			contrib += outer;
+			acc += outer * read_imagef(world_state, Sampler, (int2)(x-1, y)).x;
+		}
+
+		// Cell right
+		if(myProps & 0x20){
+			contrib += outer;
+			acc += outer * read_imagef(world_state, Sampler, (int2)(x+1, y)).x;
+		}
+
+		float res=acc/contrib;
+		res=min(1.0f, max(0.0f, res));
+		write_imagef(buffer, pos, (float4)(res, 0.0f, 0.0f, 0.0f));
+	}
+}
@@ -0,0 +1,37 @@
+// Packs the properties of each cell, and which of its neighbours conduct, into
+// a byte, in the same bits as PackProperties on the host. Cells with any
+// property set keep just that, and otherwise bits 0x4, 0x8, 0x10 and 0x20 are
+// set if the cell above, below, left or right isn't an insulator. Anything
+// outside the world counts as an insulator.
+
+enum cell_flags_t{
+           Cell_Fixed      =0x1,
+           Cell_Insulator  =0x2
+};
+
+__kernel void kernel_pack(
+	__global const uint *world_properties, //0, as in world_t
+	__global uchar *packed, //1
+	uint w, //2
+	uint h //3
+	){
+
+	uint x=get_global_id(0), y=get_global_id(1);
+	if(x>=w || y>=h)
+		return;
+
+	size_t index=(size_t)y*w + x;
+	uint myProps=world_properties[index];
+
+	if(myProps==0){
+		if(y>0 && !(world_properties[index-w] & Cell_Insulator))
+			myProps |= 0x4;		// Cell above
+		if(y+1<h && !(world_properties[index+w] & Cell_Insulator))
+			myProps |= 0x8;		// Cell below
+		if(x>0 && !(world_properties[index-1] & Cell_Insulator))
+			myProps |= 0x10;	// Cell left
+		if(x+1<w && !(world_properties[index+1] & Cell_Insulator))
+			myProps |= 0x20;	// Cell right
+	}
+	packed[index]=(uchar)myProps;
+}
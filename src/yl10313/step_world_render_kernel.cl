@@ -0,0 +1,83 @@
+// Renders the state straight into bitmap scanlines, in the same colours as
+// RenderWorld, so only the picture has to be read back. Each work-item makes
+// one pixel, which may cover a block of cells when the picture is smaller than
+// the world. Blocks are chosen exactly as in DownsampleWorld: any insulator
+// makes the pixel an insulator, and otherwise it shows the mean (box) or the
+// hottest (max) of the cells. Temperatures outside [0,1] are clamped, and NaN
+// is drawn as cold, as on the host.
+
+#pragma OPENCL FP_CONTRACT OFF
+
+#if defined(cl_khr_fp64)
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double sum_t;	// DownsampleWorld sums in double, so means round the same way
+#else
+typedef float sum_t;
+#endif
+
+enum cell_flags_t{
+           Cell_Fixed      =0x1,
+           Cell_Insulator  =0x2
+};
+
+__kernel void kernel_render(
+	__global const float *world_state, //0
+	__global const uchar *properties, //1, as packed by kernel_pack
+	uint srcW, //2
+	uint srcH, //3
+	uint w, //4, picture width, no more than srcW
+	uint h, //5, picture height, no more than srcH
+	uint filterMax, //6, non-zero to show the hottest cell rather than the mean
+	__global uchar *pixels //7, h scanlines of w*3 bytes, each followed by (4-w%4)%4 bytes of padding as in RenderWorld
+	){
+
+	uint ox=get_global_id(0), oy=get_global_id(1);
+	if(ox>=w || oy>=h)
+		return;
+
+	// Cell x lands in pixel x*w/srcW, so pixel ox starts at the first x with that
+	// quotient, and likewise for rows.
+	uint x0=(uint)(((ulong)ox*srcW+w-1)/w), x1=(uint)(((ulong)(ox+1)*srcW+w-1)/w);
+	uint y0=(uint)(((ulong)oy*srcH+h-1)/h), y1=(uint)(((ulong)(oy+1)*srcH+h-1)/h);
+
+	bool insulator=false;
+	sum_t sum=0;
+	uint count=0;
+	float hottest=0.0f;
+	for(uint y=y0;y<y1;y++){
+		size_t row=(size_t)y*srcW;
+		for(uint x=x0;x<x1;x++){
+			if(properties[row+x] & Cell_Insulator){
+				insulator=true;
+			}else{
+				float value=world_state[row+x];
+				sum+=value;
+				count++;
+				hottest=max(hottest, value);
+			}
+		}
+	}
+
+	uint cbScanline=w*3 + (4-w%4)%4;
+	size_t index=(size_t)oy*cbScanline + ox*3;
+	if(insulator){
+		pixels[index]=0;
+		pixels[index+1]=255;
+		pixels[index+2]=0;
+	}else{
+		float value = filterMax ? hottest : (float)(sum/count);
+		// Clamped as RenderCodes does on the host, and the comparison is false for NaN
+		float level=value*255;
+		uchar heat = level>0 ? (uchar)min(level, 255.0f) : 0;
+		pixels[index]=255-heat;	// Blue
+		pixels[index+1]=0;	// Green
+		pixels[index+2]=heat;	// Red
+	}
+
+	// The last pixel of each row fills in the padding
+	if(ox==w-1){
+		for(uint p=w*3;p<cbScanline;p++){
+			pixels[(size_t)oy*cbScanline+p]=0;
+		}
+	}
+}
@@ -0,0 +1,849 @@
+#include "step_world_session.hpp"
+
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+
+#include "program_cache.hpp"
+#include "step_tuner.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+namespace{
+
+	size_t RoundUp(size_t x, size_t multiple)
+	{
+		return ((x+multiple-1)/multiple)*multiple;
+	}
+
+	//! An origin or region for the image copies
+	cl::size_t<3> Size3(size_t x, size_t y, size_t z)
+	{
+		cl::size_t<3> res;
+		res[0]=x;
+		res[1]=y;
+		res[2]=z;
+		return res;
+	}
+
+}; // anonymous namespace
+
+std::vector<uint32_t> PackProperties(const world_t &world)
+{
+	unsigned w=world.w, h=world.h;
+
+	std::vector<uint32_t> packed(world.properties.begin(), world.properties.end());
+	for(unsigned y=0;y<h;y++){
+		for(unsigned x=0;x<w;x++){
+			size_t index=CellIndex(x,y,w);
+			if(!packed[index]){
+				if(!(world.properties[index-w] & Cell_Insulator))
+					packed[index] += 0x4;	// Cell above
+				if(!(world.properties[index+w] & Cell_Insulator))
+					packed[index] += 0x8;	// Cell below
+				if(!(world.properties[index-1] & Cell_Insulator))
+					packed[index] += 0x10;	// Cell left
+				if(!(world.properties[index+1] & Cell_Insulator))
+					packed[index] += 0x20;	// Cell right
+			}
+		}
+	}
+	return packed;
+}
+
+const char *StepKernelName(step_kernel_t kernel)
+{
+	switch(kernel){
+	case Kernel_Global:	return "global";
+	case Kernel_Tiled:	return "tiled";
+	case Kernel_Fused:	return "fused";
+	case Kernel_Coarse:	return "coarse";
+	case Kernel_Image:	return "image";
+	}
+	throw std::invalid_argument("StepKernelName : Unknown kernel.");
+}
+
+step_kernel_t ParseStepKernel(const std::string &name)
+{
+	if(name=="global")
+		return Kernel_Global;
+	if(name=="tiled")
+		return Kernel_Tiled;
+	if(name=="fused")
+		return Kernel_Fused;
+	if(name=="coarse")
+		return Kernel_Coarse;
+	if(name=="image")
+		return Kernel_Image;
+	throw std::invalid_argument("ParseStepKernel : Unknown kernel '"+name+"', expected global, tiled, fused, coarse or image.");
+}
+
+step_options_t StepOptionsFromEnv()
+{
+	step_options_t options;
+	if(getenv("HPCE_STEP_KERNEL") && *getenv("HPCE_STEP_KERNEL")){
+		options.kernel=ParseStepKernel(getenv("HPCE_STEP_KERNEL"));
+	}
+	if(getenv("HPCE_LOCAL_SIZE") && *getenv("HPCE_LOCAL_SIZE")){
+		if(2!=sscanf(getenv("HPCE_LOCAL_SIZE"), "%ux%u", &options.localW, &options.localH))
+			throw std::invalid_argument("StepOptionsFromEnv : HPCE_LOCAL_SIZE should look like 16x16.");
+	}
+	if(getenv("HPCE_FUSE_STEPS") && *getenv("HPCE_FUSE_STEPS")){
+		options.fuse=atoi(getenv("HPCE_FUSE_STEPS"));
+	}
+	if(getenv("HPCE_COARSEN") && *getenv("HPCE_COARSEN")){
+		options.coarsen=atoi(getenv("HPCE_COARSEN"));
+	}
+	if(getenv("HPCE_BATCH") && *getenv("HPCE_BATCH")){
+		options.batch=atoi(getenv("HPCE_BATCH"));
+	}
+	if(getenv("HPCE_PROFILE") && *getenv("HPCE_PROFILE")){
+		options.profile=atoi(getenv("HPCE_PROFILE"))!=0;
+	}
+	if(getenv("HPCE_SPECIALIZE") && *getenv("HPCE_SPECIALIZE")){
+		options.specialize=atoi(getenv("HPCE_SPECIALIZE"))!=0;
+	}
+	if(getenv("HPCE_MEMORY") && *getenv("HPCE_MEMORY")){
+		std::string memory=getenv("HPCE_MEMORY");
+		if(memory=="auto"){
+			options.memory=Memory_Auto;
+		}else if(memory=="copy"){
+			options.memory=Memory_Copy;
+		}else if(memory=="mapped"){
+			options.memory=Memory_Mapped;
+		}else{
+			throw std::invalid_argument("StepOptionsFromEnv : HPCE_MEMORY should be auto, copy or mapped.");
+		}
+	}
+	return options;
+}
+
+std::string DescribeStepOptions(const step_options_t &options)
+{
+	std::string res=std::string(StepKernelName(options.kernel))+" kernel, local size ";
+	if(options.localW && options.localH){
+		res+=std::to_string(options.localW)+"x"+std::to_string(options.localH);
+	}else{
+		res+="chosen by the run-time";
+	}
+	if(options.kernel==Kernel_Fused){
+		res+=", "+std::to_string(options.fuse)+" steps per launch";
+	}
+	if(options.kernel==Kernel_Coarse){
+		res+=", "+std::to_string(options.coarsen)+" cells per work-item";
+	}
+	if(options.memory==Memory_Mapped){
+		res+=", mapped memory";
+	}
+	if(options.specialize){
+		res+=", specialized";
+	}
+	return res;
+}
+
+cl::Device SelectDevice()
+{
+	std::vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	if(platforms.size()==0)
+		throw std::runtime_error("No OpenCL platforms found.");
+
+	int selectedPlatform=0;
+	if(getenv("HPCE_SELECT_PLATFORM")){
+		selectedPlatform=atoi(getenv("HPCE_SELECT_PLATFORM"));
+	}
+	cl::Platform platform=platforms.at(selectedPlatform);
+
+	std::vector<cl::Device> devices;
+	platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+	if(devices.size()==0)
+		throw std::runtime_error("No opencl devices found.\n");
+
+	int selectedDevice=0;
+	if(getenv("HPCE_SELECT_DEVICE")){
+		selectedDevice=atoi(getenv("HPCE_SELECT_DEVICE"));
+	}
+	cl::Device device=devices.at(selectedDevice);
+
+	std::cerr<<"Using platform "<<selectedPlatform<<", device "<<selectedDevice<<" : "<<device.getInfo<CL_DEVICE_NAME>()<<"\n";
+	return device;
+}
+
+step_session_t::step_session_t(const world_t &world, const step_options_t &options)
+	: step_session_t(world, options, SelectDevice())
+{}
+
+step_session_t::step_session_t(const world_t &world, const step_options_t &options, const cl::Device &device)
+	: m_w(world.w)
+	, m_h(world.h)
+	, m_alpha(world.alpha)
+	, m_t(world.t)
+	, m_options(options)
+	, m_device(device)
+	, m_mapped(0)
+	, m_current(0)
+	, m_argsBound(false)
+	, m_boundDt(0)
+	, m_batchLaunches(0)
+	, m_steps(0)
+	, m_sampleEvery(0)
+	, m_gatherDirty(false)
+	, m_checkEvery(0)
+	, m_tolerance(0)
+	, m_converged(false)
+	, m_checkLocal(0)
+	, m_checkGroups(0)
+	, m_cbPixels(0)
+{
+	size_t cells=WorldCells(world.w, world.h);
+	if( (world.state.size()!=cells) || (world.properties.size()!=cells) )
+		throw std::invalid_argument("step_session_t : World state and properties don't match its dimensions.");
+
+	std::vector<cl::Device> devices(1, m_device);
+	m_context=cl::Context(devices);
+
+	if(m_options.batch==0)
+		m_options.batch=64;
+
+	if(m_options.kernel==Kernel_Tiled){
+		m_programFile="step_world_tiled_kernel.cl";
+		m_kernelName="kernel_tiled";
+	}else if(m_options.kernel==Kernel_Fused){
+		m_programFile="step_world_fused_kernel.cl";
+		m_kernelName="kernel_fused";
+	}else if(m_options.kernel==Kernel_Coarse){
+		if(m_options.coarsen==0)
+			m_options.coarsen=8;
+		if( (m_options.coarsen%4) || (m_options.coarsen>16) )
+			throw std::invalid_argument("step_session_t : Cells per work-item must be 4, 8, 12 or 16.");
+		// The strip length is a build option, so the loop over it can be unrolled
+		char options[32];
+		sprintf(options, "-DHPCE_COARSEN=%u", m_options.coarsen);
+		m_programFile="step_world_coarse_kernel.cl";
+		m_programOptions=options;
+		m_kernelName="kernel_coarse";
+	}else if(m_options.kernel==Kernel_Image){
+		if(!m_device.getInfo<CL_DEVICE_IMAGE_SUPPORT>())
+			throw std::runtime_error("step_session_t : Device doesn't support images.");
+		if( (m_w > m_device.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>()) || (m_h > m_device.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>()) )
+			throw std::runtime_error("step_session_t : World is too large to fit in an image on this device.");
+		m_programFile="step_world_image_kernel.cl";
+		m_kernelName="kernel_image";
+	}else{
+		m_programFile="step_world_v5_kernel.cl";
+		m_programOptions="-DHPCE_PROPERTY_T=uchar";
+		m_kernelName="kernel_xy";
+	}
+	// Only kernels that take the size and weights as arguments can have them built in
+	if(m_options.kernel==Kernel_Fused || m_options.kernel==Kernel_Image){
+		m_options.specialize=false;
+	}
+
+	m_cbBuffer=sizeof(float)*cells;
+	if(m_cbBuffer > m_device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+		throw std::runtime_error("World is too large to fit in a single buffer on this device.");
+
+	// On CPUs and integrated GPUs device memory is host memory, so copying between
+	// them is pure overhead. Buffers the run-time allocates in host memory (with
+	// whatever alignment it needs) can instead be mapped in place.
+	if(m_options.memory==Memory_Auto){
+		m_options.memory = m_device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() ? Memory_Mapped : Memory_Copy;
+	}
+	cl_mem_flags hostFlags = (m_options.memory==Memory_Mapped) ? CL_MEM_ALLOC_HOST_PTR : 0;
+	m_buffProperties=cl::Buffer(m_context, CL_MEM_READ_WRITE, cells);	// One byte per cell, see kernel_pack
+	m_buffers[0]=cl::Buffer(m_context, CL_MEM_READ_WRITE | hostFlags, m_cbBuffer);
+	m_buffers[1]=cl::Buffer(m_context, CL_MEM_READ_WRITE | hostFlags, m_cbBuffer);
+
+	if(m_options.kernel==Kernel_Image){
+		// The buffers are kept to stage copies in and out of the images
+		m_images[0]=cl::Image2D(m_context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), m_w, m_h);
+		m_images[1]=cl::Image2D(m_context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), m_w, m_h);
+		m_imageProperties=cl::Image2D(m_context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_UNSIGNED_INT8), m_w, m_h);
+	}
+	CreateKernels("");
+	ChooseWorkGroup();
+
+	m_queue=cl::CommandQueue(m_context, m_device, m_options.profile ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+	// The properties are packed on the device, which saves a serial pass over
+	// the world on the host. The raw properties are only needed until then.
+	{
+		cl::Buffer buffRaw(m_context, CL_MEM_READ_ONLY | hostFlags, sizeof(uint32_t)*cells);
+		WriteWhole(buffRaw, &world.properties[0]);
+
+		cl::Program packProgram=BuildProgram(m_context, m_device, "step_world_pack_kernel.cl");
+		cl::Kernel packKernel(packProgram, "kernel_pack");
+		packKernel.setArg(0, buffRaw);
+		packKernel.setArg(1, m_buffProperties);
+		packKernel.setArg(2, m_w);
+		packKernel.setArg(3, m_h);
+		m_queue.enqueueNDRangeKernel(packKernel, cl::NDRange(0, 0), cl::NDRange(m_w, m_h), cl::NullRange);
+	}
+	WriteWhole(m_buffers[m_current], &world.state[0]);
+
+	if(m_options.kernel==Kernel_Image){
+		m_queue.enqueueCopyBufferToImage(m_buffProperties, m_imageProperties, 0, Size3(0, 0, 0), Size3(m_w, m_h, 1));
+		m_queue.enqueueCopyBufferToImage(m_buffers[m_current], m_images[m_current], 0, Size3(0, 0, 0), Size3(m_w, m_h, 1));
+	}
+}
+
+const cl::Buffer &step_session_t::StateBuffer(unsigned i)
+{
+	// The copy is enqueued, so it happens after the launch that wrote the image
+	if(m_options.kernel==Kernel_Image){
+		m_queue.enqueueCopyImageToBuffer(m_images[i], m_buffers[i], Size3(0, 0, 0), Size3(m_w, m_h, 1), 0);
+	}
+	return m_buffers[i];
+}
+
+void step_session_t::WriteWhole(const cl::Buffer &buffer, const void *src)
+{
+	if(m_options.memory==Memory_Mapped){
+		void *dst=m_queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_WRITE, 0, m_cbBuffer);
+		memcpy(dst, src, m_cbBuffer);
+		m_queue.enqueueUnmapMemObject(buffer, dst);
+	}else{
+		m_queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, m_cbBuffer, src);
+	}
+}
+
+void step_session_t::CreateKernels(const std::string &extraOptions)
+{
+	std::string options=m_programOptions;
+	if(!extraOptions.empty()){
+		options += (options.empty() ? "" : " ") + extraOptions;
+	}
+	m_program=BuildProgram(m_context, m_device, m_programFile, options);
+	m_kernels[0]=cl::Kernel(m_program, m_kernelName);
+	m_kernels[1]=cl::Kernel(m_program, m_kernelName);
+
+	// These never change, so each kernel is bound to its buffers once and for all
+	if(m_options.kernel==Kernel_Image){
+		for(unsigned i=0;i<2;i++){
+			m_kernels[i].setArg(0, m_images[i]);
+			m_kernels[i].setArg(3, m_images[1-i]);
+		}
+		SetArgs(4, m_imageProperties);
+	}else{
+		for(unsigned i=0;i<2;i++){
+			m_kernels[i].setArg(0, m_buffers[i]);
+			m_kernels[i].setArg(3, m_buffers[1-i]);
+		}
+		SetArgs(4, m_buffProperties);
+	}
+	m_argsBound=false;
+	m_boundFuse[0]=0;
+	m_boundFuse[1]=0;
+}
+
+void step_session_t::Specialize(float inner, float outer)
+{
+	// Nine significant digits always read back as the same float, so the
+	// built-in weights are bit for bit the ones passed as arguments
+	char options[256];
+	int len=sprintf(options, "-DHPCE_W=%uu -DHPCE_H=%uu -DHPCE_INNER=%.8ef -DHPCE_OUTER=%.8ef",
+		m_w, m_h, (double)inner, (double)outer);
+	if(m_options.kernel==Kernel_Tiled){
+		sprintf(options+len, " -DHPCE_LOCAL_W=%uu -DHPCE_LOCAL_H=%uu", m_options.localW, m_options.localH);
+	}
+
+	unsigned lw=m_options.localW, lh=m_options.localH;
+	CreateKernels(options);
+	ChooseWorkGroup();
+	// The specialised kernel may use more registers, and so allow smaller work-groups
+	if(m_options.localW!=lw || m_options.localH!=lh)
+		throw std::runtime_error("step_session_t : Specialised kernel can't run with the work-group size it was built for.");
+}
+
+void step_session_t::ChooseWorkGroup()
+{
+	size_t maxGroup=std::min(
+		m_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(),
+		m_kernels[0].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(m_device)
+	);
+	unsigned lw=m_options.localW, lh=m_options.localH;
+
+	if(m_options.kernel==Kernel_Global){
+		// The global kernel takes the width of the world from the global size, so
+		// it can't be padded out to a multiple of the work-group size.
+		m_globalSize=cl::NDRange(m_w, m_h);
+		if( lw && lh && (m_w%lw==0) && (m_h%lh==0) && ((size_t)lw*lh<=maxGroup) ){
+			m_localSize=cl::NDRange(lw, lh);
+		}else{
+			m_localSize=cl::NullRange;
+			m_options.localW=0;
+			m_options.localH=0;
+		}
+		return;
+	}
+
+	if(m_options.kernel==Kernel_Image){
+		// The image kernel knows the size of the world from its images, so it can be padded
+		if( lw && lh && ((size_t)lw*lh<=maxGroup) ){
+			m_localSize=cl::NDRange(lw, lh);
+			m_globalSize=cl::NDRange(RoundUp(m_w, lw), RoundUp(m_h, lh));
+		}else{
+			m_localSize=cl::NullRange;
+			m_globalSize=cl::NDRange(m_w, m_h);
+			m_options.localW=0;
+			m_options.localH=0;
+		}
+		return;
+	}
+
+	if(m_options.kernel==Kernel_Coarse){
+		// One work-item per strip, and any padding returns straight away
+		size_t strips=(m_w+m_options.coarsen-1)/m_options.coarsen;
+		SetArgs(5, m_w);
+		SetArgs(6, m_h);
+		if( lw && lh && ((size_t)lw*lh<=maxGroup) ){
+			m_localSize=cl::NDRange(lw, lh);
+			m_globalSize=cl::NDRange(RoundUp(strips, lw), RoundUp(m_h, lh));
+		}else{
+			m_localSize=cl::NullRange;
+			m_globalSize=cl::NDRange(strips, m_h);
+			m_options.localW=0;
+			m_options.localH=0;
+		}
+		return;
+	}
+
+	if(lw==0 || lh==0){
+		lw=16;
+		lh=16;
+	}
+	while((size_t)lw*lh > maxGroup){
+		if(lw>=lh){
+			lw=(lw+1)/2;
+		}else{
+			lh=(lh+1)/2;
+		}
+	}
+
+	// Work-items past the edge of the world only help to load the tile
+	m_localSize=cl::NDRange(lw, lh);
+	m_globalSize=cl::NDRange(RoundUp(m_w, lw), RoundUp(m_h, lh));
+	m_options.localW=lw;
+	m_options.localH=lh;
+
+	SetArgs(5, m_w);
+	SetArgs(6, m_h);
+
+	size_t cbLocal=m_device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	if(m_options.kernel==Kernel_Tiled){
+		size_t cbTile=sizeof(float)*(lw+2)*(lh+2);
+		if(cbTile > cbLocal)
+			throw std::runtime_error("step_session_t : Tile doesn't fit in local memory on this device.");
+		SetArgs(7, cl::__local(cbTile));
+	}else{
+		// Two copies of the state plus the properties, for a halo fuse cells deep.
+		// Rather than fail, use a shallower halo if that is all that fits.
+		unsigned fuse=m_options.fuse ? m_options.fuse : 4;
+		while( fuse>1 && 3*sizeof(float)*(lw+2*fuse)*(lh+2*fuse) > cbLocal ){
+			fuse--;
+		}
+		size_t cbTile=sizeof(float)*(lw+2*fuse)*(lh+2*fuse);
+		if(3*cbTile > cbLocal)
+			throw std::runtime_error("step_session_t : Tile doesn't fit in local memory on this device.");
+		m_options.fuse=fuse;
+		SetArgs(8, cl::__local(cbTile));
+		SetArgs(9, cl::__local(cbTile));
+		SetArgs(10, cl::__local(cbTile));
+	}
+}
+
+unsigned step_session_t::Step(float dt, unsigned n)
+{
+	if(m_mapped)
+		throw std::logic_error("step_session_t::Step : State is still mapped.");
+	bool checking = (m_checkEvery!=0);
+	if(checking && m_converged)
+		return 0;
+
+	auto begin=std::chrono::steady_clock::now();
+	double waited=0;
+
+	// Only a change of step size means going back to the run-time for arguments.
+	// Any dt (even zero) has to be bound before the first launch.
+	if(!m_argsBound || dt!=m_boundDt){
+		float outer=m_alpha*dt;		// We spread alpha to other cells per time
+		float inner=1-outer/4;				// Anything that doesn't spread stays
+
+		if(m_options.specialize){
+			Specialize(inner, outer);
+		}
+		SetArgs(1, inner);
+		SetArgs(2, outer);
+		m_argsBound=true;
+		m_boundDt=dt;
+	}
+
+	cl::NDRange offset(0, 0);
+
+	// The fused kernel takes up to fuse steps per launch, the others one
+	unsigned perLaunch=(m_options.kernel==Kernel_Fused) ? m_options.fuse : 1;
+	bool sampling = m_sampleEvery && !m_gatherIndices.empty();
+
+	// The queue is in-order, so each launch sees the output of the one before
+	// without any barriers.
+	unsigned done=0;
+	while(done<n){
+		unsigned todo=std::min(perLaunch, n-done);
+		if(sampling){
+			// Launches mustn't jump over a sample
+			todo=std::min<uint64_t>(todo, m_sampleEvery - m_steps%m_sampleEvery);
+		}
+		if(checking){
+			// A check compares the two buffers, so the launch just before it must
+			// be a single step
+			unsigned toCheck=m_checkEvery - m_steps%m_checkEvery;
+			todo=std::min(todo, toCheck>1 ? toCheck-1 : 1);
+		}
+		if(m_options.kernel==Kernel_Fused && m_boundFuse[m_current]!=todo){
+			m_kernels[m_current].setArg(7, todo);
+			m_boundFuse[m_current]=todo;
+		}
+
+		// Events cost something to create, so only ask for one if it will be used
+		bool endOfBatch=(++m_batchLaunches==m_options.batch);
+		cl::Event event;
+		m_queue.enqueueNDRangeKernel(m_kernels[m_current], offset, m_globalSize, m_localSize,
+			NULL, (endOfBatch || m_options.profile) ? &event : NULL);
+		m_profile.launches++;
+		if(m_options.profile){
+			m_profileEvents.push_back(event);
+		}
+
+		if(endOfBatch){
+			m_batchLaunches=0;
+			m_queue.flush();
+			m_batchEnds.push_back(event);
+			if(m_batchEnds.size()>2){
+				auto beginWait=std::chrono::steady_clock::now();
+				m_batchEnds.front().wait();
+				waited+=std::chrono::duration<double>(std::chrono::steady_clock::now()-beginWait).count();
+				m_batchEnds.pop_front();
+				CollectProfile(false);
+			}
+		}
+
+		m_current=1-m_current;
+
+		// Time is stepped one dt at a time, to round exactly like the reference
+		for(unsigned t=0;t<todo;t++){
+			m_t += dt;
+		}
+		done+=todo;
+		m_steps+=todo;
+
+		if(sampling && m_steps%m_sampleEvery==0){
+			Sample();
+		}
+		if(checking && m_steps%m_checkEvery==0){
+			Check();
+			CollectChecks(false);
+			if(m_converged)
+				break;
+		}
+	}
+	m_queue.flush();	// Make sure the device starts while the host gets on with something else
+	CollectSamples(false);
+
+	double elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+	m_profile.submitSeconds+=elapsed-waited;
+	m_profile.waitSeconds+=waited;
+	return done;
+}
+
+void step_session_t::CollectProfile(bool all)
+{
+	// The queue is in-order, so launches complete from the front
+	while(!m_profileEvents.empty()){
+		cl::Event &event=m_profileEvents.front();
+		if(!all && event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>()!=CL_COMPLETE)
+			break;
+		cl_ulong start=event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		cl_ulong end=event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		m_profile.kernelSeconds+=(end-start)*1e-9;
+		m_profileEvents.pop_front();
+	}
+}
+
+void step_session_t::Finish()
+{
+	m_queue.finish();
+	m_batchEnds.clear();
+	CollectProfile(true);
+	CollectSamples(true);
+	CollectChecks(true);
+}
+
+unsigned step_session_t::AddProbe(unsigned x, unsigned y)
+{
+	return AddRegion(x, y, 1, 1);
+}
+
+unsigned step_session_t::AddRegion(unsigned x, unsigned y, unsigned w, unsigned h)
+{
+	if( (x>=m_w) || (y>=m_h) || (w>m_w-x) || (h>m_h-y) )
+		throw std::invalid_argument("step_session_t::AddRegion : Region isn't inside the world.");
+
+	unsigned first=m_gatherIndices.size();
+	for(unsigned row=y;row<y+h;row++){
+		for(unsigned col=x;col<x+w;col++){
+			m_gatherIndices.push_back(CellIndex(col, row, m_w));
+		}
+	}
+	m_gatherDirty=true;
+	return first;
+}
+
+void step_session_t::SampleEvery(unsigned k)
+{
+	m_sampleEvery=k;
+}
+
+void step_session_t::Sample()
+{
+	if(m_gatherDirty){
+		// Any samples in flight still need the old buffer, but the queue holds on to it
+		if(!m_gatherProgram()){
+			m_gatherProgram=BuildProgram(m_context, m_device, "step_world_gather_kernel.cl");
+			m_gatherKernel=cl::Kernel(m_gatherProgram, "kernel_gather");
+		}
+		size_t count=m_gatherIndices.size();
+		m_buffGatherIndices=cl::Buffer(m_context, CL_MEM_READ_ONLY, sizeof(cl_ulong)*count);
+		m_buffSamples=cl::Buffer(m_context, CL_MEM_WRITE_ONLY, sizeof(float)*count);
+		m_queue.enqueueWriteBuffer(m_buffGatherIndices, CL_TRUE, 0, sizeof(cl_ulong)*count, &m_gatherIndices[0]);
+		m_gatherKernel.setArg(1, m_buffGatherIndices);
+		m_gatherKernel.setArg(2, m_buffSamples);
+		m_gatherDirty=false;
+	}
+
+	// A single buffer on the device is enough, as the in-order queue finishes
+	// each read before the next gather can overwrite it
+	size_t count=m_gatherIndices.size();
+	m_gatherKernel.setArg(0, StateBuffer(m_current));
+	m_queue.enqueueNDRangeKernel(m_gatherKernel, cl::NDRange(0), cl::NDRange(count), cl::NullRange);
+
+	m_pendingSamples.push_back(std::make_pair(cl::Event(), step_sample_t()));
+	std::pair<cl::Event,step_sample_t> &pending=m_pendingSamples.back();
+	pending.second.t=m_t;
+	pending.second.values.resize(count);
+	m_queue.enqueueReadBuffer(m_buffSamples, CL_FALSE, 0, sizeof(float)*count, &pending.second.values[0], NULL, &pending.first);
+}
+
+void step_session_t::CollectSamples(bool all)
+{
+	// The queue is in-order, so reads complete from the front
+	while(!m_pendingSamples.empty()){
+		cl::Event &event=m_pendingSamples.front().first;
+		if(all){
+			event.wait();
+		}else if(event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>()!=CL_COMPLETE){
+			break;
+		}
+		m_samples.push_back(std::move(m_pendingSamples.front().second));
+		m_pendingSamples.pop_front();
+	}
+}
+
+std::vector<step_sample_t> step_session_t::TakeSamples(bool wait)
+{
+	if(wait){
+		Finish();
+	}else{
+		CollectSamples(false);
+	}
+	std::vector<step_sample_t> res;
+	res.swap(m_samples);
+	return res;
+}
+
+void step_session_t::ConvergeEvery(unsigned k, float tolerance)
+{
+	m_checkEvery=k;
+	m_tolerance=tolerance;
+	m_converged=false;
+}
+
+void step_session_t::Check()
+{
+	if(!m_checkProgram()){
+		m_checkProgram=BuildProgram(m_context, m_device, "step_world_converge_kernel.cl");
+		m_checkKernel=cl::Kernel(m_checkProgram, "kernel_converge");
+		m_checkFinalKernel=cl::Kernel(m_checkProgram, "kernel_converge_final");
+
+		// The reduction needs a power of two, and a few dozen groups is plenty to
+		// keep a device busy on a pass this short
+		size_t maxGroup=std::min(m_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(), (size_t)256);
+		maxGroup=std::min(maxGroup, m_checkKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(m_device));
+		maxGroup=std::min(maxGroup, m_checkFinalKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(m_device));
+		m_checkLocal=1;
+		while(m_checkLocal*2<=maxGroup){
+			m_checkLocal*=2;
+		}
+		size_t cells=WorldCells(m_w, m_h);
+		m_checkGroups=std::max<size_t>(1, std::min<size_t>(64, (cells+m_checkLocal-1)/m_checkLocal));
+
+		m_buffPartials=cl::Buffer(m_context, CL_MEM_READ_WRITE, sizeof(cl_float2)*m_checkGroups);
+		m_buffCheck=cl::Buffer(m_context, CL_MEM_WRITE_ONLY, sizeof(cl_float2));
+		m_checkKernel.setArg(2, (cl_ulong)cells);
+		m_checkKernel.setArg(3, cl::__local(sizeof(cl_float2)*m_checkLocal));
+		m_checkKernel.setArg(4, m_buffPartials);
+		m_checkFinalKernel.setArg(0, m_buffPartials);
+		m_checkFinalKernel.setArg(1, (cl_uint)m_checkGroups);
+		m_checkFinalKernel.setArg(2, cl::__local(sizeof(cl_float2)*m_checkLocal));
+		m_checkFinalKernel.setArg(3, m_buffCheck);
+	}
+
+	// The other buffer still holds the state from one step before
+	m_checkKernel.setArg(0, StateBuffer(m_current));
+	m_checkKernel.setArg(1, StateBuffer(1-m_current));
+	m_queue.enqueueNDRangeKernel(m_checkKernel, cl::NDRange(0), cl::NDRange(m_checkGroups*m_checkLocal), cl::NDRange(m_checkLocal));
+	m_queue.enqueueNDRangeKernel(m_checkFinalKernel, cl::NDRange(0), cl::NDRange(m_checkLocal), cl::NDRange(m_checkLocal));
+
+	m_pendingChecks.push_back(pending_check_t());
+	pending_check_t &pending=m_pendingChecks.back();
+	pending.check.t=m_t;
+	m_queue.enqueueReadBuffer(m_buffCheck, CL_FALSE, 0, sizeof(cl_float2), &pending.result, NULL, &pending.event);
+}
+
+void step_session_t::CollectChecks(bool all)
+{
+	// The queue is in-order, so reads complete from the front
+	while(!m_pendingChecks.empty()){
+		pending_check_t &pending=m_pendingChecks.front();
+		if(all){
+			pending.event.wait();
+		}else if(pending.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>()!=CL_COMPLETE){
+			break;
+		}
+		pending.check.maxChange=pending.result.s[0];
+		pending.check.totalHeat=pending.result.s[1];
+		if(pending.check.maxChange < m_tolerance)
+			m_converged=true;
+		m_checks.push_back(pending.check);
+		m_pendingChecks.pop_front();
+	}
+}
+
+std::vector<step_check_t> step_session_t::TakeChecks(bool wait)
+{
+	if(wait){
+		Finish();
+	}else{
+		CollectChecks(false);
+	}
+	std::vector<step_check_t> res;
+	res.swap(m_checks);
+	return res;
+}
+
+step_frame_t step_session_t::RenderFrame(unsigned w, unsigned h, downsample_filter_t filter)
+{
+	if(m_mapped)
+		throw std::logic_error("step_session_t::RenderFrame : State is still mapped.");
+
+	step_frame_t frame;
+	DownsampleSize(m_w, m_h, w, h);
+	frame.t=m_t;
+	frame.w=w;
+	frame.h=h;
+	frame.scanlines.resize(((size_t)w*3 + (4-w%4)%4)*h);
+	if(frame.scanlines.empty())
+		return frame;
+
+	if(!m_renderProgram()){
+		m_renderProgram=BuildProgram(m_context, m_device, "step_world_render_kernel.cl");
+		m_renderKernel=cl::Kernel(m_renderProgram, "kernel_render");
+		m_renderKernel.setArg(1, m_buffProperties);
+		m_renderKernel.setArg(2, m_w);
+		m_renderKernel.setArg(3, m_h);
+	}
+	if(frame.scanlines.size()>m_cbPixels){
+		m_cbPixels=frame.scanlines.size();
+		m_buffPixels=cl::Buffer(m_context, CL_MEM_WRITE_ONLY, m_cbPixels);
+		m_renderKernel.setArg(7, m_buffPixels);
+	}
+	m_renderKernel.setArg(0, StateBuffer(m_current));
+	m_renderKernel.setArg(4, w);
+	m_renderKernel.setArg(5, h);
+	m_renderKernel.setArg(6, (cl_uint)(filter==Filter_Max));
+	m_queue.enqueueNDRangeKernel(m_renderKernel, cl::NDRange(0, 0), cl::NDRange(w, h), cl::NullRange);
+	m_queue.enqueueReadBuffer(m_buffPixels, CL_TRUE, 0, frame.scanlines.size(), &frame.scanlines[0]);
+
+	// The read waited for everything before it
+	m_batchEnds.clear();
+	CollectProfile(true);
+	CollectSamples(true);
+	CollectChecks(true);
+	return frame;
+}
+
+void step_session_t::ReadWorld(world_t &world)
+{
+	if( (world.w!=m_w) || (world.h!=m_h) )
+		throw std::invalid_argument("step_session_t::ReadWorld : World dimensions don't match the session.");
+
+	world.state.resize(WorldCells(m_w, m_h));
+	if(m_options.memory==Memory_Mapped){
+		memcpy(&world.state[0], MapState(), m_cbBuffer);
+		UnmapState();
+	}else{
+		m_queue.enqueueReadBuffer(StateBuffer(m_current), CL_TRUE, 0, m_cbBuffer, &world.state[0]);
+
+		// The read waited for everything before it
+		m_batchEnds.clear();
+		CollectProfile(true);
+		CollectSamples(true);
+		CollectChecks(true);
+	}
+	world.t=m_t;
+}
+
+const float *step_session_t::MapState()
+{
+	if(m_mapped)
+		throw std::logic_error("step_session_t::MapState : State is already mapped.");
+
+	m_mapped=(const float*)m_queue.enqueueMapBuffer(StateBuffer(m_current), CL_TRUE, CL_MAP_READ, 0, m_cbBuffer);
+
+	// The map waited for everything before it
+	m_batchEnds.clear();
+	CollectProfile(true);
+	CollectSamples(true);
+	CollectChecks(true);
+	return m_mapped;
+}
+
+void step_session_t::UnmapState()
+{
+	if(!m_mapped)
+		throw std::logic_error("step_session_t::UnmapState : State isn't mapped.");
+
+	m_queue.enqueueUnmapMemObject(m_buffers[m_current], (void*)m_mapped);
+	m_mapped=0;
+}
+
+void StepWorldV6Session(world_t &world, float dt, unsigned n)
+{
+	step_target_t target=ChooseStepTarget(world);
+	if(target.host){
+		StepOnHost(target, world, dt, n);
+		return;
+	}
+	step_session_t session(world, ChooseStepOptions(world, target.clDevice), target.clDevice);
+	session.Step(dt, n);
+	session.ReadWorld(world);
+}
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
@@ -0,0 +1,390 @@
+#ifndef hpce_yl10313_step_world_session_hpp
+#define hpce_yl10313_step_world_session_hpp
+
+#include "heat.hpp"
+
+#include <deque>
+
+// OpenCL define:
+#define __CL_ENABLE_EXCEPTIONS
+#define __CL_USE_DEPRECATED_OPENCL_1_1_APIS
+#include "CL/cl.hpp"
+
+namespace hpce{
+
+namespace yl10313{
+
+	//! Precompute which neighbours of each cell conduct, in the bits the v5 kernel expects
+	/*! Cells with any property set are left as they are. Otherwise bits 0x4, 0x8,
+		0x10 and 0x20 are set if the cell above, below, left or right conducts.
+	*/
+	std::vector<uint32_t> PackProperties(const world_t &world);
+
+	//! Which kernel a session steps the world with
+	typedef enum{
+		Kernel_Global,	//! One cell per work-item, read straight from global memory (step_world_v5_kernel.cl)
+		Kernel_Tiled,	//! Work-group tile plus halo staged in local memory (step_world_tiled_kernel.cl)
+		Kernel_Fused,	//! Several steps per launch on a tile with a deeper halo (step_world_fused_kernel.cl)
+		Kernel_Coarse,	//! A strip of cells per work-item, using float4 (step_world_coarse_kernel.cl)
+		Kernel_Image	//! As global, but with the state and properties in images, read through the texture cache (step_world_image_kernel.cl)
+	}step_kernel_t;
+
+	//! How a session keeps the world in device memory
+	typedef enum{
+		Memory_Auto,	//! Mapped if the device shares memory with the host, otherwise copied
+		Memory_Copy,	//! Ordinary buffers, with reads and writes copying to and from the device
+		Memory_Mapped	//! Buffers allocated in host memory (CL_MEM_ALLOC_HOST_PTR), accessed by mapping them
+	}step_memory_t;
+
+	//! How a session should step the world
+	struct step_options_t
+	{
+		step_kernel_t kernel;
+		//! Work-group size, or zero for a default
+		/*! The tiled and fused kernels default to 16x16, and the tile in local memory
+			follows the work-group shape. The global kernel can only use a work-group
+			size that divides the world exactly, and otherwise lets the run-time choose,
+			as does the coarse kernel when no size is given.
+		*/
+		unsigned localW, localH;
+		//! Steps per launch for the fused kernel, or zero for a default of 4
+		/*! Larger values mean fewer launches, but more redundant work in the halo,
+			and a tile that needs more local memory.
+		*/
+		unsigned fuse;
+		//! Cells per work-item for the coarse kernel (4, 8, 12 or 16), or zero for a default of 8
+		unsigned coarsen;
+		//! Launches enqueued between flushes, or zero for a default of 64
+		/*! At most two batches are in flight, so the host never gets more than that
+			far ahead of the device.
+		*/
+		unsigned batch;
+		//! Time every launch with OpenCL profiling events (see step_session_t::Profile)
+		bool profile;
+		//! Never Memory_Auto once a session has resolved it
+		step_memory_t memory;
+		//! Compile the kernel for this world and step size, rather than passing them as arguments
+		/*! The global, tiled and coarse kernels are then built with the world size,
+			the weights and the work-group size as -D options,
+			so the compiler can fold them. Each step size needs its own build, which
+			the program cache keeps like any other. Other kernels ignore this.
+		*/
+		bool specialize;
+
+		step_options_t()
+			: kernel(Kernel_Global)
+			, localW(0)
+			, localH(0)
+			, fuse(0)
+			, coarsen(0)
+			, batch(0)
+			, profile(false)
+			, memory(Memory_Auto)
+			, specialize(false)
+		{}
+	};
+
+	//! Name of a kernel as used by HPCE_STEP_KERNEL ("global", "tiled", "fused", "coarse", "image")
+	const char *StepKernelName(step_kernel_t kernel);
+
+	//! Inverse of StepKernelName, which throws std::invalid_argument for unknown names
+	step_kernel_t ParseStepKernel(const std::string &name);
+
+	//! Options taken from the environment
+	/*! HPCE_STEP_KERNEL names the kernel (see StepKernelName), HPCE_LOCAL_SIZE
+		gives the work-group size as WxH, e.g. 32x8, HPCE_FUSE_STEPS the number
+		of steps per launch for the fused kernel, HPCE_COARSEN the cells per
+		work-item for the coarse kernel, HPCE_BATCH the launches per batch,
+		HPCE_PROFILE=1 turns on profiling (just the totals in step_profile_t, rather
+		than the timeline v5 records), HPCE_MEMORY is auto, copy or mapped, and
+		HPCE_SPECIALIZE=1 compiles kernels for the world and step size.
+	*/
+	step_options_t StepOptionsFromEnv();
+
+	//! Human readable summary of options, e.g. "fused kernel, local size 16x16, 4 steps per launch"
+	std::string DescribeStepOptions(const step_options_t &options);
+
+	//! The device named by HPCE_SELECT_PLATFORM and HPCE_SELECT_DEVICE (defaulting to the first of each)
+	cl::Device SelectDevice();
+
+	//! Where the time went in a session
+	struct step_profile_t
+	{
+		unsigned launches;	//! Kernel launches so far
+		double kernelSeconds;	//! Device time spent in kernels, only measured if profiling
+		double submitSeconds;	//! Host time spent in Step, apart from waiting
+		double waitSeconds;	//! Host time spent in Step waiting for the device to catch up
+
+		step_profile_t()
+			: launches(0)
+			, kernelSeconds(0)
+			, submitSeconds(0)
+			, waitSeconds(0)
+		{}
+	};
+
+	//! Values of the probes and regions of a session at one point in time
+	struct step_sample_t
+	{
+		float t;	//! World time of the sample
+		std::vector<float> values;	//! Probes and regions in the order they were added, each region row by row
+	};
+
+	//! How close to a steady state the world was at one point in time, see step_session_t::ConvergeEvery
+	struct step_check_t
+	{
+		float t;	//! World time of the check
+		float maxChange;	//! Largest change of any one cell over the step before t
+		float totalHeat;	//! Sum of the state of every cell
+	};
+
+	//! A picture of the world rendered on the device, see step_session_t::RenderFrame
+	struct step_frame_t
+	{
+		float t;	//! World time of the frame
+		unsigned w, h;	//! Size of the picture in pixels
+		std::vector<uint8_t> scanlines;	//! Padded BGR scanlines exactly as in a bitmap, ready for WriteBitmap
+	};
+
+	//! A world that stays resident on an OpenCL device between calls
+	/*! All the set-up that StepWorldV5PackedProperties repeats on every call (choosing
+		a device, building the program, packing the properties, allocating buffers and
+		copying the world over) is done once when the session is created. After that
+		Step only enqueues kernels, and the host only waits for the device when the
+		world is read back with ReadWorld.
+
+		The device is chosen with HPCE_SELECT_PLATFORM and HPCE_SELECT_DEVICE, as for
+		v3-v5, and the program comes from BuildProgram. Every kernel gives exactly
+		the same results.
+
+		There are two kernel objects, one stepping each buffer into the other, with
+		all their arguments bound up front. A step is then just an enqueue of the
+		right kernel, and the in-order queue makes sure each launch sees the output
+		of the one before. Launches are flushed in batches, and the host waits for
+		the batch before last to finish before starting another, so it can't get
+		arbitrarily far ahead of the device.
+	*/
+	class step_session_t
+	{
+	private:
+		unsigned m_w, m_h;
+		float m_alpha;
+		float m_t;
+		size_t m_cbBuffer;
+		step_options_t m_options;
+
+		cl::Device m_device;
+		cl::Context m_context;
+		cl::CommandQueue m_queue;
+		cl::Program m_program;
+		const char *m_programFile;	//! Source of m_program
+		std::string m_programOptions;	//! Build options of m_program, apart from any specialisation
+		const char *m_kernelName;	//! Kernel in m_program that steps the world
+		cl::NDRange m_globalSize, m_localSize;
+
+		const float *m_mapped;	//! Current state while mapped by MapState, otherwise null
+
+		cl::Buffer m_buffProperties;
+		cl::Buffer m_buffers[2];
+		cl::Kernel m_kernels[2];	//! m_kernels[i] steps m_buffers[i] into m_buffers[1-i]
+		//! With the image kernel these hold the state instead of m_buffers
+		/*! m_kernels[i] then steps m_images[i] into m_images[1-i], and the buffers
+			only receive a copy of the state when something needs it as a buffer.
+		*/
+		cl::Image2D m_images[2];
+		cl::Image2D m_imageProperties;
+		unsigned m_current;	//! Index of the buffer holding the current state
+
+		bool m_argsBound;	//! The weights for m_boundDt are bound to the current kernels
+		float m_boundDt;	//! Step size the weights were worked out from
+		unsigned m_boundFuse[2];	//! Steps per launch bound to each fused kernel, or zero if none yet
+
+		unsigned m_batchLaunches;	//! Launches in the current batch so far
+		std::deque<cl::Event> m_batchEnds;	//! Last launch of each batch that might still be running
+
+		std::deque<cl::Event> m_profileEvents;	//! Launches that haven't been added to m_profile yet
+		step_profile_t m_profile;
+
+		uint64_t m_steps;	//! Steps taken since the session was created
+		unsigned m_sampleEvery;	//! Steps between samples, or zero for none
+		std::vector<cl_ulong> m_gatherIndices;	//! Cell index of each value in a sample
+		bool m_gatherDirty;	//! Indices have changed since they were last copied to the device
+		cl::Program m_gatherProgram;
+		cl::Kernel m_gatherKernel;
+		cl::Buffer m_buffGatherIndices;
+		cl::Buffer m_buffSamples;
+		//! Samples being read back, oldest first
+		/*! Reads write straight into values, so this is a deque, which never moves
+			its elements when one is added or removed at either end.
+		*/
+		std::deque<std::pair<cl::Event,step_sample_t> > m_pendingSamples;
+		std::vector<step_sample_t> m_samples;	//! Samples that have arrived
+
+		unsigned m_checkEvery;	//! Steps between convergence checks, or zero for none
+		float m_tolerance;
+		bool m_converged;	//! A check has come back with a change below m_tolerance
+		size_t m_checkLocal, m_checkGroups;	//! Shape of the first stage of the reduction
+		cl::Program m_checkProgram;
+		cl::Kernel m_checkKernel, m_checkFinalKernel;
+		cl::Buffer m_buffPartials;	//! One result per work-group of the first stage
+		cl::Buffer m_buffCheck;	//! Result of the second stage
+		//! A check whose result is being read back
+		struct pending_check_t
+		{
+			cl::Event event;
+			cl_float2 result;
+			step_check_t check;
+		};
+		std::deque<pending_check_t> m_pendingChecks;	//! Oldest first, and never moved, as for m_pendingSamples
+		std::vector<step_check_t> m_checks;	//! Checks that have arrived
+
+		cl::Program m_renderProgram;	//! Only built once a frame is rendered
+		cl::Kernel m_renderKernel;
+		cl::Buffer m_buffPixels;
+		size_t m_cbPixels;	//! Size of m_buffPixels, which only ever grows
+
+		step_session_t(const step_session_t &);	// Not copyable
+		step_session_t &operator=(const step_session_t &);
+
+		void ChooseWorkGroup();
+
+		//! Build m_program with the given extra options, and bind both kernels to the buffers
+		void CreateKernels(const std::string &extraOptions);
+
+		//! Rebuild the kernels with the size, weights and work-group size as constants
+		void Specialize(float inner, float outer);
+
+		//! Give both kernels the same argument
+		template<class T>
+		void SetArgs(cl_uint index, const T &value)
+		{
+			m_kernels[0].setArg(index, value);
+			m_kernels[1].setArg(index, value);
+		}
+
+		//! Add completed launches to the profile
+		void CollectProfile(bool all);
+
+		//! Replace the whole of buffer with src, blocking until done
+		void WriteWhole(const cl::Buffer &buffer, const void *src);
+
+		//! m_buffers[i], first bringing it up to date from m_images[i] if the state is in images
+		const cl::Buffer &StateBuffer(unsigned i);
+
+		//! Enqueue a gather of the current state, and a read of it that doesn't block
+		void Sample();
+
+		//! Move samples whose reads have completed to m_samples
+		void CollectSamples(bool all);
+
+		//! Enqueue a reduction of the current state, and a read of the result that doesn't block
+		void Check();
+
+		//! Move checks whose reads have completed to m_checks, noting whether the world has converged
+		void CollectChecks(bool all);
+	public:
+		//! Copy the world to the device, ready to be stepped
+		step_session_t(const world_t &world, const step_options_t &options=step_options_t());
+
+		//! Copy the world to a specific device, ready to be stepped
+		step_session_t(const world_t &world, const step_options_t &options, const cl::Device &device);
+
+		//! Enqueue n steps of size dt, without waiting for them to complete
+		/*! If convergence checks are on (see ConvergeEvery) this stops early once
+			a check says the world has converged, and does nothing at all after that.
+			\return Number of steps enqueued, which is only less than n on convergence
+		*/
+		unsigned Step(float dt, unsigned n);
+
+		//! Wait for all the steps enqueued so far to complete
+		void Finish();
+
+		//! Wait for outstanding steps, then copy the current state and time into world
+		/*! world must have the same dimensions as the one the session was created from */
+		void ReadWorld(world_t &world);
+
+		//! Wait for outstanding steps, then give direct access to the current state
+		/*! With mapped memory this is the buffer itself, with no copy at all. The
+			pointer is valid until UnmapState, which must be called before stepping
+			again.
+		*/
+		const float *MapState();
+
+		//! Release the state mapped by MapState
+		void UnmapState();
+
+		//! Watch the cell at (x,y), returning the position of its value in each sample
+		unsigned AddProbe(unsigned x, unsigned y);
+
+		//! Watch the w x h cells with top-left corner (x,y), returning the position of the first in each sample
+		unsigned AddRegion(unsigned x, unsigned y, unsigned w, unsigned h);
+
+		//! Take a sample every k steps (counting from when the session was created), or never if k is zero
+		/*! Each sample is gathered into a small buffer on the device, and read back
+			without waiting, so stepping carries on while it is in flight.
+		*/
+		void SampleEvery(unsigned k);
+
+		//! Samples that have arrived since the last call, oldest first
+		/*! If wait is true this first waits for everything enqueued so far, so all
+			samples up to now are included.
+		*/
+		std::vector<step_sample_t> TakeSamples(bool wait=false);
+
+		//! Check for a steady state every k steps, or never if k is zero
+		/*! Each check reduces the state on the device to the largest change of any
+			cell over the last step and the total heat, and only those two numbers
+			are read back, without waiting. Once a check comes back with a change
+			below tolerance the world counts as converged, and Step stops enqueuing.
+			The result arrives a little after the check was enqueued, so the world
+			may have been stepped a little past that point.
+		*/
+		void ConvergeEvery(unsigned k, float tolerance);
+
+		//! True once a check has found the largest change below the tolerance
+		bool Converged() const
+		{ return m_converged; }
+
+		//! Checks that have arrived since the last call, oldest first
+		/*! If wait is true this first waits for everything enqueued so far */
+		std::vector<step_check_t> TakeChecks(bool wait=false);
+
+		//! Wait for outstanding steps, then render the current state on the device
+		/*! Only the picture is read back, which is three bytes per pixel rather than
+			four per cell, and far less if it is shrunk. The picture is exactly what
+			RenderWorld would draw for DownsampleWorld(world, w, h, filter), so w and h
+			of zero give a full size picture.
+		*/
+		step_frame_t RenderFrame(unsigned w=0, unsigned h=0, downsample_filter_t filter=Filter_Box);
+
+		unsigned Width() const
+		{ return m_w; }
+
+		unsigned Height() const
+		{ return m_h; }
+
+		//! World time after all the steps enqueued so far
+		float Time() const
+		{ return m_t; }
+
+		//! The options actually in use, with any defaults filled in
+		const step_options_t &Options() const
+		{ return m_options; }
+
+		//! Where the time has gone so far, with kernel times up to the last Finish or ReadWorld
+		const step_profile_t &Profile() const
+		{ return m_profile; }
+
+		const cl::Device &Device() const
+		{ return m_device; }
+	};
+
+	//! Same interface as the other versions, using a session (with options from ChooseStepOptions) for the duration of the call
+	/*! If the device is chosen automatically (see ChooseStepTarget) this may step on the host instead. */
+	void StepWorldV6Session(world_t &world, float dt, unsigned n);
+
+}; // namepspace yl10313
+
+}; // namepspace hpce
+
+#endif
@@ -0,0 +1,109 @@
+// Same update as step_world_v5_kernel.cl, but each work-group first copies its
+// tile of the state, plus a one cell halo, into local memory. Each state value is
+// then read from global memory roughly once per step, rather than five times.
+
+// The session can fix the world size (HPCE_W and HPCE_H), the weights
+// (HPCE_INNER and HPCE_OUTER) and the work-group size (HPCE_LOCAL_W and
+// HPCE_LOCAL_H) as build options, so the compiler can fold them into the index
+// arithmetic and unroll the tile load. The arguments are then ignored.
+
+// Keep a*b+c as two roundings, so the results match the other kernels and the host
+#pragma OPENCL FP_CONTRACT OFF
+
+enum cell_flags_t{
+           Cell_Fixed      =0x1,
+           Cell_Insulator  =0x2
+};
+
+__kernel void kernel_tiled(
+	__global const float *world_state, //0
+	float inner_arg, //1
+	float outer_arg, //2
+	__global float *buffer, //3
+	__global const uchar *world_properties, //4, packed by kernel_pack
+	uint w_arg, //5
+	uint h_arg, //6
+	__local float *tile //7, (local width+2)*(local height+2) floats
+	){
+
+#ifdef HPCE_INNER
+	const float inner=HPCE_INNER, outer=HPCE_OUTER;
+#else
+	const float inner=inner_arg, outer=outer_arg;
+#endif
+#ifdef HPCE_W
+	const uint w=HPCE_W, h=HPCE_H;
+#else
+	const uint w=w_arg, h=h_arg;
+#endif
+
+	// The global size is padded up to a multiple of the local size, so there may
+	// be work-items past the edge of the world, which only help with loading.
+#ifdef HPCE_LOCAL_W
+	const size_t lw=HPCE_LOCAL_W, lh=HPCE_LOCAL_H;
+#else
+	size_t lw=get_local_size(0), lh=get_local_size(1);
+#endif
+	size_t lx=get_local_id(0), ly=get_local_id(1);
+	size_t x0=get_group_id(0)*lw, y0=get_group_id(1)*lh;
+	size_t tw=lw+2;
+
+	// Cooperatively load the tile and halo. Coordinates are clamped to the world,
+	// and the clamped copies are never used: packed properties only mark
+	// neighbours that are inside the world as conductive.
+	for(size_t i=ly*lw+lx; i<tw*(lh+2); i+=lw*lh){
+		size_t gx=x0+i%tw, gy=y0+i/tw;
+		gx=min(gx==0 ? 0 : gx-1, (size_t)w-1);
+		gy=min(gy==0 ? 0 : gy-1, (size_t)h-1);
+		tile[i]=world_state[gy*w+gx];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	size_t x=x0+lx, y=y0+ly;
+	if(x>=w || y>=h)
+		return;
+
+	// Kept in size_t so that worlds of more than 2^32 cells don't wrap
+	size_t index=y*w + x;
+	size_t t=(ly+1)*tw + lx+1;
+	uint myProps = world_properties[index];
+
+	if((myProps & Cell_Fixed) || (myProps & Cell_Insulator)){
+		// Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
+		buffer[index]=tile[t];
+	}else{
+		float contrib=inner;
+		float acc=inner*tile[t];
+
+		// Cell above
+		if(myProps & 0x4) {
+			contrib += outer;
+			acc += outer * tile[t-tw];
+		}
+
+		// Cell below
+		if(myProps & 0x8){
+			contrib += outer;
+			acc += outer * tile[t+tw];
+		}
+
+		// Cell left
+		if(myProps & 0x10){
+			contrib += outer;
+			acc += outer * tile[t-1];
+		}
+
+		// Cell right
+		if(myProps & 0x20){
+			contrib += outer;
+			acc += outer * tile[t+1];
+		}
+
+		// Scale the accumulate value by the number of places contributing to it
+		float res=acc/contrib;
+		// Then clamp to the range [0,1]
+		res=min(1.0f, max(0.0f, res));
+		buffer[index] = res;
+
+	} // end of if(insulator){ ... } else {
+}
@@ -27,10 +27,10 @@ void StepWorldV1Lambda(world_t &world, float dt, unsigned n)
 	float inner=1-outer/4;				// Anything that doesn't spread stays
 	
 	// This is our temporary working space
-	std::vector<float> buffer(w*h);
+	std::vector<float> buffer(WorldCells(w, h));
 
 	auto kernel_xy = [&] (unsigned x, unsigned y){
-		unsigned index=y*w + x;
+		size_t index=CellIndex(x,y,w);
 				
 		if((world.properties[index] & Cell_Fixed) || (world.properties[index] & Cell_Insulator)){
 			// Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
@@ -96,6 +96,8 @@ void StepWorldV1Lambda(world_t &world, float dt, unsigned n)
 }; // namepspace hpce
 
 
+// Left out when linked into step_world, which picks a version with --engine
+#ifndef HPCE_NO_MAIN
 int main(int argc, char *argv[])
 {
 	float dt=0.1;
@@ -128,4 +130,4 @@ int main(int argc, char *argv[])
 		
 	return 0;
 }
-
+#endif
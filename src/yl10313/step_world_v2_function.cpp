@@ -21,7 +21,7 @@ namespace yl10313{
 */
 void kernel_xy(uint32_t x, uint32_t y, uint32_t w, const float *world_state, float inner, float outer, float *buffer, const uint32_t *world_properties)
  {
-    unsigned index=y*w + x;
+    size_t index=CellIndex(x,y,w);
 				
 	if((world_properties[index] & Cell_Fixed) || (world_properties[index] & Cell_Insulator)){
 		// Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
@@ -71,7 +71,7 @@ void StepWorldV2Function(world_t &world, float dt, unsigned n)
 	float inner=1-outer/4;				// Anything that doesn't spread stays
 	
 	// This is our temporary working space
-	std::vector<float> buffer(w*h);
+	std::vector<float> buffer(WorldCells(w, h));
 	
 	for(unsigned t=0;t<n;t++){
 		for(unsigned y=0;y<h;y++){
@@ -96,6 +96,8 @@ void StepWorldV2Function(world_t &world, float dt, unsigned n)
 }; // namepspace hpce
 
 
+// Left out when linked into step_world, which picks a version with --engine
+#ifndef HPCE_NO_MAIN
 int main(int argc, char *argv[])
 {
 	float dt=0.1;
@@ -128,4 +130,4 @@ int main(int argc, char *argv[])
 		
 	return 0;
 }
-
+#endif
@@ -11,11 +11,11 @@ __kernel void kernel_xy(
 	__global const uint *world_properties //4
 	){
     
-    uint x=get_global_id(0);
-    uint y=get_global_id(1);
-    uint w=get_global_size(0);
+    size_t x=get_global_id(0);
+    size_t y=get_global_id(1);
+    size_t w=get_global_size(0);
 
-	unsigned index=y*w + x;
+	size_t index=y*w + x;
 	
 	if((world_properties[index] & Cell_Fixed) || (world_properties[index] & Cell_Insulator)){
 		// Do nothing, this cell never changes (e.g. a boundary, or an interior fixed-value heat-source)
@@ -11,38 +11,13 @@
 #define __CL_USE_DEPRECATED_OPENCL_1_1_APIS
 #include "CL/cl.hpp"
 
-
-// kernal things
-#include <fstream>
-#include <streambuf>
-
+#include "program_cache.hpp"
 
 
 namespace hpce{
 
 namespace yl10313{
 
-
-	std::string LoadSource(const char *fileName)
-	{
-		// Don't forget to change your_login here
-		std::string baseDir="src/yl10313";
-		if(getenv("HPCE_CL_SRC_DIR")){
-			baseDir=getenv("HPCE_CL_SRC_DIR");
-		}
-		
-		std::string fullName=baseDir+"/"+fileName;
-		
-		std::ifstream src(fullName, std::ios::in | std::ios::binary);
-		if(!src.is_open())
-			throw std::runtime_error("LoadSource : Couldn't load cl file from '"+fullName+"'.");
-		
-		return std::string(
-			(std::istreambuf_iterator<char>(src)), // Node the extra brackets.
-            std::istreambuf_iterator<char>()
-		);
-	}
-
 	
 //! Create a square world with a standardised "slalom track"
 
@@ -143,22 +118,8 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
 	// create OpenCL context
 	cl::Context context(devices);
 
-	// Load cl source
-	std::string kernelSource=hpce::yl10313::LoadSource("step_world_v3_kernel.cl");
-	
-	cl::Program::Sources sources;	// A vector of (data,length) pairs
-	sources.push_back(std::make_pair(kernelSource.c_str(), kernelSource.size()+1));	// push on our single string
-	
-	cl::Program program(context, sources);
-	try{
-		program.build(devices);
-	}catch(...){
-		for(unsigned i=0;i<devices.size();i++){
-			std::cerr<<"Log for device "<<devices[i].getInfo<CL_DEVICE_NAME>()<<":\n\n";
-			std::cerr<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[i])<<"\n\n";
-		}
-		throw;
-	}
+	// Build the kernels, or fetch them from the binary cache
+	cl::Program program=BuildProgram(context, device, "step_world_v3_kernel.cl");
 
 	// Declare the variables
 	unsigned w=world.w, h=world.h;
@@ -166,7 +127,9 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
 	float inner=1-outer/4;				// Anything that doesn't spread stays
 
 	// Create the buffer used in the OpenCL Kernel
-	size_t cbBuffer=4*world.w*world.h;
+	size_t cbBuffer=sizeof(float)*WorldCells(world.w, world.h);
+	if(cbBuffer > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+		throw std::runtime_error("World is too large to fit in a single buffer on this device.");
 	cl::Buffer buffProperties(context, CL_MEM_READ_ONLY, cbBuffer);
 	cl::Buffer buffState(context, CL_MEM_READ_ONLY, cbBuffer);
 	cl::Buffer buffBuffer(context, CL_MEM_WRITE_ONLY, cbBuffer);
@@ -198,7 +161,7 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
 
 	
 	// This is our temporary working space
-	std::vector<float> buffer(w*h);
+	std::vector<float> buffer(WorldCells(w, h));
 	
 	// for(unsigned t=0;t<n;t++){
 	// 	for(unsigned y=0;y<h;y++){
@@ -218,7 +181,7 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
 	// } // end of for(t...
 
 
-	for (int t = 0; t < n; ++t)
+	for (unsigned t = 0; t < n; ++t)
 	{
 
 		// copy current state over the GPU
@@ -269,6 +232,8 @@ void StepWorldV3OpenCL(world_t &world, float dt, unsigned n)
 }; // namepspace hpce
 
 
+// Left out when linked into step_world, which picks a version with --engine
+#ifndef HPCE_NO_MAIN
 int main(int argc, char *argv[])
 {
 
@@ -307,4 +272,4 @@ int main(int argc, char *argv[])
 		
 	return 0;
 }
-
+#endif
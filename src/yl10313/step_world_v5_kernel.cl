@@ -1,3 +1,16 @@
+// Keep a*b+c as two roundings, so the results match the host exactly
+#pragma OPENCL FP_CONTRACT OFF
+
+// Type of the packed properties: the session packs them into bytes on the
+// device (see step_world_pack_kernel.cl), and builds with -DHPCE_PROPERTY_T=uchar
+#ifndef HPCE_PROPERTY_T
+#define HPCE_PROPERTY_T uint
+#endif
+
+// The session can also fix the width (HPCE_W) and the weights (HPCE_INNER and
+// HPCE_OUTER) as build options, so the compiler can fold them into the code.
+// The arguments are then ignored.
+
 enum cell_flags_t{
            Cell_Fixed      =0x1,
            Cell_Insulator  =0x2
@@ -5,17 +18,27 @@ enum cell_flags_t{
 
 __kernel void kernel_xy(
 	__global const float *world_state, //0
-	float inner, //1
-	float outer, //2
+	float inner_arg, //1
+	float outer_arg, //2
 	__global float *buffer, //3 
-	__global const uint *world_properties //4
+	__global const HPCE_PROPERTY_T *world_properties //4
 	){
     
-    uint x=get_global_id(0);
-    uint y=get_global_id(1);
-    uint w=get_global_size(0);
+    size_t x=get_global_id(0);
+    size_t y=get_global_id(1);
+#ifdef HPCE_W
+    const size_t w=HPCE_W;
+#else
+    size_t w=get_global_size(0);
+#endif
+#ifdef HPCE_INNER
+    const float inner=HPCE_INNER, outer=HPCE_OUTER;
+#else
+    const float inner=inner_arg, outer=outer_arg;
+#endif
 
-	unsigned index=y*w + x;
+	// Kept in size_t so that worlds of more than 2^32 cells don't wrap
+	size_t index=y*w + x;
 	uint myProps = world_properties[index];
 	
 	if((myProps & Cell_Fixed) || (myProps & Cell_Insulator)){
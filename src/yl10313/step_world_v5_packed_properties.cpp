@@ -5,46 +5,49 @@
 #include <cstdint>
 #include <memory>
 #include <cstdio>
+#include <chrono>
+#include <fstream>
+#include <sstream>
 
 // OpenCL define:
 #define __CL_ENABLE_EXCEPTIONS
 #define __CL_USE_DEPRECATED_OPENCL_1_1_APIS
 #include "CL/cl.hpp"
 
-
-// kernel things
-#include <fstream>
-#include <streambuf>
-
+#include "program_cache.hpp"
+#include "step_timeline.hpp"
 
 
 namespace hpce{
 
 namespace yl10313{
 
+namespace{
 
-	std::string LoadSource(const char *fileName)
+	//! Write the report of a timeline to HPCE_PROFILE_JSON, or stderr if that isn't set
+	void WriteTimelineReport(timeline_t &timeline, const cl::Device &device, const world_t &world, unsigned n)
 	{
-		// Don't forget to change your_login here
-		std::string baseDir="src/yl10313";
-		if(getenv("HPCE_CL_SRC_DIR")){
-			baseDir=getenv("HPCE_CL_SRC_DIR");
+		std::stringstream info;
+		info<<"\"device\": "<<JsonString(device.getInfo<CL_DEVICE_NAME>())<<", \"w\": "<<world.w<<", \"h\": "<<world.h<<", \"steps\": "<<n;
+
+		const char *fileName=getenv("HPCE_PROFILE_JSON");
+		if(fileName && *fileName){
+			std::ofstream dst(fileName);
+			if(!dst.is_open())
+				throw std::runtime_error(std::string("WriteTimelineReport : Couldn't open '")+fileName+"'.");
+			timeline.WriteJson(dst, info.str());
+		}else{
+			timeline.WriteJson(std::cerr, info.str());
 		}
-		
-		std::string fullName=baseDir+"/"+fileName;
-		
-		std::ifstream src(fullName, std::ios::in | std::ios::binary);
-		if(!src.is_open())
-			throw std::runtime_error("LoadSource : Couldn't load cl file from '"+fullName+"'.");
-		
-		return std::string(
-			(std::istreambuf_iterator<char>(src)), // Node the extra brackets.
-            std::istreambuf_iterator<char>()
-		);
 	}
 
+}; // anonymous namespace
+
 void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n)
 {
+	// HPCE_PROFILE=1 times every command, and reports where the time went
+	timeline_t timeline(timeline_t::EnabledFromEnv());
+
 	// Choose a platform
 	std::vector<cl::Platform> platforms;
  	cl::Platform::get(&platforms);
@@ -89,22 +92,10 @@ void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n)
 	// create OpenCL context
 	cl::Context context(devices);
 
-	// Load cl source
-	std::string kernelSource=hpce::yl10313::LoadSource("step_world_v5_kernel.cl");
-	
-	cl::Program::Sources sources;	// A vector of (data,length) pairs
-	sources.push_back(std::make_pair(kernelSource.c_str(), kernelSource.size()+1));	// push on our single string
-	
-	cl::Program program(context, sources);
-	try{
-		program.build(devices);
-	}catch(...){
-		for(unsigned i=0;i<devices.size();i++){
-			std::cerr<<"Log for device "<<devices[i].getInfo<CL_DEVICE_NAME>()<<":\n\n";
-			std::cerr<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[i])<<"\n\n";
-		}
-		throw;
-	}
+	// Build the kernels, or fetch them from the binary cache
+	auto beginCompile=std::chrono::steady_clock::now();
+	cl::Program program=BuildProgram(context, device, "step_world_v5_kernel.cl");
+	timeline.AddHost(Phase_Compile, std::chrono::duration<double>(std::chrono::steady_clock::now()-beginCompile).count());
 
 
 
@@ -114,7 +105,9 @@ void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n)
 	float inner=1-outer/4;				// Anything that doesn't spread stays
 
 
-	size_t cbBuffer=4*world.w*world.h;
+	size_t cbBuffer=sizeof(float)*WorldCells(world.w, world.h);
+	if(cbBuffer > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+		throw std::runtime_error("World is too large to fit in a single buffer on this device.");
 	cl::Buffer buffProperties(context, CL_MEM_READ_ONLY, cbBuffer);
 	cl::Buffer buffState(context, CL_MEM_READ_WRITE, cbBuffer);
 	cl::Buffer buffBuffer(context, CL_MEM_READ_WRITE, cbBuffer);
@@ -130,14 +123,15 @@ void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n)
 	kernel.setArg(4, buffProperties);
 
 	// Create a command queue
-	cl::CommandQueue queue(context, device);
+	cl::CommandQueue queue(context, device, timeline.QueueProperties());
 
+	auto beginPack=std::chrono::steady_clock::now();
 	std::vector<uint32_t> packed(world.properties.begin(), world.properties.end());
 	for (unsigned y = 0; y < h; y++)
 	{
 		for (unsigned x = 0; x < w; x++)
 		{
-			unsigned index=y*w + x;
+			size_t index=CellIndex(x,y,w);
 			// packed[index]=world.properties[index];
 			if (!packed[index]){
 				if ( !( packed[index-w] & Cell_Insulator) )
@@ -164,6 +158,8 @@ void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n)
 		}
 	}
 
+	timeline.AddHost(Phase_Pack, std::chrono::duration<double>(std::chrono::steady_clock::now()-beginPack).count());
+
 		// setting up the iteration space
 	// Always start iterations at x=0, y=0
 	cl::NDRange offset(0, 0);		
@@ -180,16 +176,20 @@ void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n)
 	// "0" : The starting offset within the GPU buffer.
 	// "cbBuffer" : The number of bytes to copy.
 	// "&world.properties[0]"" : Pointer to the data in host memory (DDR in this case) we want to copy.
-	queue.enqueueWriteBuffer(buffProperties, CL_TRUE, 0, cbBuffer, &packed[0]);
+	queue.enqueueWriteBuffer(buffProperties, CL_TRUE, 0, cbBuffer, &packed[0], NULL, timeline.Event());
+	timeline.Add(Phase_Upload, cbBuffer);
 
 		
 	// } // end of for(t...
-	queue.enqueueWriteBuffer(buffState, CL_TRUE, 0, cbBuffer, &world.state[0]);
+	queue.enqueueWriteBuffer(buffState, CL_TRUE, 0, cbBuffer, &world.state[0], NULL, timeline.Event());
+	timeline.Add(Phase_Upload, cbBuffer);
 
-	for (int t = 0; t < n; ++t)
+	for (unsigned t = 0; t < n; ++t)
 	{
 
-		queue.enqueueNDRangeKernel(kernel, offset, globalSize, localSize);
+		queue.enqueueNDRangeKernel(kernel, offset, globalSize, localSize, NULL, timeline.Event());
+		// Each cell reads its state and properties and writes its new state
+		timeline.Add(Phase_Kernel, 3*cbBuffer, (uint64_t)w*h);
 
 		queue.enqueueBarrier();
 
@@ -205,7 +205,13 @@ void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n)
 
 	} // end of for(t...
 
-	queue.enqueueReadBuffer(buffBuffer, CL_TRUE, 0, cbBuffer, &world.state[0]);
+	// After the final swap the newest state is in buffState
+	queue.enqueueReadBuffer(buffState, CL_TRUE, 0, cbBuffer, &world.state[0], NULL, timeline.Event());
+	timeline.Add(Phase_Readback, cbBuffer);
+
+	if(timeline.Enabled()){
+		WriteTimelineReport(timeline, device, world, n);
+	}
 }
 
 }; // namepspace yl10313
@@ -213,6 +219,8 @@ void StepWorldV5PackedProperties(world_t &world, float dt, unsigned n)
 }; // namepspace hpce
 
 
+// Left out when linked into step_world, which picks a version with --engine
+#ifndef HPCE_NO_MAIN
 int main(int argc, char *argv[])
 {
 	float dt=0.1;
@@ -245,4 +253,4 @@ int main(int argc, char *argv[])
 		
 	return 0;
 }
-
+#endif
@@ -0,0 +1,215 @@
+#include "step_tuner.hpp"
+
+#include <cstdlib>
+#include <cstdio>
+#include <sstream>
+
+// Usage: step_world_v6_session [dt [n [binary [chunk]]]]
+//
+//   chunk  Step in calls of this many steps, reading the world back after each
+//          one as an interactive viewer would. The default of 0 does all n steps
+//          in one call.
+//
+// The kernel and its parameters come from HPCE_STEP_KERNEL, HPCE_LOCAL_SIZE,
+// HPCE_FUSE_STEPS and HPCE_COARSEN (see StepOptionsFromEnv). Without
+// HPCE_STEP_KERNEL the tuning database is used, and HPCE_TUNE=1 benchmarks
+// the kernels first (see ChooseStepOptions). HPCE_SELECT_DEVICE=auto picks the
+// fastest device, or the host, for the world (see ChooseStepTarget). With
+// HPCE_PROFILE=1 the time spent in kernels and submitting them is reported.
+//
+// HPCE_PROBES lists cells to watch as "x,y x,y ...", and HPCE_REGIONS lists
+// rectangles as "x,y,w,h ...". Every HPCE_SAMPLE_EVERY steps (default 100)
+// their values are printed to stderr, without reading back the whole world.
+//
+// HPCE_FRAMES gives a prefix for pictures rendered on the device every
+// HPCE_FRAME_EVERY steps (default 100), so HPCE_FRAMES=tmp/f writes
+// tmp/f000100.bmp, tmp/f000200.bmp and so on. HPCE_FRAME_SIZE shrinks them
+// to WxH as render_world would (either may be 0 to keep the aspect ratio),
+// and HPCE_FRAME_FILTER is box or max.
+//
+// HPCE_TOLERANCE stops stepping early once no cell changes by more than that
+// in a step, which is checked on the device every HPCE_CONVERGE_EVERY steps
+// (default 100). Each check is printed to stderr.
+
+namespace{
+
+	void AddProbes(hpce::yl10313::step_session_t &session)
+	{
+		std::istringstream probes(getenv("HPCE_PROBES") ? getenv("HPCE_PROBES") : "");
+		std::string item;
+		while(probes>>item){
+			unsigned x, y;
+			if(2!=sscanf(item.c_str(), "%u,%u", &x, &y))
+				throw std::invalid_argument("HPCE_PROBES should look like 10,20 30,40.");
+			session.AddProbe(x, y);
+		}
+
+		std::istringstream regions(getenv("HPCE_REGIONS") ? getenv("HPCE_REGIONS") : "");
+		while(regions>>item){
+			unsigned x, y, w, h;
+			if(4!=sscanf(item.c_str(), "%u,%u,%u,%u", &x, &y, &w, &h))
+				throw std::invalid_argument("HPCE_REGIONS should look like 10,20,4,4 30,40,2,8.");
+			session.AddRegion(x, y, w, h);
+		}
+
+		unsigned every=100;
+		if(getenv("HPCE_SAMPLE_EVERY") && *getenv("HPCE_SAMPLE_EVERY")){
+			every=atoi(getenv("HPCE_SAMPLE_EVERY"));
+		}
+		session.SampleEvery(every);
+	}
+
+	void PrintSamples(const std::vector<hpce::yl10313::step_sample_t> &samples)
+	{
+		for(unsigned i=0;i<samples.size();i++){
+			std::cerr<<"Sample t="<<samples[i].t<<" :";
+			for(unsigned j=0;j<samples[i].values.size();j++){
+				std::cerr<<" "<<samples[i].values[j];
+			}
+			std::cerr<<"\n";
+		}
+	}
+
+	void SetConvergence(hpce::yl10313::step_session_t &session)
+	{
+		if(!getenv("HPCE_TOLERANCE") || !*getenv("HPCE_TOLERANCE"))
+			return;
+		unsigned every=100;
+		if(getenv("HPCE_CONVERGE_EVERY") && *getenv("HPCE_CONVERGE_EVERY")){
+			every=atoi(getenv("HPCE_CONVERGE_EVERY"));
+		}
+		session.ConvergeEvery(every, strtof(getenv("HPCE_TOLERANCE"), NULL));
+	}
+
+	void PrintChecks(const std::vector<hpce::yl10313::step_check_t> &checks)
+	{
+		for(unsigned i=0;i<checks.size();i++){
+			std::cerr<<"Check t="<<checks[i].t<<" : max change "<<checks[i].maxChange<<", total heat "<<checks[i].totalHeat<<"\n";
+		}
+	}
+
+	//! Where and how often to write frames, from HPCE_FRAMES etc.
+	struct frame_options_t
+	{
+		std::string prefix;
+		unsigned every;	//! Zero for no frames
+		unsigned w, h;
+		hpce::downsample_filter_t filter;
+	};
+
+	frame_options_t FrameOptionsFromEnv()
+	{
+		frame_options_t res;
+		res.prefix=getenv("HPCE_FRAMES") ? getenv("HPCE_FRAMES") : "";
+		res.every=res.prefix.empty() ? 0 : 100;
+		if(getenv("HPCE_FRAME_EVERY") && *getenv("HPCE_FRAME_EVERY")){
+			res.every=atoi(getenv("HPCE_FRAME_EVERY"));
+		}
+		res.w=0;
+		res.h=0;
+		if(getenv("HPCE_FRAME_SIZE") && *getenv("HPCE_FRAME_SIZE")){
+			if(2!=sscanf(getenv("HPCE_FRAME_SIZE"), "%ux%u", &res.w, &res.h))
+				throw std::invalid_argument("HPCE_FRAME_SIZE should look like 640x480.");
+		}
+		res.filter=hpce::Filter_Box;
+		if(getenv("HPCE_FRAME_FILTER") && *getenv("HPCE_FRAME_FILTER")){
+			std::string filter=getenv("HPCE_FRAME_FILTER");
+			if(filter=="max"){
+				res.filter=hpce::Filter_Max;
+			}else if(filter!="box"){
+				throw std::invalid_argument("HPCE_FRAME_FILTER should be box or max.");
+			}
+		}
+		return res;
+	}
+
+	void WriteFrame(hpce::yl10313::step_session_t &session, const frame_options_t &frames, unsigned step)
+	{
+		char name[16];
+		snprintf(name, sizeof(name), "%06u.bmp", step);
+		hpce::yl10313::step_frame_t frame=session.RenderFrame(frames.w, frames.h, frames.filter);
+		hpce::WriteBitmap(frames.prefix+name, frame.w, frame.h, &frame.scanlines[0]);
+	}
+
+}; // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+	float dt=0.1;
+	unsigned n=1;
+	bool binary=false;
+	unsigned chunk=0;
+	
+	if(argc>1){
+		dt=strtof(argv[1], NULL);
+	}
+	if(argc>2){
+		n=atoi(argv[2]);
+	}
+	if(argc>3){
+		if(atoi(argv[3]))
+			binary=true;
+	}
+	if(argc>4){
+		chunk=atoi(argv[4]);
+	}
+	if(chunk==0){
+		chunk=n;
+	}
+	
+	try{
+		hpce::world_t world=hpce::LoadWorld(std::cin);
+		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
+		
+		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<" in chunks of "<<chunk<<std::endl;
+		hpce::yl10313::step_target_t target=hpce::yl10313::ChooseStepTarget(world);
+		if(target.host){
+			for(unsigned done=0;done<n;done+=chunk){
+				hpce::yl10313::StepOnHost(target, world, dt, std::min(chunk, n-done));
+			}
+		}else{
+			hpce::yl10313::step_options_t options=hpce::yl10313::ChooseStepOptions(world, target.clDevice);
+			hpce::yl10313::step_session_t session(world, options, target.clDevice);
+			std::cerr<<"Using "<<hpce::yl10313::DescribeStepOptions(session.Options())<<std::endl;
+			AddProbes(session);
+			SetConvergence(session);
+			frame_options_t frames=FrameOptionsFromEnv();
+			for(unsigned done=0;done<n;){
+				unsigned todo=std::min(chunk-done%chunk, n-done);
+				if(frames.every){
+					todo=std::min(todo, frames.every-done%frames.every);
+				}
+				unsigned stepped=session.Step(dt, todo);
+				done+=stepped;
+
+				if(frames.every && done%frames.every==0){
+					WriteFrame(session, frames, done);
+				}
+				if(done%chunk==0 || done==n || stepped<todo){
+					session.ReadWorld(world);
+					PrintSamples(session.TakeSamples());
+					PrintChecks(session.TakeChecks());
+				}
+				if(stepped<todo){
+					std::cerr<<"Converged after "<<done<<" steps, at t="<<session.Time()<<std::endl;
+					break;
+				}
+			}
+
+			const hpce::yl10313::step_profile_t &profile=session.Profile();
+			if(session.Options().profile && profile.launches){
+				std::cerr<<"Profile : "<<profile.launches<<" launches, "
+					<<profile.kernelSeconds*1e3<<" ms in kernels ("<<profile.kernelSeconds*1e6/profile.launches<<" us per launch), "
+					<<profile.submitSeconds*1e3<<" ms submitting ("<<profile.submitSeconds*1e6/profile.launches<<" us per launch), "
+					<<profile.waitSeconds*1e3<<" ms waiting for the device"<<std::endl;
+			}
+		}
+		
+		hpce::SaveWorld(std::cout, world, binary);
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+		
+	return 0;
+}
@@ -0,0 +1,57 @@
+#include "step_bands.hpp"
+
+#include <cstdlib>
+
+// Usage: step_world_v7_bands [dt [n [binary [chunk]]]]
+//
+//   chunk  Step in calls of this many steps, reading the world back after each
+//          one. The default of 0 does all n steps in one call.
+//
+// The devices, host threads and halo depth come from HPCE_BAND_DEVICES,
+// HPCE_BAND_THREADS and HPCE_BAND_HALO (see BandOptionsFromEnv).
+
+int main(int argc, char *argv[])
+{
+	float dt=0.1;
+	unsigned n=1;
+	bool binary=false;
+	unsigned chunk=0;
+	
+	if(argc>1){
+		dt=strtof(argv[1], NULL);
+	}
+	if(argc>2){
+		n=atoi(argv[2]);
+	}
+	if(argc>3){
+		if(atoi(argv[3]))
+			binary=true;
+	}
+	if(argc>4){
+		chunk=atoi(argv[4]);
+	}
+	if(chunk==0){
+		chunk=n;
+	}
+	
+	try{
+		hpce::world_t world=hpce::LoadWorld(std::cin);
+		std::cerr<<"Loaded world with w="<<world.w<<", h="<<world.h<<std::endl;
+		
+		std::cerr<<"Stepping by dt="<<dt<<" for n="<<n<<" in chunks of "<<chunk<<std::endl;
+		hpce::yl10313::band_session_t session(world, hpce::yl10313::BandOptionsFromEnv());
+		std::cerr<<"Starting bands : "<<session.DescribeBands()<<std::endl;
+		for(unsigned done=0;done<n;done+=chunk){
+			session.Step(dt, std::min(chunk, n-done));
+			session.ReadWorld(world);
+		}
+		std::cerr<<"Final bands : "<<session.DescribeBands()<<std::endl;
+		
+		hpce::SaveWorld(std::cout, world, binary);
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+		
+	return 0;
+}
@@ -0,0 +1,61 @@
+#include "step_ensemble.hpp"
+
+#include <cstdlib>
+#include <sstream>
+
+// Usage: step_world_v8_ensemble [dt [n [binary]]]
+//
+// Reads any number of worlds, one after the other, from stdin, steps them all
+// together in an ensemble, and writes them out in the same order.
+// HPCE_ENSEMBLE_DT can give a different step size for each world, as a list
+// like "0.1 0.05 0.2", in which case dt is ignored.
+
+int main(int argc, char *argv[])
+{
+	float dt=0.1;
+	unsigned n=1;
+	bool binary=false;
+
+	if(argc>1){
+		dt=strtof(argv[1], NULL);
+	}
+	if(argc>2){
+		n=atoi(argv[2]);
+	}
+	if(argc>3){
+		if(atoi(argv[3]))
+			binary=true;
+	}
+
+	try{
+		std::vector<hpce::world_t> worlds;
+		while((std::cin>>std::ws).peek()!=EOF){
+			worlds.push_back(hpce::LoadWorld(std::cin));
+		}
+		std::cerr<<"Loaded "<<worlds.size()<<" worlds"<<std::endl;
+
+		std::vector<float> dts(worlds.size(), dt);
+		if(getenv("HPCE_ENSEMBLE_DT") && *getenv("HPCE_ENSEMBLE_DT")){
+			std::istringstream list(getenv("HPCE_ENSEMBLE_DT"));
+			dts.clear();
+			float x;
+			while(list>>x){
+				dts.push_back(x);
+			}
+			if(dts.size()!=worlds.size())
+				throw std::invalid_argument("HPCE_ENSEMBLE_DT should give one step size for each world.");
+		}
+
+		std::cerr<<"Stepping for n="<<n<<std::endl;
+		hpce::yl10313::StepWorldsV8Ensemble(worlds, dts, n);
+
+		for(unsigned i=0;i<worlds.size();i++){
+			hpce::SaveWorld(std::cout, worlds[i], binary);
+		}
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+#include "step_world_session.hpp"
+
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <limits>
+
+// Checks that frames rendered on the device are exactly what RenderWorld draws
+// on the host, including for temperatures that RenderWorld has to clamp.
+// Files are written to tmp/, which has to exist.
+
+static int failures=0;
+
+static void check(bool ok, const std::string &what)
+{
+	if(!ok){
+		std::cerr<<"  FAIL : "<<what<<"\n";
+		failures++;
+	}else{
+		std::cerr<<"  pass : "<<what<<"\n";
+	}
+}
+
+static std::string ReadFile(const std::string &fileName)
+{
+	std::ifstream src(fileName.c_str(), std::ios::in | std::ios::binary);
+	if(!src.is_open())
+		throw std::runtime_error("ReadFile : Couldn't open '"+fileName+"'.");
+	std::stringstream res;
+	res<<src.rdbuf();
+	return res.str();
+}
+
+//! A world with every kind of bad temperature mixed in with good ones and insulators
+static hpce::world_t BadWorld()
+{
+	const float inf=std::numeric_limits<float>::infinity();
+	const float nan=std::numeric_limits<float>::quiet_NaN();
+	const float values[]={ 1.5f, 0.25f, -0.5f, nan, 0.75f, inf, -inf, 1e30f, 0.5f, 1.0f, 0.0f };
+
+	hpce::world_t world;
+	world.w=41;
+	world.h=23;
+	world.alpha=0.1f;
+	world.t=0;
+	for(unsigned i=0;i<world.w*world.h;i++){
+		world.state.push_back(values[i%11]);
+		world.properties.push_back(i%13==5 ? hpce::Cell_Insulator : (hpce::cell_flags_t)0);
+	}
+	return world;
+}
+
+int main(int argc, char *argv[])
+{
+	try{
+		hpce::world_t world=BadWorld();
+		hpce::yl10313::step_session_t session(world, hpce::yl10313::StepOptionsFromEnv());
+
+		const struct{ unsigned w, h; hpce::downsample_filter_t filter; const char *name; } sizes[]={
+			{ 0, 0, hpce::Filter_Box, "full size" },
+			{ 13, 0, hpce::Filter_Box, "13 wide, box" },
+			{ 13, 0, hpce::Filter_Max, "13 wide, max" },
+			{ 7, 5, hpce::Filter_Max, "7x5, max" }
+		};
+
+		std::cerr<<"Device frames against RenderWorld, with temperatures outside [0,1]\n";
+		for(unsigned i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++){
+			hpce::yl10313::step_frame_t frame=session.RenderFrame(sizes[i].w, sizes[i].h, sizes[i].filter);
+			hpce::WriteBitmap("tmp/test_render_frames_device.bmp", frame.w, frame.h, &frame.scanlines[0]);
+			hpce::RenderWorld("tmp/test_render_frames_host.bmp", hpce::DownsampleWorld(world, sizes[i].w, sizes[i].h, sizes[i].filter));
+			check(ReadFile("tmp/test_render_frames_device.bmp")==ReadFile("tmp/test_render_frames_host.bmp"), sizes[i].name);
+		}
+	}catch(const std::exception &e){
+		std::cerr<<"Exception : "<<e.what()<<std::endl;
+		return 1;
+	}
+
+	if(failures){
+		std::cerr<<failures<<" checks failed.\n";
+		return 1;
+	}
+	std::cerr<<"All checks passed.\n";
+	return 0;
+}